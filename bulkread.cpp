@@ -0,0 +1,591 @@
+#include "bulkread.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+//! 受け取られずに溜められるファイル数
+static const std::size_t kCompletedQueueSize = 16;
+
+//! io_uring で同時に開いておくファイル数
+static const std::size_t kMaxOpenFiles = 16;
+
+//! io_uring に同時に発行する読み込み数
+static const unsigned kQueueDepth = 64;
+
+//! 1 回の読み込みの大きさ
+static const std::size_t kChunkSize = 1024 * 1024;
+
+//! 読み込み中と受け取られていないファイルの大きさの合計の上限
+static const std::size_t kMaxBufferedBytes = 256 * 1024 * 1024;
+
+//! 取り消しの user_data (読み込みの添字と重ならない)
+static const std::uint64_t kCancelTag = ~std::uint64_t(0);
+
+//! mmap した io_uring のキュー
+struct BulkReader::Uring {
+    int fd = -1;
+
+    void*         sqRing     = MAP_FAILED;
+    std::size_t   sqRingSize = 0;
+    void*         cqRing     = MAP_FAILED;
+    std::size_t   cqRingSize = 0;
+    void*         sqeArray   = MAP_FAILED;
+    std::size_t   sqeSize    = 0;
+    unsigned*     sqHead     = nullptr;
+    unsigned*     sqTail     = nullptr;
+    unsigned*     sqMask     = nullptr;
+    unsigned*     sqArray    = nullptr;
+    unsigned*     cqHead     = nullptr;
+    unsigned*     cqTail     = nullptr;
+    unsigned*     cqMask     = nullptr;
+    io_uring_sqe* sqes       = nullptr;
+    io_uring_cqe* cqes       = nullptr;
+
+    ~Uring()
+    {
+        if ( sqeArray != MAP_FAILED ) {
+            munmap(sqeArray, sqeSize);
+        }
+        if ( cqRing != MAP_FAILED ) {
+            munmap(cqRing, cqRingSize);
+        }
+        if ( sqRing != MAP_FAILED ) {
+            munmap(sqRing, sqRingSize);
+        }
+        if ( fd >= 0 ) {
+            close(fd);
+        }
+    }
+
+    //! @return 成功なら true
+    bool setup(unsigned entries)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+
+        fd = int(syscall(__NR_io_uring_setup, entries, &params));
+        if ( fd < 0 ) {
+            return false;
+        }
+
+        int prot   = PROT_READ | PROT_WRITE;
+        int flags  = MAP_SHARED | MAP_POPULATE;
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqeSize    = params.sq_entries * sizeof(io_uring_sqe);
+        sqRing     = mmap(nullptr, sqRingSize, prot, flags, fd, IORING_OFF_SQ_RING);
+        cqRing     = mmap(nullptr, cqRingSize, prot, flags, fd, IORING_OFF_CQ_RING);
+        sqeArray   = mmap(nullptr, sqeSize, prot, flags, fd, IORING_OFF_SQES);
+        if ( sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeArray == MAP_FAILED ) {
+            return false;
+        }
+
+        std::uint8_t* sq = static_cast<std::uint8_t*>(sqRing);
+        std::uint8_t* cq = static_cast<std::uint8_t*>(cqRing);
+        sqHead           = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail           = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask           = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray          = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cqHead           = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail           = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask           = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes             = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sqes             = static_cast<io_uring_sqe*>(sqeArray);
+        return true;
+    }
+
+    //! 読み込みを 1 つ積む (io_uring_enter() するまで発行されない)
+    void
+    prepareRead(int fileFd, void* dest, std::size_t size, std::size_t offset, std::uint64_t tag)
+    {
+        unsigned      tail  = *sqTail;
+        unsigned      index = tail & *sqMask;
+        io_uring_sqe& sqe   = sqes[index];
+
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode    = IORING_OP_READ;
+        sqe.fd        = fileFd;
+        sqe.addr      = reinterpret_cast<std::uint64_t>(dest);
+        sqe.len       = unsigned(size);
+        sqe.off       = offset;
+        sqe.user_data = tag;
+
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    //! 発行中の読み込み target を取り消す要求を 1 つ積む
+    void prepareCancel(std::uint64_t target)
+    {
+        unsigned      tail  = *sqTail;
+        unsigned      index = tail & *sqMask;
+        io_uring_sqe& sqe   = sqes[index];
+
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe.fd        = -1;
+        sqe.addr      = target;
+        sqe.user_data = kCancelTag;
+
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    //! 積んだ読み込み tags を取り消し、すべて完了するまで待つ
+    //!
+    //! @return 待ちきれなければ false (読み込み先がまだ書き換えられるかもしれない)
+    //!
+    //! カーネルは io_uring を閉じても発行中の読み込みを非同期に片付けるので、
+    //! 読み込み先を解放する前に呼ぶ。
+    bool cancel(std::vector<std::uint64_t> tags)
+    {
+        // まだ発行されていないものは取り下げる
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        for ( unsigned i = head; i != *sqTail; i += 1 ) {
+            std::uint64_t tag = sqes[sqArray[i & *sqMask]].user_data;
+            tags.erase(std::remove(tags.begin(), tags.end(), tag), tags.end());
+        }
+        __atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+
+        for ( std::uint64_t tag : tags ) {
+            prepareCancel(tag);
+        }
+
+        // 取り消せたものも -ECANCELED で完了する
+        std::size_t nPending = tags.size();
+        while ( nPending > 0 ) {
+            unsigned nSubmit = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            if ( submitAndWait(nSubmit) ) {
+                return false;
+            }
+            reap([&](std::uint64_t tag, int) {
+                if ( tag != kCancelTag ) {
+                    nPending -= 1;
+                }
+            });
+        }
+        return true;
+    }
+
+    //! nSubmit 個を発行して、少なくとも 1 つ完了するまで待つ
+    //!
+    //! @return 成功なら 0、失敗なら errno
+    int submitAndWait(unsigned nSubmit)
+    {
+        while ( true ) {
+            long ret = syscall(
+                __NR_io_uring_enter, fd, nSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0
+            );
+            if ( ret >= 0 ) {
+                return 0;
+            }
+            if ( errno != EINTR ) {
+                return errno;
+            }
+        }
+    }
+
+    //! 完了したものを列挙する
+    template <typename F>
+    void reap(F&& f)
+    {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for ( ; head != tail; head += 1 ) {
+            const io_uring_cqe& cqe = cqes[head & *cqMask];
+            f(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+};
+
+BulkReader::BulkReader(std::vector<std::string> paths, Backend backend)
+    : m_Paths(std::move(paths))
+    , m_Backend(backend)
+    , m_Completed(kCompletedQueueSize)
+{
+}
+
+BulkReader::~BulkReader()
+{
+    // 読み込み中なら止めて、受け取られなかったファイルを捨てる
+    m_Completed.close();
+    {
+        std::lock_guard<std::mutex> lock(m_BudgetMutex);
+        m_IsStopping = true;
+    }
+    m_BudgetChanged.notify_all();
+    if ( m_Thread.joinable() ) {
+        m_Thread.join();
+    }
+    BulkFile* file;
+    while ( m_Completed.pop(file) ) {
+        delete file;
+    }
+}
+
+bool BulkReader::start()
+{
+    if ( m_Backend != Backend::kRead ) {
+        m_Uring.reset(new Uring);
+        if ( m_Uring->setup(kQueueDepth) ) {
+            m_Backend = Backend::kUring;
+        } else if ( m_Backend == Backend::kUring ) {
+            m_Uring.reset();
+            return false;
+        } else {
+            m_Uring.reset();
+            m_Backend = Backend::kRead;
+        }
+    }
+
+    m_Thread = std::thread(&BulkReader::run, this);
+    return true;
+}
+
+bool BulkReader::next(std::unique_ptr<BulkFile>& file)
+{
+    BulkFile* completed;
+    if ( ! m_Completed.pop(completed) ) {
+        return false;
+    }
+    release(completed->data.size());
+    file.reset(completed);
+    return true;
+}
+
+bool BulkReader::reserve(std::size_t size, bool isWaiting)
+{
+    std::unique_lock<std::mutex> lock(m_BudgetMutex);
+    auto hasRoom = [&] {
+        return m_nBufferedBytes == 0 || m_nBufferedBytes + size <= kMaxBufferedBytes;
+    };
+    if ( isWaiting ) {
+        m_BudgetChanged.wait(lock, [&] { return m_IsStopping || hasRoom(); });
+    }
+    if ( m_IsStopping || ! hasRoom() ) {
+        return false;
+    }
+    m_nBufferedBytes += size;
+    return true;
+}
+
+void BulkReader::release(std::size_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_BudgetMutex);
+        m_nBufferedBytes -= size;
+    }
+    m_BudgetChanged.notify_all();
+}
+
+void BulkReader::shrink(BulkFile* file, std::size_t size)
+{
+    if ( size < file->data.size() ) {
+        release(file->data.size() - size);
+        file->data.resize(size);
+    }
+}
+
+bool BulkReader::complete(BulkFile* file)
+{
+    if ( ! m_Completed.push(file) ) {
+        delete file;
+        return false;
+    }
+    return true;
+}
+
+void BulkReader::run()
+{
+    std::size_t iFirst = 0;
+    traceThreadName("bulk read");
+    if ( m_Uring ) {
+        iFirst = uringReadAll();
+    }
+    readAll(iFirst);
+    m_Completed.close();
+}
+
+//! path を開いて大きさを調べる
+//!
+//! @return 成功ならファイル記述子、失敗なら -1 (file->error に errno)
+static int openBulkFile(BulkFile* file, std::size_t& size)
+{
+    int fd = open(file->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if ( fd < 0 ) {
+        file->error = errno;
+        return -1;
+    }
+
+    struct stat st;
+    if ( fstat(fd, &st) ) {
+        file->error = errno;
+        close(fd);
+        return -1;
+    }
+    size = std::size_t(st.st_size);
+
+    return fd;
+}
+
+void BulkReader::readAll(std::size_t iFirst)
+{
+    for ( std::size_t i = iFirst; i < m_Paths.size(); i += 1 ) {
+        BulkFile* file = new BulkFile;
+        file->path     = m_Paths[i];
+
+        std::size_t size = 0;
+        int         fd   = openBulkFile(file, size);
+        if ( fd >= 0 && ! reserve(size, true) ) {
+            close(fd);
+            delete file;
+            return;
+        }
+
+        TraceSpan span("read");
+        if ( fd >= 0 ) {
+            file->data.resize(size);
+            std::size_t offset = 0;
+            while ( offset < file->data.size() ) {
+                ssize_t n = read(fd, &file->data[offset], file->data.size() - offset);
+                if ( n < 0 && errno == EINTR ) {
+                    continue;
+                }
+                if ( n < 0 ) {
+                    file->error = errno;
+                    break;
+                }
+                if ( n == 0 ) {
+                    // 読んでいる間に短くなった
+                    shrink(file, offset);
+                    break;
+                }
+                offset += std::size_t(n);
+            }
+            close(fd);
+        }
+        span.setCount(std::int64_t(file->data.size()));
+        span.end();
+
+        if ( ! complete(file) ) {
+            return;
+        }
+    }
+}
+
+std::size_t BulkReader::uringReadAll()
+{
+    // 開いているファイル
+    struct OpenFile {
+        BulkFile*   file      = nullptr;
+        int         fd        = -1;
+        std::size_t submitted = 0; //!< 発行済みの大きさ
+        std::size_t end       = 0; //!< 読み込み中に短くなったら縮める
+        unsigned    nPending  = 0; //!< 発行中と再発行待ちの読み込み
+    };
+    // 発行中の読み込み (添字が user_data)
+    struct Request {
+        std::size_t iOpen;
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    std::vector<OpenFile>    openFiles(kMaxOpenFiles);
+    std::vector<Request>     requests(kQueueDepth);
+    std::vector<std::size_t> freeRequests;
+    std::vector<std::size_t> retryRequests;
+    std::size_t              iNext       = 0;
+    std::size_t              nInFlight   = 0;
+    bool                     isCancelled = false;
+
+    // 開いたが予約が空くのを待っているファイル
+    OpenFile    waiting;
+    std::size_t waitingSize = 0;
+
+    for ( std::size_t i = kQueueDepth; i > 0; i -= 1 ) {
+        freeRequests.push_back(i - 1);
+    }
+
+    while ( true ) {
+        // 空いているところにファイルを開く (大きさの合計が上限を超えるなら待たせる)
+        //
+        // 何も読んでいなければ、受け取られて予約が空くまで待つ。
+        bool isReading = nInFlight > 0;
+        for ( const OpenFile& openFile : openFiles ) {
+            isReading = isReading || openFile.file;
+        }
+        for ( OpenFile& openFile : openFiles ) {
+            while ( ! isCancelled && ! openFile.file ) {
+                if ( ! waiting.file ) {
+                    if ( iNext >= m_Paths.size() ) {
+                        break;
+                    }
+                    BulkFile* file = new BulkFile;
+                    file->path     = m_Paths[iNext];
+                    iNext += 1;
+
+                    int fd = openBulkFile(file, waitingSize);
+                    if ( fd < 0 || waitingSize == 0 ) {
+                        if ( fd >= 0 ) {
+                            close(fd);
+                        }
+                        isCancelled = ! complete(file);
+                        continue;
+                    }
+                    waiting.file = file;
+                    waiting.fd   = fd;
+                }
+                if ( ! reserve(waitingSize, ! isReading) ) {
+                    break;
+                }
+                isReading = true;
+
+                waiting.file->data.resize(waitingSize);
+                openFile     = waiting;
+                openFile.end = waitingSize;
+                waiting      = OpenFile {};
+            }
+        }
+
+        // 再発行待ちを先に、残りはファイルを順に分割して発行する
+        unsigned nSubmit = 0;
+        for ( std::size_t iRequest : retryRequests ) {
+            const Request& request = requests[iRequest];
+            OpenFile&      file    = openFiles[request.iOpen];
+            m_Uring->prepareRead(
+                file.fd, &file.file->data[request.offset], request.size, request.offset, iRequest
+            );
+            nSubmit += 1;
+        }
+        retryRequests.clear();
+        for ( std::size_t iOpen = 0; iOpen < openFiles.size() && ! isCancelled; iOpen += 1 ) {
+            OpenFile& file = openFiles[iOpen];
+            while ( file.file && ! file.file->error && file.submitted < file.end
+                    && ! freeRequests.empty() ) {
+                std::size_t iRequest = freeRequests.back();
+                std::size_t size     = std::min(kChunkSize, file.end - file.submitted);
+                freeRequests.pop_back();
+
+                requests[iRequest] = Request { iOpen, file.submitted, size };
+                m_Uring->prepareRead(
+                    file.fd, &file.file->data[file.submitted], size, file.submitted, iRequest
+                );
+                file.submitted += size;
+                file.nPending += 1;
+                nSubmit += 1;
+            }
+        }
+        nInFlight += nSubmit;
+
+        if ( nInFlight == 0 ) {
+            // 何も読んでいないのに待たせているファイルがあれば止められている
+            if ( waiting.file ) {
+                close(waiting.fd);
+                delete waiting.file;
+                isCancelled = true;
+            }
+            break;
+        }
+
+        int error = 0;
+        {
+            TraceSpan span("io_uring wait");
+            span.setCount(std::int64_t(nInFlight));
+            error = m_Uring->submitAndWait(nSubmit);
+        }
+        if ( error ) {
+            // 発行中の読み込みを取り消して完了を待ってから、領域を解放する
+            std::vector<bool> isFree(kQueueDepth, false);
+            for ( std::size_t iRequest : freeRequests ) {
+                isFree[iRequest] = true;
+            }
+            std::vector<std::uint64_t> tags;
+            for ( std::size_t iRequest = 0; iRequest < kQueueDepth; iRequest += 1 ) {
+                if ( ! isFree[iRequest] ) {
+                    tags.push_back(iRequest);
+                }
+            }
+            bool isDrained = m_Uring->cancel(std::move(tags));
+            m_Uring.reset();
+
+            if ( waiting.file ) {
+                close(waiting.fd);
+                waiting.file->error = error;
+                isCancelled         = isCancelled || ! complete(waiting.file);
+            }
+            for ( OpenFile& openFile : openFiles ) {
+                if ( openFile.file ) {
+                    close(openFile.fd);
+                    openFile.file->error = error;
+                    if ( isDrained ) {
+                        shrink(openFile.file, 0);
+                    } else {
+                        // 完了を待てなかった読み込みが書き込むかもしれないので、領域は解放しない
+                        auto* leaked = new std::vector<std::uint8_t>;
+                        leaked->swap(openFile.file->data);
+                        release(leaked->size());
+                    }
+                    isCancelled = isCancelled || ! complete(openFile.file);
+                }
+            }
+            return isCancelled ? m_Paths.size() : iNext;
+        }
+
+        m_Uring->reap([&](std::uint64_t iRequest, int res) {
+            Request&  request = requests[iRequest];
+            OpenFile& file    = openFiles[request.iOpen];
+            nInFlight -= 1;
+
+            if ( res == -EINTR || res == -EAGAIN ) {
+                retryRequests.push_back(iRequest);
+                return;
+            }
+            if ( res < 0 ) {
+                file.file->error = -res;
+            } else if ( res == 0 ) {
+                // 読み込み中に短くなった
+                file.end = std::min(file.end, request.offset);
+            } else if ( std::size_t(res) < request.size ) {
+                // 残りを読み直す
+                request.offset += std::size_t(res);
+                request.size -= std::size_t(res);
+                retryRequests.push_back(iRequest);
+                return;
+            }
+            file.nPending -= 1;
+            freeRequests.push_back(iRequest);
+        });
+
+        // 読み終わったファイルを渡す
+        for ( OpenFile& openFile : openFiles ) {
+            if ( ! openFile.file || openFile.nPending > 0 ) {
+                continue;
+            }
+            if ( ! openFile.file->error && ! isCancelled && openFile.submitted < openFile.end ) {
+                continue;
+            }
+
+            close(openFile.fd);
+            shrink(openFile.file, openFile.end);
+            if ( isCancelled ) {
+                delete openFile.file;
+            } else {
+                isCancelled = ! complete(openFile.file);
+            }
+            openFile = OpenFile {};
+        }
+    }
+
+    return isCancelled ? m_Paths.size() : iNext;
+}
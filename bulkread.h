@@ -0,0 +1,92 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ring.h"
+
+//! BulkReader が読み込んだファイル
+struct BulkFile {
+    std::string               path;
+    std::vector<std::uint8_t> data;
+    int                       error = 0; //!< 失敗したときの errno
+};
+
+//! 多数のファイルをまとめて先読みする
+//!
+//! 専用のスレッドで読み込み、読み終わったファイルから next() で受け取る (順序は保証しない)。
+//! io_uring が使えれば複数のファイルにまたがって多数の読み込みを同時に発行し、
+//! 使えなければ read(2) で順に読む。
+//! 受け取られていないファイルが溜まるか、その大きさの合計が上限を超えると読み込みを止める。
+class BulkReader {
+public:
+    enum Backend {
+        kAuto,  //!< io_uring が使えなければ read(2)
+        kUring,
+        kRead,
+    };
+
+    explicit BulkReader(std::vector<std::string> paths, Backend backend = Backend::kAuto);
+    ~BulkReader();
+
+    BulkReader(const BulkReader&)            = delete;
+    BulkReader& operator=(const BulkReader&) = delete;
+
+    //! 読み込みを始める
+    //!
+    //! @return 成功なら true (kUring で io_uring が使えなければ false)
+    bool start();
+
+    //! 次に読み終わったファイルを受け取る
+    //!
+    //! @return すべて受け取ったら false
+    bool next(std::unique_ptr<BulkFile>& file);
+
+    //! 実際に使っている読み込み方法
+    Backend backend() const { return m_Backend; }
+
+private:
+    std::vector<std::string> m_Paths;
+    Backend                  m_Backend;
+    SpscRing<BulkFile*>      m_Completed;
+    std::thread              m_Thread;
+
+    std::mutex              m_BudgetMutex;
+    std::condition_variable m_BudgetChanged;
+    std::size_t             m_nBufferedBytes = 0;     //!< 読み込み中と受け取られていないファイル
+    bool                    m_IsStopping     = false; //!< デストラクタが止めている
+
+    struct Uring;
+    std::unique_ptr<Uring> m_Uring;
+
+    void run();
+
+    //! read(2) で順に読む
+    void readAll(std::size_t iFirst);
+
+    //! io_uring で読む
+    //!
+    //! @return io_uring が使えなくなったら、まだ始めていない最初のパスの添字
+    std::size_t uringReadAll();
+
+    //! 読み終わったファイルを渡す。受け取る側が閉じていたら捨てて false を返す。
+    bool complete(BulkFile* file);
+
+    //! size バイトを読み込む領域を予約する
+    //!
+    //! 何も予約されていなければ上限を超えていても予約する。
+    //! isWaiting なら空くまで待ち、止められたら false を返す。待たなければ空いていないと false。
+    bool reserve(std::size_t size, bool isWaiting);
+
+    //! 予約を size バイト返す
+    void release(std::size_t size);
+
+    //! file の大きさを size に縮めて、縮めた分の予約を返す
+    void shrink(BulkFile* file, std::size_t size);
+};
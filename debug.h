@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "vidup.h"
+
+// vidup コマンドのデバッグ用 (C API には含めない)
+// VIDUP_DEBUG_COMMANDS をつけてビルドした vidup.cpp (vidup_debug.o) にだけある
+
+//! ファイル一覧を出力する
+//!
+//! @return exit code
+int debugFiles(vidup* handle);
+
+//! name のシーンを出力する
+//!
+//! @return exit code
+int debugFileScenes(vidup* handle, const char* name);
+
+//! name の保管庫からフレームを戻して標準出力に書き出す
+//!
+//! @return exit code
+int debugArchiveFrames(vidup* handle, const char* name, std::uint32_t iFirstFrame, int nFrames);
+
+//! intersectSorted() のマイクロベンチマーク
+//!
+//! @return 成功なら 0
+int benchIntersect();
+
+//! BulkReader の読み込み方法ごとの速さを比べる
+//!
+//! @return 成功なら 0
+int benchRead(const std::vector<std::string>& paths);
+
+//! シーン検出の方法ごとの速さと結果を比べる
+//!
+//! @return 成功して結果がすべて一致すれば 0
+int benchDetect(const char* path, int frameRate, int frameStride);
@@ -0,0 +1,398 @@
+#include "hnsw.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+
+static const char kMagic[8] = { 'V', 'H', 'N', 'S', 'W', '0', '0', '1' };
+
+HnswIndex::HnswIndex(std::size_t dimension, std::size_t m, std::size_t efConstruction)
+    : m_Dimension(dimension)
+    , m_M(m)
+    , m_MaxM0(m * 2)
+    , m_EfConstruction(efConstruction)
+    , m_LevelMultiplier(1.0 / std::log(double(m)))
+{
+}
+
+float HnswIndex::distance(const float* a, const float* b) const
+{
+    float sum = 0;
+    for ( std::size_t i = 0; i < m_Dimension; i += 1 ) {
+        float delta = a[i] - b[i];
+        sum += delta * delta;
+    }
+    return sum;
+}
+
+int HnswIndex::randomLevel()
+{
+    // xorshift64*
+    m_RandomState ^= m_RandomState >> 12;
+    m_RandomState ^= m_RandomState << 25;
+    m_RandomState ^= m_RandomState >> 27;
+    std::uint64_t random = m_RandomState * 0x2545F4914F6CDD1Dull;
+
+    double uniform = (double(random >> 11) + 0.5) / double(std::uint64_t(1) << 53);
+    return int(-std::log(uniform) * m_LevelMultiplier);
+}
+
+bool HnswIndex::findNode(std::uint32_t label, NodeId& node) const
+{
+    auto it = m_NodeOfLabel.find(label);
+    if ( it == m_NodeOfLabel.end() ) {
+        return false;
+    }
+    node = it->second;
+    return true;
+}
+
+const float* HnswIndex::find(std::uint32_t label) const
+{
+    NodeId node;
+    if ( ! findNode(label, node) ) {
+        return nullptr;
+    }
+    return vectorOf(node);
+}
+
+std::vector<std::uint32_t> HnswIndex::labels() const
+{
+    std::vector<std::uint32_t> result;
+    for ( std::size_t i = 0; i < m_Labels.size(); i += 1 ) {
+        if ( ! m_Deleted[i] ) {
+            result.push_back(m_Labels[i]);
+        }
+    }
+    return result;
+}
+
+HnswIndex::NodeId
+HnswIndex::greedySearch(const float* query, NodeId entry, int fromLevel, int toLevel) const
+{
+    NodeId current     = entry;
+    float  currentDist = distance(query, vectorOf(current));
+
+    for ( int level = fromLevel; level > toLevel; level -= 1 ) {
+        bool changed = true;
+        while ( changed ) {
+            changed = false;
+            for ( NodeId neighbor : m_Links[current][level] ) {
+                float dist = distance(query, vectorOf(neighbor));
+                if ( dist < currentDist ) {
+                    current     = neighbor;
+                    currentDist = dist;
+                    changed     = true;
+                }
+            }
+        }
+    }
+
+    return current;
+}
+
+std::vector<HnswIndex::DistanceNode>
+HnswIndex::searchLayer(const float* query, NodeId entry, std::size_t ef, int level) const
+{
+    // candidates は近い順、results は遠い順に取り出す
+    std::priority_queue<DistanceNode, std::vector<DistanceNode>, std::greater<DistanceNode>>
+                                     candidates;
+    std::priority_queue<DistanceNode> results;
+    std::vector<bool>                 visited(m_Labels.size(), false);
+
+    float entryDist = distance(query, vectorOf(entry));
+    candidates.emplace(entryDist, entry);
+    results.emplace(entryDist, entry);
+    visited[entry] = true;
+
+    while ( ! candidates.empty() ) {
+        DistanceNode candidate = candidates.top();
+        if ( candidate.first > results.top().first && results.size() >= ef ) {
+            break;
+        }
+        candidates.pop();
+
+        for ( NodeId neighbor : m_Links[candidate.second][level] ) {
+            if ( visited[neighbor] ) {
+                continue;
+            }
+            visited[neighbor] = true;
+
+            float dist = distance(query, vectorOf(neighbor));
+            if ( results.size() < ef || dist < results.top().first ) {
+                candidates.emplace(dist, neighbor);
+                results.emplace(dist, neighbor);
+                if ( results.size() > ef ) {
+                    results.pop();
+                }
+            }
+        }
+    }
+
+    std::vector<DistanceNode> nearest(results.size());
+    for ( std::size_t i = nearest.size(); i > 0; i -= 1 ) {
+        nearest[i - 1] = results.top();
+        results.pop();
+    }
+    return nearest;
+}
+
+void HnswIndex::shrinkLinks(NodeId node, int level)
+{
+    std::vector<NodeId>& links    = m_Links[node][level];
+    std::size_t          maxLinks = level == 0 ? m_MaxM0 : m_M;
+    if ( links.size() <= maxLinks ) {
+        return;
+    }
+
+    // 近いものから残す
+    std::vector<DistanceNode> sorted;
+    for ( NodeId neighbor : links ) {
+        sorted.emplace_back(distance(vectorOf(node), vectorOf(neighbor)), neighbor);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    links.clear();
+    for ( std::size_t i = 0; i < maxLinks; i += 1 ) {
+        links.push_back(sorted[i].second);
+    }
+}
+
+void HnswIndex::add(std::uint32_t label, const float* vector)
+{
+    NodeId existing;
+    if ( findNode(label, existing) ) {
+        return;
+    }
+
+    NodeId node  = NodeId(m_Labels.size());
+    int    level = randomLevel();
+
+    m_Vectors.insert(m_Vectors.end(), vector, vector + m_Dimension);
+    m_Labels.push_back(label);
+    m_Deleted.push_back(0);
+    m_NodeOfLabel[label] = node;
+    m_Links.emplace_back(std::size_t(level + 1));
+
+    if ( m_MaxLevel < 0 ) {
+        m_EntryPoint = node;
+        m_MaxLevel   = level;
+        return;
+    }
+
+    const float* query = vectorOf(node);
+    NodeId       entry = greedySearch(query, m_EntryPoint, m_MaxLevel, level);
+
+    for ( int l = std::min(level, m_MaxLevel); l >= 0; l -= 1 ) {
+        std::vector<DistanceNode> nearest = searchLayer(query, entry, m_EfConstruction, l);
+
+        std::size_t maxLinks = l == 0 ? m_MaxM0 : m_M;
+        for ( std::size_t i = 0; i < nearest.size() && i < maxLinks; i += 1 ) {
+            NodeId neighbor = nearest[i].second;
+            m_Links[node][l].push_back(neighbor);
+            m_Links[neighbor][l].push_back(node);
+            shrinkLinks(neighbor, l);
+        }
+        entry = nearest.front().second;
+    }
+
+    if ( level > m_MaxLevel ) {
+        m_EntryPoint = node;
+        m_MaxLevel   = level;
+    }
+}
+
+bool HnswIndex::remove(std::uint32_t label)
+{
+    NodeId node;
+    if ( ! findNode(label, node) ) {
+        return false;
+    }
+
+    m_Deleted[node] = 1;
+    m_nDeleted += 1;
+    m_NodeOfLabel.erase(label);
+    return true;
+}
+
+std::vector<std::pair<float, std::uint32_t>>
+HnswIndex::search(const float* query, std::size_t k, std::size_t ef) const
+{
+    std::vector<std::pair<float, std::uint32_t>> result;
+    if ( m_MaxLevel < 0 ) {
+        return result;
+    }
+
+    NodeId entry = greedySearch(query, m_EntryPoint, m_MaxLevel, 0);
+
+    // 墓標は結果から除くので、k 件に足りなければ ef を広げて探し直す
+    ef = std::max(ef, k);
+    while ( true ) {
+        std::vector<DistanceNode> nearest = searchLayer(query, entry, ef, 0);
+
+        result.clear();
+        for ( const DistanceNode& node : nearest ) {
+            if ( m_Deleted[node.second] ) {
+                continue;
+            }
+            result.emplace_back(node.first, m_Labels[node.second]);
+            if ( result.size() >= k ) {
+                return result;
+            }
+        }
+        if ( nearest.size() < ef ) {
+            return result;
+        }
+        ef *= 2;
+    }
+}
+
+// 形式: magic dimension m efConstruction generation entryPoint maxLevel nNodes
+//       { label deleted nLevels vector { nLinks links } * nLevels } * nNodes
+bool HnswIndex::save(const char* path) const
+{
+    std::FILE* stream = std::fopen(path, "wb");
+    if ( ! stream ) {
+        return false;
+    }
+
+    auto write = [&](const void* p, std::size_t size) {
+        return std::fwrite(p, 1, size, stream) == size;
+    };
+
+    std::uint64_t dimension      = m_Dimension;
+    std::uint64_t m              = m_M;
+    std::uint64_t efConstruction = m_EfConstruction;
+    std::uint64_t nNodes         = m_Labels.size();
+    std::int32_t  maxLevel       = m_MaxLevel;
+
+    bool ok = write(kMagic, sizeof(kMagic)) && write(&dimension, sizeof(dimension))
+        && write(&m, sizeof(m)) && write(&efConstruction, sizeof(efConstruction))
+        && write(&m_Generation, sizeof(m_Generation)) && write(&m_EntryPoint, sizeof(m_EntryPoint))
+        && write(&maxLevel, sizeof(maxLevel)) && write(&nNodes, sizeof(nNodes));
+
+    for ( std::size_t i = 0; ok && i < m_Labels.size(); i += 1 ) {
+        std::uint32_t nLevels = std::uint32_t(m_Links[i].size());
+
+        ok = write(&m_Labels[i], sizeof(m_Labels[i])) && write(&m_Deleted[i], sizeof(m_Deleted[i]))
+            && write(&nLevels, sizeof(nLevels))
+            && write(vectorOf(NodeId(i)), m_Dimension * sizeof(float));
+        for ( std::uint32_t level = 0; ok && level < nLevels; level += 1 ) {
+            const std::vector<NodeId>& links  = m_Links[i][level];
+            std::uint32_t              nLinks = std::uint32_t(links.size());
+
+            ok = write(&nLinks, sizeof(nLinks)) && write(links.data(), nLinks * sizeof(NodeId));
+        }
+    }
+
+    if ( std::fclose(stream) ) {
+        ok = false;
+    }
+    return ok;
+}
+
+bool HnswIndex::load(const char* path)
+{
+    std::FILE* stream = std::fopen(path, "rb");
+    if ( ! stream ) {
+        return false;
+    }
+
+    // 壊れたファイルで大きな領域を確保しないように、読む前に残りのバイト数と比べる
+    std::uint64_t remaining = 0;
+    if ( std::fseek(stream, 0, SEEK_END) == 0 ) {
+        long end  = std::ftell(stream);
+        remaining = end > 0 ? std::uint64_t(end) : 0;
+    }
+    std::rewind(stream);
+
+    auto read = [&](void* p, std::size_t size) {
+        if ( size > remaining || std::fread(p, 1, size, stream) != size ) {
+            return false;
+        }
+        remaining -= size;
+        return true;
+    };
+
+    char          magic[sizeof(kMagic)];
+    std::uint64_t dimension      = 0;
+    std::uint64_t m              = 0;
+    std::uint64_t efConstruction = 0;
+    std::uint64_t nNodes         = 0;
+    std::int32_t  maxLevel       = -1;
+
+    // ラベル、墓標、レベル数、ベクトル
+    std::uint64_t nodeSize
+        = sizeof(std::uint32_t) + 1 + sizeof(std::uint32_t) + m_Dimension * sizeof(float);
+
+    bool ok = read(magic, sizeof(magic)) && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0
+        && read(&dimension, sizeof(dimension)) && dimension == m_Dimension && read(&m, sizeof(m))
+        && read(&efConstruction, sizeof(efConstruction))
+        && read(&m_Generation, sizeof(m_Generation)) && read(&m_EntryPoint, sizeof(m_EntryPoint))
+        && read(&maxLevel, sizeof(maxLevel)) && read(&nNodes, sizeof(nNodes)) && m >= 2
+        && maxLevel >= -1 && nNodes <= remaining / nodeSize && (nNodes == 0) == (maxLevel < 0)
+        && (nNodes == 0 || m_EntryPoint < nNodes);
+    if ( ok ) {
+        m_M               = m;
+        m_MaxM0           = m * 2;
+        m_EfConstruction  = efConstruction;
+        m_LevelMultiplier = 1.0 / std::log(double(m));
+        m_MaxLevel        = maxLevel;
+        m_nDeleted        = 0;
+        m_Vectors.resize(nNodes * m_Dimension);
+        m_Labels.resize(nNodes);
+        m_Deleted.resize(nNodes);
+        m_Links.assign(nNodes, {});
+        m_NodeOfLabel.clear();
+    }
+
+    for ( std::size_t i = 0; ok && i < nNodes; i += 1 ) {
+        std::uint32_t nLevels = 0;
+
+        ok = read(&m_Labels[i], sizeof(m_Labels[i])) && read(&m_Deleted[i], sizeof(m_Deleted[i]))
+            && read(&nLevels, sizeof(nLevels))
+            && read(&m_Vectors[i * m_Dimension], m_Dimension * sizeof(float)) && nLevels >= 1
+            && nLevels <= std::uint32_t(maxLevel) + 1;
+        if ( ! ok ) {
+            break;
+        }
+        if ( m_Deleted[i] ) {
+            m_nDeleted += 1;
+        } else {
+            m_NodeOfLabel[m_Labels[i]] = NodeId(i);
+        }
+        m_Links[i].resize(nLevels);
+        for ( std::uint32_t level = 0; ok && level < nLevels; level += 1 ) {
+            std::uint32_t nLinks = 0;
+
+            ok = read(&nLinks, sizeof(nLinks)) && nLinks <= remaining / sizeof(NodeId);
+            if ( ok ) {
+                m_Links[i][level].resize(nLinks);
+                ok = read(m_Links[i][level].data(), nLinks * sizeof(NodeId));
+            }
+        }
+    }
+
+    // 探索は入口から最上位のレベルをたどり、隣接ノードの同じレベルのリンクをたどる
+    if ( ok && nNodes > 0 ) {
+        ok = m_Links[m_EntryPoint].size() == std::size_t(maxLevel) + 1;
+    }
+    for ( std::size_t i = 0; ok && i < nNodes; i += 1 ) {
+        for ( std::size_t level = 0; ok && level < m_Links[i].size(); level += 1 ) {
+            for ( NodeId neighbor : m_Links[i][level] ) {
+                if ( neighbor >= nNodes || m_Links[neighbor].size() <= level ) {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    std::fclose(stream);
+    if ( ! ok ) {
+        *this = HnswIndex(m_Dimension);
+    }
+    return ok;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+//! 近似最近傍探索のグラフ (Hierarchical Navigable Small World)
+//!
+//! ノードは label (fileId など) で識別する。
+//! 削除は墓標で、探索ではたどるが結果には含めない。
+class HnswIndex {
+public:
+    HnswIndex(std::size_t dimension, std::size_t m = 16, std::size_t efConstruction = 100);
+
+    std::size_t dimension() const { return m_Dimension; }
+
+    //! 墓標を含むノード数
+    std::size_t size() const { return m_Labels.size(); }
+
+    std::size_t deletedCount() const { return m_nDeleted; }
+
+    //! 索引を作ったときの DB の世代
+    std::uint64_t generation() const { return m_Generation; }
+
+    void setGeneration(std::uint64_t generation) { m_Generation = generation; }
+
+    //! 削除されていない label を列挙する
+    std::vector<std::uint32_t> labels() const;
+
+    //! label を追加する。同じ label がすでにあれば何もしない。
+    void add(std::uint32_t label, const float* vector);
+
+    //! 削除されていない label のベクトル (なければ nullptr)
+    const float* find(std::uint32_t label) const;
+
+    //! @return 削除したら true
+    bool remove(std::uint32_t label);
+
+    //! query に近い k 個の (二乗距離, label) を近い順に返す
+    std::vector<std::pair<float, std::uint32_t>>
+    search(const float* query, std::size_t k, std::size_t ef) const;
+
+    //! @return 成功なら true
+    bool save(const char* path) const;
+
+    //! @return 成功なら true
+    bool load(const char* path);
+
+private:
+    typedef std::uint32_t            NodeId;
+    typedef std::pair<float, NodeId> DistanceNode;
+
+    std::size_t m_Dimension;
+    std::size_t m_M;              //!< レベル 1 以上のリンク数の上限
+    std::size_t m_MaxM0;          //!< レベル 0 のリンク数の上限
+    std::size_t m_EfConstruction;
+    double      m_LevelMultiplier;
+
+    std::uint64_t m_Generation  = 0;
+    NodeId        m_EntryPoint  = 0;
+    int           m_MaxLevel    = -1;
+    std::size_t   m_nDeleted    = 0;
+    std::uint64_t m_RandomState = 0x2545F4914F6CDD1Dull;
+
+    std::vector<float>                            m_Vectors; //!< size() * m_Dimension
+    std::vector<std::uint32_t>                    m_Labels;
+    std::vector<std::uint8_t>                     m_Deleted;
+    std::vector<std::vector<std::vector<NodeId>>> m_Links; //!< [node][level] の隣接ノード
+    std::unordered_map<std::uint32_t, NodeId>     m_NodeOfLabel; //!< 削除されていないノード
+
+    const float* vectorOf(NodeId node) const { return &m_Vectors[std::size_t(node) * m_Dimension]; }
+
+    float distance(const float* a, const float* b) const;
+    int   randomLevel();
+    bool  findNode(std::uint32_t label, NodeId& node) const;
+
+    NodeId greedySearch(const float* query, NodeId entry, int fromLevel, int toLevel) const;
+
+    //! level 上で query に近い ef 個のノードを近い順に返す
+    std::vector<DistanceNode>
+    searchLayer(const float* query, NodeId entry, std::size_t ef, int level) const;
+
+    void shrinkLinks(NodeId node, int level);
+};
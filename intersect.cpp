@@ -0,0 +1,181 @@
+#include "intersect.h"
+
+#include <immintrin.h>
+
+//! サイズ比がこれ以上ならギャロップ探索にする
+static const std::size_t kGallopingRatio = 32;
+
+//! [lower, size) から value 以上の最初の添字をギャロップ探索する
+static std::size_t
+gallop(const std::uint64_t* keys, std::size_t lower, std::size_t size, std::uint64_t value)
+{
+    // 指数的に範囲を広げてから二分探索
+    std::size_t step  = 1;
+    std::size_t upper = lower;
+    while ( upper < size && keys[upper] < value ) {
+        lower = upper + 1;
+        upper += step;
+        step *= 2;
+    }
+    if ( upper > size ) {
+        upper = size;
+    }
+
+    while ( lower < upper ) {
+        std::size_t middle = lower + (upper - lower) / 2;
+        if ( keys[middle] < value ) {
+            lower = middle + 1;
+        } else {
+            upper = middle;
+        }
+    }
+    return lower;
+}
+
+//! small の各要素を large からギャロップ探索する
+static std::size_t intersectGalloping(
+    const std::uint64_t* small,
+    std::size_t          nSmall,
+    const std::uint64_t* large,
+    std::size_t          nLarge,
+    std::uint32_t*       indicesSmall,
+    std::uint32_t*       indicesLarge
+)
+{
+    std::size_t n = 0;
+    std::size_t j = 0;
+    for ( std::size_t i = 0; i < nSmall && j < nLarge; i += 1 ) {
+        j = gallop(large, j, nLarge, small[i]);
+        if ( j < nLarge && large[j] == small[i] ) {
+            if ( indicesSmall ) {
+                indicesSmall[n] = std::uint32_t(i);
+            }
+            if ( indicesLarge ) {
+                indicesLarge[n] = std::uint32_t(j);
+            }
+            n += 1;
+            j += 1;
+        }
+    }
+    return n;
+}
+
+//! [i, na) と [j, nb) を単純にマージする
+static std::size_t intersectMerge(
+    const std::uint64_t* a,
+    std::size_t          i,
+    std::size_t          na,
+    const std::uint64_t* b,
+    std::size_t          j,
+    std::size_t          nb,
+    std::uint32_t*       indicesA,
+    std::uint32_t*       indicesB
+)
+{
+    std::size_t n = 0;
+    while ( i < na && j < nb ) {
+        if ( a[i] < b[j] ) {
+            i += 1;
+        } else if ( b[j] < a[i] ) {
+            j += 1;
+        } else {
+            if ( indicesA ) {
+                indicesA[n] = std::uint32_t(i);
+            }
+            if ( indicesB ) {
+                indicesB[n] = std::uint32_t(j);
+            }
+            n += 1;
+            i += 1;
+            j += 1;
+        }
+    }
+    return n;
+}
+
+std::size_t intersectSorted(
+    const std::uint64_t* a,
+    std::size_t          na,
+    const std::uint64_t* b,
+    std::size_t          nb,
+    std::uint32_t*       indicesA,
+    std::uint32_t*       indicesB
+)
+{
+    if ( na == 0 || nb == 0 ) {
+        return 0;
+    }
+    if ( nb / na >= kGallopingRatio ) {
+        return intersectGalloping(a, na, b, nb, indicesA, indicesB);
+    }
+    if ( na / nb >= kGallopingRatio ) {
+        return intersectGalloping(b, nb, a, na, indicesB, indicesA);
+    }
+
+    std::size_t n = 0;
+    std::size_t i = 0;
+    std::size_t j = 0;
+
+    // a の 4 要素と b の 4 要素を、b を回転させながら 4 回比較する
+    while ( i + 4 <= na && j + 4 <= nb ) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&a[i]));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&b[j]));
+
+        __m256i vb1 = _mm256_permute4x64_epi64(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        __m256i vb2 = _mm256_permute4x64_epi64(vb, _MM_SHUFFLE(1, 0, 3, 2));
+        __m256i vb3 = _mm256_permute4x64_epi64(vb, _MM_SHUFFLE(2, 1, 0, 3));
+        __m256i eq0 = _mm256_cmpeq_epi64(va, vb);
+        __m256i eq1 = _mm256_cmpeq_epi64(va, vb1);
+        __m256i eq2 = _mm256_cmpeq_epi64(va, vb2);
+        __m256i eq3 = _mm256_cmpeq_epi64(va, vb3);
+        __m256i eq  = _mm256_or_si256(_mm256_or_si256(eq0, eq1), _mm256_or_si256(eq2, eq3));
+
+        unsigned mask = unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(eq)));
+        if ( ! indicesA && ! indicesB ) {
+            n += _mm_popcnt_u32(mask);
+        } else if ( mask ) {
+            // 一致した要素の b 側の添字はスカラーで求める (ブロック内で昇順)
+            std::size_t jj = j;
+            while ( mask ) {
+                std::size_t ii = i + _tzcnt_u32(mask);
+                if ( indicesA ) {
+                    indicesA[n] = std::uint32_t(ii);
+                }
+                if ( indicesB ) {
+                    while ( b[jj] != a[ii] ) {
+                        jj += 1;
+                    }
+                    indicesB[n] = std::uint32_t(jj);
+                }
+                n += 1;
+                mask &= mask - 1;
+            }
+        }
+
+        std::uint64_t aMax = a[i + 3];
+        std::uint64_t bMax = b[j + 3];
+        if ( aMax <= bMax ) {
+            i += 4;
+        }
+        if ( bMax <= aMax ) {
+            j += 4;
+        }
+    }
+
+    // 残りはマージ
+    std::uint32_t* restA = indicesA ? indicesA + n : nullptr;
+    std::uint32_t* restB = indicesB ? indicesB + n : nullptr;
+    return n + intersectMerge(a, i, na, b, j, nb, restA, restB);
+}
+
+std::size_t intersectSortedScalar(
+    const std::uint64_t* a,
+    std::size_t          na,
+    const std::uint64_t* b,
+    std::size_t          nb,
+    std::uint32_t*       indicesA,
+    std::uint32_t*       indicesB
+)
+{
+    return intersectMerge(a, 0, na, b, 0, nb, indicesA, indicesB);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//! ソート済みで重複のない 64-bit キー列の積集合を求める
+//!
+//! @return 共通要素の数
+//!
+//! 一致した要素の a, b 内の添字を昇順に indicesA, indicesB に書き込む (nullptr なら書き込まない)。
+//! それぞれ min(na, nb) 要素分の領域が必要。
+//!
+//! サイズの偏りが大きい場合は小さい方の各要素で大きい方をギャロップ探索し、
+//! それ以外は AVX2 で 4x4 要素ずつ総当たり比較する。
+std::size_t intersectSorted(
+    const std::uint64_t* a,
+    std::size_t          na,
+    const std::uint64_t* b,
+    std::size_t          nb,
+    std::uint32_t*       indicesA,
+    std::uint32_t*       indicesB
+);
+
+//! intersectSorted() の比較用の単純なマージ
+std::size_t intersectSortedScalar(
+    const std::uint64_t* a,
+    std::size_t          na,
+    const std::uint64_t* b,
+    std::size_t          nb,
+    std::uint32_t*       indicesA,
+    std::uint32_t*       indicesB
+);
@@ -1,947 +1,245 @@
 #include <algorithm>
-#include <cmath>
-#include <cstdarg>
+#include <cerrno>
+#include <csignal>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <filesystem>
-#include <map>
-#include <set>
+#include <functional>
+#include <limits>
+#include <memory>
 #include <string>
 #include <vector>
 
-#include <immintrin.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
 
-#include <sqlite3.h>
+#include "bulkread.h"
+#include "debug.h"
+#include "vidup.h"
+#include "watch.h"
 
 namespace fs = std::filesystem;
 
-typedef std::uint32_t Hash;
-typedef std::uint32_t DurationMs;
-typedef int           FileId; //!< 未設定は -1
+static const std::size_t kFrameSize = VIDUP_FRAME_SIZE;
 
-//! シーンを一意に識別するための値
-struct SceneId {
-    Hash       hash;
-    DurationMs durationMs;
-};
-
-static inline bool operator<(const SceneId& a, const SceneId& b)
-{
-    if ( a.hash != b.hash ) {
-        return a.hash < b.hash;
-    } else {
-        return a.durationMs < b.durationMs;
-    };
-}
-
-struct Scene {
-    SceneId sceneId;
-    FileId  fileId;
-};
-
-//! getTopHashes() の出力
-struct HashCount {
-    SceneId sceneId;
-    int     count;
-};
-
-enum FileStatus {
-    kNone     = 0,
-    kAnalyzed = 1,
-};
-
-struct FileEntry {
-    FileId   id;
-    fs::path name;
-    int      status; //!< FileStatus
-};
-
-//! gray 16x16px
-static const std::size_t kFrameSize             = 16 * 16;
-static const double      kSceneChangedThreshold = 4.5;
-
-static bool g_isVerbose = false;
-
-// TODO: use CLMUL
-static std::uint32_t
-crc32acc(std::uint32_t acc, std::size_t size, const std::uint8_t* __restrict buf)
-{
-    std::uint64_t acc64 = acc;
-    std::size_t   i     = 0;
-    for ( ; i + 8 <= size; i += sizeof(std::uint64_t) ) {
-        acc64 = _mm_crc32_u64(acc64, *reinterpret_cast<const std::uint64_t*>(&buf[i]));
-    }
-    acc = std::uint32_t(acc64);
-    for ( ; i < size; i += 1 ) {
-        acc = _mm_crc32_u8(acc, buf[i]);
-    }
-    return acc;
-}
-
-//! root mean squared error
-static double rmse(const std::uint8_t* __restrict frame1, const std::uint8_t* __restrict frame2)
-{
-    // 8-bit の自乗なので 16-bit、kFrameSize が 16-bit 以下ならオーバーフローしない
-    std::uint32_t rse = 0;
-    for ( std::size_t i = 0; i < kFrameSize; i += 1 ) {
-        std::int16_t delta = std::int16_t(frame1[i]) - frame2[i];
-        rse += delta * delta;
-    }
-
-    // divide by kFrameSize*gray
-    return std::sqrt(float(rse) / (kFrameSize * 256));
-}
-
-static bool readFrame(std::FILE* stream, std::uint8_t* __restrict dest)
-{
-    if ( std::fread(dest, 1, kFrameSize, stream) != kFrameSize ) {
-        return false;
-    }
-
-    // dithering
-    for ( std::size_t i = 0; i < kFrameSize; i += 1 ) {
-        dest[i] = dest[i] & 0xF0;
-    }
-
-    return true;
-}
-
-static void debugPrintf(const char* __restrict format, ...)
-{
-    if ( ! g_isVerbose ) {
-        return;
-    }
-    va_list arg;
-    va_start(arg, format);
-    std::vfprintf(stderr, format, arg);
-    va_end(arg);
-}
-
-//! foreign keys を有効化する
-//!
-//! @return 成功なら 0
-//!
-//! 失敗した場合は標準エラーにメッセージを出力する。
-static int enableForeignKeys(sqlite3* db)
-{
-    sqlite3_stmt* stmt   = nullptr;
-    int           status = sqlite3_prepare_v2(db, "PRAGMA foreign_keys = ON", -1, &stmt, nullptr);
-    if ( status ) {
-        std::fprintf(stderr, "PRAGMA foreign_keys = ON: %s\n", sqlite3_errmsg(db));
-        return 1;
-    }
-
-    status = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "PRAGMA foreign_keys = ON: %s\n", sqlite3_errmsg(db));
-        return 1;
-    }
-
-    return 0;
-}
-
-//! テーブルを作成する
-//!
-//! @return 成功なら 0
-static int createTables(sqlite3* db)
-{
-    sqlite3_stmt* stmt = nullptr;
-    int           status;
-
-    // create database files
-    status = sqlite3_prepare_v2(
-        db,
-        "CREATE TABLE IF NOT EXISTS files("
-        "id INTEGER PRIMARY KEY,"
-        "path TEXT UNIQUE,"
-        "status INTEGER"
-        ")",
-        -1,
-        &stmt,
-        nullptr
-    );
-    if ( status ) {
-        std::fprintf(stderr, "CREATE TABLE files: %s\n", sqlite3_errmsg(db));
-        return 1;
-    }
-
-    status = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "CREATE TABLE files: %s\n", sqlite3_errmsg(db));
-        return 1;
-    }
-
-    // create database scenes
-    status = sqlite3_prepare_v2(
-        db,
-        "CREATE TABLE IF NOT EXISTS scenes("
-        "hash INTEGER,"
-        "duration_ms INTEGER,"
-        "file_id INTEGER,"
-        "FOREIGN KEY (file_id) REFERENCES files(id) ON DELETE CASCADE"
-        ")",
-        -1,
-        &stmt,
-        nullptr
-    );
-    if ( status ) {
-        std::fprintf(stderr, "CREATE TABLE scenes: %s\n", sqlite3_errmsg(db));
-        return 1;
-    }
-
-    status = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "CREATE TABLE scenes: %s\n", sqlite3_errmsg(db));
-        return 1;
-    }
-
-    // craete index scene_hash
-    status = sqlite3_prepare_v2(
-        db,
-        "CREATE INDEX IF NOT EXISTS scene_hash_duration ON scenes(hash, duration_ms);",
-        -1,
-        &stmt,
-        nullptr
-    );
-    if ( status ) {
-        std::fprintf(stderr, "CREATE INDEX scene_hash_duration: %s\n", sqlite3_errmsg(db));
-        return 1;
-    }
-
-    status = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "CREATE INDEX scene_hash_duration: %s\n", sqlite3_errmsg(db));
-        return 1;
-    }
-
-    // create index scene_file_id
-    status = sqlite3_prepare_v2(
-        db, "CREATE INDEX IF NOT EXISTS scene_file_id ON scenes(file_id)", -1, &stmt, nullptr
-    );
-    if ( status ) {
-        std::fprintf(stderr, "CREATE INDEX scene_file_id: %s\n", sqlite3_errmsg(db));
-        return 1;
-    }
-
-    status = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "CREATE INDEX scene_file_id: %s\n", sqlite3_errmsg(db));
-        return 1;
-    }
-
-    return 0;
-}
-
-//! name からファイルの情報を取得する
-//!
-//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
-//!
-//! 失敗した場合、entry.id には -1 が入る。
-static int getFileEntry(sqlite3* db, const fs::path& name, FileEntry& entry)
-{
-    sqlite3_stmt* stmt = nullptr;
-    int           status;
-
-    entry.id = -1;
-
-    status
-        = sqlite3_prepare_v2(db, "SELECT id, status FROM files WHERE path = ?", -1, &stmt, nullptr);
-    if ( status ) {
-        std::fprintf(stderr, "SELECT id from files: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_bind_text(stmt, 1, name.c_str(), -1, nullptr);
-    if ( status ) {
-        std::fprintf(stderr, "SELECT id from files: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_step(stmt);
-    if ( status == SQLITE_DONE ) {
-        sqlite3_finalize(stmt);
-        return 0;
-    } else if ( status != SQLITE_ROW ) {
-        std::fprintf(stderr, "SELECT id from files: %d\n", status);
-        sqlite3_finalize(stmt);
-        return status;
-    }
-
-    entry.id     = sqlite3_column_int(stmt, 0);
-    entry.name   = name;
-    entry.status = sqlite3_column_int(stmt, 1);
-
-    sqlite3_finalize(stmt);
-    return 0;
-}
-
-//! fileId からファイル名を取得する
-//!
-//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
-static int getFileName(sqlite3* db, FileId fileId, fs::path& name)
-{
-    sqlite3_stmt* stmt = nullptr;
-    int           status;
-
-    status = sqlite3_prepare_v2(db, "SELECT path FROM files WHERE id = ?", -1, &stmt, nullptr);
-    if ( status ) {
-        std::fprintf(stderr, "SELECT path from files: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_bind_int(stmt, 1, fileId);
-    if ( status ) {
-        std::fprintf(stderr, "SELECT path from files: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_step(stmt);
-    if ( status == SQLITE_DONE ) {
-        name.clear();
-        sqlite3_finalize(stmt);
-        return 0;
-    } else if ( status != SQLITE_ROW ) {
-        std::fprintf(stderr, "SELECT path from files: %d\n", status);
-        name.clear();
-        sqlite3_finalize(stmt);
-        return status;
-    }
-
-    name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-
-    sqlite3_finalize(stmt);
-    return 0;
-}
-
-//! fileId のシーンを取得する
-//!
-//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
-//!
-//! scenes はクリアされず追記される。
-static int getScenesByFile(sqlite3* db, FileId fileId, std::vector<Scene>& scenes)
-{
-    sqlite3_stmt* stmt = nullptr;
-    int           status;
-
-    status = sqlite3_prepare_v2(
-        db, "SELECT hash, duration_ms FROM scenes WHERE file_id = ?", -1, &stmt, nullptr
-    );
-    if ( status ) {
-        std::fprintf(stderr, "getScenesByFile: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_bind_int(stmt, 1, fileId);
-    if ( status ) {
-        std::fprintf(stderr, "getScenesByFile: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_step(stmt);
-    while ( status == SQLITE_ROW ) {
-        Hash       hash       = sqlite3_column_int(stmt, 0);
-        DurationMs durationMs = sqlite3_column_int(stmt, 1);
-
-        scenes.emplace_back(Scene { SceneId { hash, durationMs }, fileId });
-        status = sqlite3_step(stmt);
-    }
-    sqlite3_finalize(stmt);
-
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "getScenesByFile: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    return 0;
-}
-
-//! hash のシーンを取得する
-//!
-//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
-//!
-//! scenes はクリアされず追記される。
-static int getScenesByHash(sqlite3* db, const SceneId& sceneId, std::vector<Scene>& scenes)
-{
-    sqlite3_stmt* stmt = nullptr;
-    int           status;
-
-    status = sqlite3_prepare_v2(
-        db,
-        "SELECT DISTINCT file_id FROM scenes WHERE (hash = ? AND duration_ms = ?)",
-        -1,
-        &stmt,
-        nullptr
-    );
-    if ( status ) {
-        std::fprintf(stderr, "getScenesByHash: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_bind_int(stmt, 1, sceneId.hash);
-    if ( status ) {
-        std::fprintf(stderr, "getScenesByHash: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-    status = sqlite3_bind_int(stmt, 2, sceneId.durationMs);
-    if ( status ) {
-        std::fprintf(stderr, "getScenesByHash: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_step(stmt);
-    while ( status == SQLITE_ROW ) {
-        FileId fileId = sqlite3_column_int(stmt, 0);
-
-        scenes.emplace_back(Scene { sceneId, fileId });
-        status = sqlite3_step(stmt);
-    }
-    sqlite3_finalize(stmt);
-
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "getScenesByHash: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
+//! --stream で何本ごとにコミットするか (入力が途切れたときもコミットする)
+static const int kStreamCommitInterval = 64;
 
-    return 0;
-}
-
-//! 重複したハッシュの上位を取得する
-//!
-//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
-//!
-//! hashCounts はクリア後にカウントされる。
-//! hashCounts は duration の降順でソートされている。
-static int getTopHashes(sqlite3* db, int limit, std::vector<HashCount>& hashCounts)
-{
-    sqlite3_stmt* stmt = nullptr;
-    int           status;
-
-    hashCounts.clear();
-
-    status = sqlite3_prepare_v2(
-        db,
-        "SELECT hash, duration_ms, COUNT(hash)"
-        " FROM scenes"
-        " GROUP BY hash, duration_ms"
-        " HAVING COUNT(hash) > 1"
-        " ORDER BY duration_ms DESC"
-        " LIMIT ?",
-        -1,
-        &stmt,
-        nullptr
-    );
-    if ( status ) {
-        std::fprintf(stderr, "getTopHashes: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_bind_int(stmt, 1, limit);
-    if ( status ) {
-        std::fprintf(stderr, "getTopHashes: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
+//! --stream の各動画の先頭行の識別子
+static const char kStreamMagic[] = "VIDUP1";
 
-    status = sqlite3_step(stmt);
-    while ( status == SQLITE_ROW ) {
-        Hash       hash       = sqlite3_column_int(stmt, 0);
-        DurationMs durationMs = sqlite3_column_int(stmt, 1);
-        int        count      = sqlite3_column_int(stmt, 2);
+//! --stream の入力のバッファのバイト数
+static const std::size_t kStreamBufferSize = 64 * 1024;
 
-        hashCounts.emplace_back(HashCount { SceneId { hash, durationMs }, count });
-        status = sqlite3_step(stmt);
-    }
-    sqlite3_finalize(stmt);
-
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "getTopHashes: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
+//! 受け取った SIGINT か SIGTERM (受け取っていなければ 0)
+static volatile std::sig_atomic_t g_Signal = 0;
 
-    return 0;
-}
+//! シグナルを受け取ったら止めるハンドル
+static vidup* g_InterruptedHandle = nullptr;
 
-//! name を DB に登録する
-//!
-//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
-static int registerFile(sqlite3* db, const fs::path& name)
+//! 進めている登録を止めさせる
+static void onSignal(int signal)
 {
-    sqlite3_stmt* stmt = nullptr;
-    int           status;
-
-    status = sqlite3_prepare_v2(
-        db, "INSERT INTO files (path, status) VALUES (?, ?)", -1, &stmt, nullptr
-    );
-    if ( status ) {
-        std::fprintf(stderr, "INSERT INTO files: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_bind_text(stmt, 1, name.c_str(), -1, nullptr);
-    if ( status ) {
-        std::fprintf(stderr, "INSERT INTO files: %s\n", sqlite3_errmsg(db));
-        return status;
+    g_Signal = signal;
+    if ( g_InterruptedHandle ) {
+        vidup_interrupt(g_InterruptedHandle);
     }
-
-    status = sqlite3_bind_int(stmt, 2, FileStatus::kNone);
-    if ( status ) {
-        std::fprintf(stderr, "INSERT INTO files: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "INSERT INTO files: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    return 0;
 }
 
-//! status を DB に登録する
+//! SIGINT と SIGTERM で handle の登録を止めて、止まったところまでを保存させる
 //!
-//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
-static int updateFileStatus(sqlite3* db, FileId fileId, FileStatus fileStatus)
+//! 読み込みを待っている間にも止められるように SA_RESTART はつけない。
+//! 2 回目のシグナルはデフォルトの動作なので、すぐに終了させられる。
+static void interruptOnSignals(vidup* handle)
 {
-    sqlite3_stmt* stmt = nullptr;
-    int           status;
-
-    status = sqlite3_prepare_v2(db, "UPDATE files SET status = ? WHERE id = ?", -1, &stmt, nullptr);
-    if ( status ) {
-        std::fprintf(stderr, "updateFileStatus: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_bind_int(stmt, 1, fileStatus);
-    if ( status ) {
-        std::fprintf(stderr, "updateFileStatus: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_bind_int(stmt, 2, fileId);
-    if ( status ) {
-        std::fprintf(stderr, "updateFileStatus: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "updateFileStatus: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    return 0;
+    g_InterruptedHandle = handle;
+
+    struct sigaction action {};
+    action.sa_handler = onSignal;
+    action.sa_flags   = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
 }
 
-//! scene を DB に登録する
-//!
-//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
-static int registerScene(sqlite3* db, const Scene& scene)
+//! シグナルで止めたときの exit code
+static int interruptedExitCode()
 {
-    sqlite3_stmt* stmt = nullptr;
-    int           status;
-
-    status = sqlite3_prepare_v2(
-        db, "INSERT INTO scenes (hash, duration_ms, file_id) VALUES (?, ?, ?)", -1, &stmt, nullptr
-    );
-    if ( status ) {
-        std::fprintf(stderr, "INSERT INTO scenes: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_bind_int(stmt, 1, scene.sceneId.hash);
-    if ( status ) {
-        std::fprintf(stderr, "INSERT INTO scenes: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-    status = sqlite3_bind_int(stmt, 2, scene.sceneId.durationMs);
-    if ( status ) {
-        std::fprintf(stderr, "INSERT INTO scenes: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-    status = sqlite3_bind_int(stmt, 3, scene.fileId);
-    if ( status ) {
-        std::fprintf(stderr, "INSERT INTO scenes: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "INSERT INTO scenes: %d\n", status);
-        return status;
-    }
-
-    return 0;
-}
-
-//! ファイルを DB から削除する
-//!
-//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
-//!
-//! ファイルに紐づくシーンもすべて削除される。
-static int deleteFile(sqlite3* db, FileId fileId)
-{
-    sqlite3_stmt* stmt = nullptr;
-    int           status;
-
-    status = sqlite3_prepare_v2(db, "DELETE FROM files WHERE id = ?", -1, &stmt, nullptr);
-    if ( status ) {
-        std::fprintf(stderr, "DELETE FROM files: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_bind_int(stmt, 1, fileId);
-    if ( status ) {
-        std::fprintf(stderr, "DELETE FROM files: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    status = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "DELETE FROM files: %s\n", sqlite3_errmsg(db));
-        return status;
-    }
-
-    return 0;
+    return 128 + g_Signal;
 }
 
-//! シーンを解析して DB に登録する
+//! fd を read(2) で読むバッファつきの入力 (--stream)
 //!
-//! @return 成功なら 0
-static int analyzeScenes(sqlite3* db, std::FILE* inStream, FileId fileId, int frameRate)
-{
-    std::uint8_t  frames[kFrameSize * 3] = { 0 };
-    std::uint8_t* firstFrame             = &frames[kFrameSize * 0];
-    std::uint8_t* lastFrame              = &frames[kFrameSize * 1];
-    std::uint8_t* frame                  = &frames[kFrameSize * 2];
-    Hash          crc                    = 0;
-    std::uint32_t nScenes                = 0;
-
-    std::uint32_t i           = 0;
-    std::uint32_t iFirstFrame = 0;
-
-    while ( readFrame(inStream, frame) ) {
-        double error = rmse(frame, lastFrame);
-        debugPrintf("%8d (%6.1f): %6.1f: %08X", i, double(i) / frameRate, error, crc);
-        if ( error > kSceneChangedThreshold ) {
-            // scene changed
-            if ( i > 0 ) {
-                debugPrintf(" scene changed\n");
-                DurationMs durationMs = (i - iFirstFrame) * 1000 / frameRate;
-                if ( db && registerScene(db, { { crc, durationMs }, fileId }) ) {
-                    return 1;
-                }
-            } else {
-                debugPrintf("\n");
-            }
-            crc = 0;
-            nScenes += 1;
-            iFirstFrame = i;
-            std::memcpy(firstFrame, frame, kFrameSize);
-        } else {
-            debugPrintf("\n");
-        }
-
-        crc = crc32acc(crc, kFrameSize, frame);
-        std::swap(lastFrame, frame);
-
-        i += 1;
-    }
-
+//! バッファに残っているバイト数がわかるので、fd に何も来ていなくても待たずに読めるかを
+//! isIdle() で調べられる。シグナルで read(2) が EINTR で戻ったら、入力の終わりと同じに扱う。
+class StreamReader {
+public:
+    explicit StreamReader(int fd)
+        : m_Fd(fd)
+        , m_Buffer(kStreamBufferSize)
     {
-        DurationMs durationMs = (i - iFirstFrame) * 1000 / frameRate;
-        if ( db && registerScene(db, { { crc, durationMs }, fileId }) ) {
-            return 1;
-        }
-        nScenes += 1;
-    }
-
-    if ( db && updateFileStatus(db, fileId, FileStatus::kAnalyzed) ) {
-        return 1;
-    }
-
-    std::fprintf(stderr, "%d scenes registered.\n", nScenes);
-
-    return 0;
-}
-
-//! 各 fileId に含まれるシーンの数をカウントする
-//!
-//! @return 成功なら 0
-//!
-//! scenes は fileId でソートされていること。
-//!
-//! fileAndCounts はクリア後にカウントされる。
-static int
-countScenes(const std::vector<Scene>& scenes, std::vector<std::pair<FileId, int>>& fileAndCounts)
-{
-    fileAndCounts.clear();
-
-    auto lower = scenes.begin();
-    while ( lower != scenes.end() ) {
-        FileId fileId = lower->fileId;
-
-        lower = std::lower_bound(
-            lower,
-            scenes.end(),
-            Scene { { 0, 0 }, fileId },
-            [&](const Scene& a, const Scene& b) { return a.fileId < b.fileId; }
-        );
-        auto upper = std::upper_bound(
-            lower,
-            scenes.end(),
-            Scene { { 0, 0 }, fileId },
-            [&](const Scene& a, const Scene& b) { return a.fileId < b.fileId; }
-        );
-
-        fileAndCounts.emplace_back(std::pair(fileId, upper - lower));
-        lower = upper;
-    }
-
-    return 0;
-}
-
-//! 類似のファイルを検索する
-//!
-//! @return 成功なら 0
-static int searchFile(sqlite3* db, FileId fileId, int limit)
-{
-    std::vector<Scene> scenesOfFile;
-    std::vector<Scene> foundScenes;
-
-    // fileId のシーンを列挙
-    if ( getScenesByFile(db, fileId, scenesOfFile) ) {
-        return 1;
-    }
-
-    // fileId のシーンと同じハッシュを含むシーンを列挙
-    // TODO: SQL で COUNT すればいいのでは
-    for ( const auto& scene : scenesOfFile ) {
-        if ( getScenesByHash(db, scene.sceneId, foundScenes) ) {
-            return 1;
-        }
     }
 
-    // fileId でソート
-    std::sort(foundScenes.begin(), foundScenes.end(), [&](const Scene& a, const Scene& b) {
-        return a.fileId < b.fileId;
-    });
-
-    // シーンから fileId を削除
-    // fileId でソートされているので lower_bound, upper_bound が使える。
-    auto lower = std::lower_bound(
-        foundScenes.begin(),
-        foundScenes.end(),
-        Scene { { 0, 0 }, fileId },
-        [&](const Scene& a, const Scene& b) { return a.fileId < b.fileId; }
-    );
-    auto upper = std::upper_bound(
-        foundScenes.begin(),
-        foundScenes.end(),
-        Scene { { 0, 0 }, fileId },
-        [&](const Scene& a, const Scene& b) { return a.fileId < b.fileId; }
-    );
-    foundScenes.erase(lower, upper);
-
-    std::vector<std::pair<FileId, int>> fileAndCounts;
-
-    countScenes(foundScenes, fileAndCounts);
-
-    // カウントの多い順にソート
-    std::sort(fileAndCounts.begin(), fileAndCounts.end(), [&](const auto& a, const auto& b) {
-        return a.second > b.second;
-    });
-
-    // 上位 limit 件を出力
-    if ( fileAndCounts.empty() ) {
-        std::fprintf(stderr, "no duplicated videos.\n");
-        return 0;
-    }
-
-    int i = 0;
-    for ( const auto& fileAndCount : fileAndCounts ) {
-        fs::path name;
-
-        if ( getFileName(db, fileAndCount.first, name) ) {
-            return 1;
-        }
-
-        std::fprintf(stderr, "%8d %s\n", fileAndCount.second, name.c_str());
-
-        i += 1;
-        if ( i >= limit ) {
-            break;
-        }
-    }
-
-    return 0;
-}
-
-//! 類似のシーン上位 limit 件を出力する
-//!
-//! @return 成功なら 0
-static int top(sqlite3* db, int limit)
-{
-    std::vector<HashCount> hashCounts;
-
-    if ( getTopHashes(db, limit, hashCounts) ) {
-        return 1;
-    }
-
-    // hashCounts と同じハッシュを含むシーンを列挙
-    std::vector<Scene> foundScenes;
-    for ( const HashCount& hashCount : hashCounts ) {
-        if ( getScenesByHash(db, hashCount.sceneId, foundScenes) ) {
-            return 1;
-        }
-
-        // 同じシーンを含むファイル名を列挙
-        debugPrintf("---- %8.1f seconds matched\n", hashCount.sceneId.durationMs / 1000.0);
-    }
-
-    // ファイルを列挙
-    std::set<FileId>           fileIds;
-    std::map<FileId, fs::path> fileNames;
-
-    for ( const Scene& scene : foundScenes ) {
-        fileIds.insert(scene.fileId);
-    }
-    for ( FileId fileId : fileIds ) {
-        fs::path name;
-        if ( getFileName(db, fileId, name) ) {
-            return 1;
+    //! 待たずに読めるデータがなければ true
+    bool isIdle() const
+    {
+        if ( m_iBegin < m_iEnd ) {
+            return false;
         }
-        fileNames[fileId] = std::move(name);
+        pollfd pfd { m_Fd, POLLIN, 0 };
+        return poll(&pfd, 1, 0) == 0;
     }
 
-    // foundScenes をファイルとハッシュをキーに分類
-    // TODO: unorderd_multimap でいいのでは
-    std::map<FileId, std::vector<const Scene*>>  fileScenes;
-    std::map<SceneId, std::vector<const Scene*>> hashScenes;
-
-    for ( const Scene& scene : foundScenes ) {
-        fileScenes[scene.fileId].push_back(&scene);
-        hashScenes[scene.sceneId].push_back(&scene);
-    }
-
-    // 注目しているファイルと共有している時間を積算
-    //
-    // A → B と B → A は同じになるため、一度積算したら fileIds から削除する。
-    std::map<FileId, std::map<FileId, DurationMs>> relationMap;
-
-    while ( ! fileIds.empty() ) {
-        FileId fileId   = fileIds.extract(fileIds.begin()).value();
-        auto&  relation = relationMap[fileId];
+    //! 改行まで (改行を含めて最大 maxSize - 1 バイト) を dest に読み、'\0' で終える
+    //!
+    //! @return 1 バイトも読めなければ false
+    bool readLine(char* dest, std::size_t maxSize)
+    {
+        std::size_t size = 0;
+        while ( size + 1 < maxSize && (m_iBegin < m_iEnd || fill()) ) {
+            dest[size] = m_Buffer[m_iBegin];
+            m_iBegin += 1;
+            size += 1;
+            if ( dest[size - 1] == '\n' ) {
+                break;
+            }
+        }
+        dest[size] = '\0';
+        return size > 0;
+    }
 
-        for ( const Scene* fileScene : fileScenes[fileId] ) {
-            for ( const Scene* hashScene : hashScenes[fileScene->sceneId] ) {
-                if ( fileIds.count(hashScene->fileId) == 0 ) {
-                    // B → A はやらない
-                    continue;
-                }
-                relation[hashScene->fileId] += fileScene->sceneId.durationMs;
+    //! 最大 size バイトを dest に読む
+    //!
+    //! @return 読んだバイト数 (入力が終わらなければ size)
+    //!
+    //! バッファに残っている分を写し、残りはバッファを通さずに読む。
+    std::size_t read(void* dest, std::size_t size)
+    {
+        char*       p     = static_cast<char*>(dest);
+        std::size_t nCopy = std::min(size, m_iEnd - m_iBegin);
+        std::memcpy(p, m_Buffer.data() + m_iBegin, nCopy);
+        m_iBegin += nCopy;
+
+        std::size_t offset = nCopy;
+        while ( offset < size ) {
+            ssize_t n = readFd(p + offset, size - offset);
+            if ( n <= 0 ) {
+                break;
             }
+            offset += std::size_t(n);
         }
+        return offset;
     }
 
-    // 積算結果を vector に詰替え
-    std::vector<std::tuple<FileId, FileId, DurationMs>> relations;
+private:
+    int               m_Fd;
+    std::vector<char> m_Buffer;
+    std::size_t       m_iBegin = 0; //!< まだ渡していない先頭
+    std::size_t       m_iEnd   = 0; //!< 読み込んだ末尾
+
+    //! 空のバッファに読み込む
+    //!
+    //! @return 読めたら true
+    bool fill()
+    {
+        ssize_t n = readFd(m_Buffer.data(), m_Buffer.size());
+        m_iBegin  = 0;
+        m_iEnd    = n > 0 ? std::size_t(n) : 0;
+        return n > 0;
+    }
 
-    // for ( const std::pair<FileId, std::map<FileId, DurationMs>>& relation : relationMap ) {
-    for ( const auto& relation : relationMap ) {
-        for ( const auto& fileDuration : relation.second ) {
-            relations.emplace_back(relation.first, fileDuration.first, fileDuration.second);
+    //! read(2) で読む
+    //!
+    //! @return 読んだバイト数、入力の終わりかシグナルで止まったら 0、失敗なら -1
+    ssize_t readFd(void* dest, std::size_t size)
+    {
+        ssize_t n = ::read(m_Fd, dest, size);
+        if ( n < 0 && errno == EINTR ) {
+            return 0;
         }
+        if ( n < 0 ) {
+            std::perror("read");
+        }
+        return n;
     }
+};
 
-    // duration でソート
-    std::sort(relations.begin(), relations.end(), [&](const auto& a, const auto& b) {
-        return std::get<2>(a) > std::get<2>(b);
-    });
-
-    // 結果を出力
-    for ( const auto& relation : relations ) {
-        std::fprintf(
-            stderr,
-            "---- %8.1f seconds matched\n%s\n%s\n",
-            std::get<2>(relation) / 1000.0f,
-            fileNames[std::get<0>(relation)].c_str(),
-            fileNames[std::get<1>(relation)].c_str()
-        );
-    }
+//! dest に最大 maxFrames フレームを読み込み、読み込んだフレーム数を返す
+typedef std::function<std::size_t(std::uint8_t* dest, std::size_t maxFrames)> FrameReader;
 
-    return 0;
+//! FrameReader を vidup_read_frames として呼ぶ
+static std::size_t callFrameReader(void* context, std::uint8_t* dest, std::size_t maxFrames)
+{
+    return (*static_cast<const FrameReader*>(context))(dest, maxFrames);
 }
 
-//! ファイル一覧を出力する
+//! タイムスタンプのファイルを読み込む
 //!
 //! @return 成功なら 0
-static int files(sqlite3* db)
+//!
+//! 1 行に 1 フレームの表示時刻 (ms) を書く。空行と # で始まる行は読み飛ばすので、
+//! ffmpeg の mkvtimestamp_v2 形式をそのまま読める。
+static int readTimestamps(const char* path, std::vector<double>& timestamps)
 {
-    sqlite3_stmt* stmt = nullptr;
-    int           status;
-
-    status = sqlite3_prepare_v2(db, "SELECT path, status FROM files", -1, &stmt, nullptr);
-    if ( status ) {
-        std::fprintf(stderr, "files: %s\n", sqlite3_errmsg(db));
-        return status;
+    std::FILE* stream = std::fopen(path, "r");
+    if ( ! stream ) {
+        std::perror("fopen for read");
+        return 1;
     }
 
-    status = sqlite3_step(stmt);
-    std::fprintf(stdout, "name\tstatus\n");
-    while ( status == SQLITE_ROW ) {
-        fs::path path       = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-        int      fileStatus = sqlite3_column_int(stmt, 1);
+    char line[256];
+    int  iLine = 0;
+    while ( std::fgets(line, sizeof(line), stream) ) {
+        iLine += 1;
+        if ( line[0] == '#' || line[0] == '\n' || line[0] == '\r' ) {
+            continue;
+        }
 
-        std::fprintf(stdout, "%s\t%d\n", path.c_str(), fileStatus);
-        status = sqlite3_step(stmt);
+        char*  end = nullptr;
+        double ms  = std::strtod(line, &end);
+        if ( end == line ) {
+            std::fprintf(stderr, "%s:%d: invalid timestamp\n", path, iLine);
+            std::fclose(stream);
+            return 1;
+        }
+        timestamps.push_back(ms);
     }
-    sqlite3_finalize(stmt);
+    std::fclose(stream);
 
-    if ( status != SQLITE_DONE ) {
-        std::fprintf(stderr, "files: %s\n", sqlite3_errmsg(db));
-        return status;
+    // 表示順に並んでいないと長さが負になる
+    if ( ! std::is_sorted(timestamps.begin(), timestamps.end()) ) {
+        std::fprintf(stderr, "%s: timestamps are not in presentation order\n", path);
+        return 1;
     }
 
     return 0;
 }
 
-//! fileId のシーンを出力する (デバッグ用)
+//! argv[iArg] を int として取得する
 //!
 //! @return 成功なら 0
-static int showFileScenes(sqlite3* db, FileId fileId)
+static int parseArgvInt(int argc, const char** argv, int iArg, int& out)
 {
-    std::vector<Scene> scenesOfFile;
-
-    std::fprintf(stdout, "file id: %d\n", fileId);
-
-    // fileId のシーンを列挙
-    if ( getScenesByFile(db, fileId, scenesOfFile) ) {
+    if ( iArg >= argc ) {
         return 1;
     }
 
-    // scenesOfFile を出力
-    std::fprintf(stdout, "hash     duration (ms)\n");
-    for ( const auto& scene : scenesOfFile ) {
-        std::fprintf(stdout, "%08X %8d\n", scene.sceneId.hash, scene.sceneId.durationMs);
-    }
+    const char* begin = argv[iArg];
+    char*       end   = nullptr;
 
-    return 0;
+    out = int(std::strtol(begin, &end, 10));
+
+    // 空文字か途中でパースをやめたら失敗
+    return (begin == end || *end != '\0');
 }
 
-//! argv[iArg] を int として取得する
+//! argv[iArg] を double として取得する
 //!
 //! @return 成功なら 0
-static int parseArgvInt(int argc, const char** argv, int iArg, int& out)
+static int parseArgvDouble(int argc, const char** argv, int iArg, double& out)
 {
     if ( iArg >= argc ) {
         return 1;
@@ -950,7 +248,7 @@ static int parseArgvInt(int argc, const char** argv, int iArg, int& out)
     const char* begin = argv[iArg];
     char*       end   = nullptr;
 
-    out = int(std::strtol(begin, &end, 10));
+    out = std::strtod(begin, &end);
 
     // 空文字か途中でパースをやめたら失敗
     return (begin == end || *end != '\0');
@@ -960,7 +258,7 @@ class Vidup {
 public:
     ~Vidup()
     {
-        closeDatabase();
+        vidup_close(m_Handle);
         if ( m_InStream ) {
             std::fclose(m_InStream);
             m_InStream = nullptr;
@@ -973,21 +271,79 @@ public:
         if ( int exitCode = parseOptions(argc, argv); exitCode ) {
             return exitCode;
         }
-        if ( int exitCode = openDatabase(m_DbPath); exitCode ) {
-            return exitCode;
+        if ( m_Mode == CommandMode::kBenchIntersect ) {
+            return benchIntersect();
+        }
+        if ( m_Mode == CommandMode::kBenchDetect ) {
+            if ( m_iArg + 1 != argc ) {
+                usage();
+                return 1;
+            }
+            return benchDetect(argv[m_iArg], m_FrameRate, m_FrameStride > 1 ? m_FrameStride : 4);
+        }
+        if ( m_Mode == CommandMode::kBenchRead ) {
+            return benchRead(std::vector<std::string>(argv + m_iArg, argv + argc));
+        }
+
+        if ( m_IsResuming && (m_Mode != CommandMode::kAnalyze || m_IsArchiving) ) {
+            std::fprintf(stderr, "--resume takes a file or --stdin without --archive.\n");
+            return 1;
         }
 
+        int status = vidup_open(m_DbPath.c_str(), &m_Handle);
+        if ( m_Mode == CommandMode::kInit && status == VIDUP_OUTDATED ) {
+            status = VIDUP_OK;
+        }
+        if ( status == VIDUP_OUTDATED ) {
+            std::fprintf(stderr, "the database is outdated. run `vidup --init` to upgrade.\n");
+            return 1;
+        }
+        if ( status ) {
+            return 1;
+        }
+        if ( vidup_set_throttle(m_Handle, m_CpuShare, m_IoLimitMib * 1024 * 1024, m_WriteLimit) ) {
+            return 1;
+        }
+        if ( m_Mode == CommandMode::kAnalyze || m_Mode == CommandMode::kStream
+             || m_Mode == CommandMode::kWatch || m_Mode == CommandMode::kReindex ) {
+            interruptOnSignals(m_Handle);
+        }
+
+        // 0 なら今の設定のまま
+        int hashBits    = m_HasHashOption ? 64 : 0;
+        int frameStride = m_HasStrideOption ? m_FrameStride : 0;
         if ( m_Mode == CommandMode::kInit ) {
-            return createTables(m_Db);
-        } else if ( m_Mode == CommandMode::kTop ) {
+            return vidup_init(m_Handle, hashBits, frameStride) ? 1 : 0;
+        }
+        if ( m_Mode == CommandMode::kReindex ) {
+            status = vidup_reindex(m_Handle, hashBits, frameStride);
+            if ( status == VIDUP_INTERRUPTED ) {
+                std::fprintf(stderr, "interrupted. the database is unchanged.\n");
+                return interruptedExitCode();
+            }
+            return status ? 1 : 0;
+        }
+
+        if ( m_Mode == CommandMode::kStream || m_Mode == CommandMode::kWatch ) {
+            if ( ! m_Timestamps.empty() ) {
+                std::fprintf(stderr, "--timestamps cannot be used with --stream or --watch.\n");
+                return 1;
+            }
+            if ( m_Mode == CommandMode::kStream ) {
+                return analyzeStream(fileno(stdin));
+            }
+            return watch(m_WatchDir);
+        }
+
+        if ( m_Mode == CommandMode::kTop ) {
             int limit = 10;
             if ( m_iArg + 1 == argc ) {
                 limit = std::atoi(argv[m_iArg]);
                 m_iArg += 1;
             }
-            return top(m_Db, limit);
+            return top(limit);
         } else if ( m_Mode == CommandMode::kFiles ) {
-            return files(m_Db);
+            return debugFiles(m_Handle);
         }
 
         // inPath
@@ -996,16 +352,19 @@ public:
             return 1;
         }
 
-        FileEntry fileEntry {};
-        fs::path  inPath = argv[m_iArg];
-        fs::path  inName = inPath.stem();
-
-        // exists file in db?
-        if ( getFileEntry(m_Db, inName, fileEntry) ) {
-            return 1;
-        }
+        fs::path inPath = argv[m_iArg];
+        fs::path inName = inPath.stem();
 
         if ( m_Mode == CommandMode::kAnalyze ) {
+            // 複数のファイルはまとめて読み込む
+            if ( ! m_InStream && m_iArg + 1 < argc ) {
+                if ( ! m_Timestamps.empty() || m_IsResuming ) {
+                    std::fprintf(stderr, "--timestamps and --resume take only one file.\n");
+                    return 1;
+                }
+                return analyzeFiles(std::vector<std::string>(argv + m_iArg, argv + argc));
+            }
+
             // open m_InStream
             if ( ! m_InStream ) {
                 const char* inputPath = argv[m_iArg];
@@ -1016,73 +375,92 @@ public:
                 std::perror("fopen for read");
                 return 1;
             }
-
-            if ( fileEntry.id >= 0 ) {
-                if ( fileEntry.status == FileStatus::kAnalyzed ) {
-                    if ( ! m_IsForced ) {
-                        std::fprintf(stderr, "\"%s\" already exists.\n", inName.c_str());
-                        return 0;
-                    }
-                }
-
-                // どんな状態であろうとエントリが存在するなら消す
-                if ( ! m_IsDryRun && deleteFile(m_Db, fileEntry.id) ) {
-                    return 1;
-                }
-            }
-
-            if ( ! m_IsDryRun ) {
-                if ( registerFile(m_Db, inName) ) {
-                    return 1;
-                }
-                if ( getFileEntry(m_Db, inName, fileEntry) ) {
-                    return 1;
-                }
-            }
-
-            std::fprintf(stderr, "analyzing \"%s\"\n", inName.c_str());
-            return analyzeScenes(
-                m_IsDryRun ? nullptr : m_Db, m_InStream, fileEntry.id, m_FrameRate
-            );
-        } else if ( m_Mode == CommandMode::kDelete ) {
-            if ( fileEntry.id < 0 ) {
-                std::fprintf(stderr, "\"%s\" not found.\n", inName.c_str());
+            if ( m_IsResuming && skipToCheckpoint(inName) ) {
                 return 1;
             }
 
-            return deleteFile(m_Db, fileEntry.id);
+            return analyzeInput(inName, [&](std::uint8_t* dest, std::size_t maxFrames) {
+                return std::fread(dest, kFrameSize, maxFrames, m_InStream);
+            });
+        }
+
+        if ( m_Mode == CommandMode::kDelete ) {
+            status = vidup_delete(m_Handle, inName.c_str());
         } else if ( m_Mode == CommandMode::kSearch ) {
-            if ( fileEntry.id < 0 ) {
-                std::fprintf(stderr, "\"%s\" not found.\n", inName.c_str());
+            status = searchFile(inName);
+        } else if ( m_Mode == CommandMode::kSimilar ) {
+            int k = 10;
+            if ( m_iArg + 2 == argc && parseArgvInt(argc, argv, m_iArg + 1, k) ) {
+                usage();
                 return 1;
             }
 
-            return searchFile(m_Db, fileEntry.id, 10);
+            status = similarFiles(inName, k);
         } else if ( m_Mode == CommandMode::kFileScenes ) {
-            if ( fileEntry.id < 0 ) {
-                std::fprintf(stderr, "\"%s\" not found.\n", inName.c_str());
+            status = debugFileScenes(m_Handle, inName.c_str());
+        } else if ( m_Mode == CommandMode::kArchiveFrames ) {
+            int iFirstFrame = 0;
+            int nFrames     = std::numeric_limits<int>::max();
+            if ( (m_iArg + 1 < argc && parseArgvInt(argc, argv, m_iArg + 1, iFirstFrame))
+                 || (m_iArg + 2 < argc && parseArgvInt(argc, argv, m_iArg + 2, nFrames))
+                 || iFirstFrame < 0 || nFrames < 0 ) {
+                usage();
                 return 1;
             }
 
-            return showFileScenes(m_Db, fileEntry.id);
+            status = debugArchiveFrames(
+                m_Handle, inName.c_str(), std::uint32_t(iFirstFrame), nFrames
+            );
         }
 
-        return 0;
+        if ( status == VIDUP_NOT_FOUND ) {
+            std::fprintf(stderr, "\"%s\" not found.\n", inName.c_str());
+        }
+        return status ? 1 : 0;
     }
 
 private:
-    enum CommandMode { kInit, kAnalyze, kDelete, kSearch, kTop, kFiles, kFileScenes };
-
-    int         m_iArg = 1;
-    fs::path    m_Me;
-    fs::path    m_Basedir;
-    fs::path    m_DbPath;
-    bool        m_IsDryRun  = false;
-    bool        m_IsForced  = false;
-    int         m_FrameRate = 30;
-    CommandMode m_Mode      = CommandMode::kAnalyze;
-    std::FILE*  m_InStream  = nullptr;
-    sqlite3*    m_Db        = nullptr;
+    enum CommandMode {
+        kInit,
+        kAnalyze,
+        kDelete,
+        kSearch,
+        kTop,
+        kFiles,
+        kFileScenes,
+        kArchiveFrames,
+        kSimilar,
+        kBenchIntersect,
+        kBenchRead,
+        kBenchDetect,
+        kStream,
+        kWatch,
+        kReindex,
+    };
+
+    int                 m_iArg = 1;
+    fs::path            m_Me;
+    fs::path            m_Basedir;
+    fs::path            m_DbPath;
+    bool                m_IsDryRun        = false;
+    bool                m_IsForced        = false;
+    bool                m_IsVerifying     = false;
+    bool                m_IsArchiving     = false;
+    bool                m_IsVerbose       = false;
+    bool                m_IsResuming      = false;
+    int                 m_FrameRate       = 30;
+    int                 m_FrameStride     = 1;
+    int                 m_TimeoutMs       = 0; //!< --timeout-ms (0 なら期限なし)
+    double              m_CpuShare        = 0; //!< --cpu-share (0 なら制限しない)
+    double              m_IoLimitMib      = 0; //!< --io-limit (MiB/s)
+    double              m_WriteLimit      = 0; //!< --write-limit (シーン/s)
+    bool                m_HasHashOption   = false;
+    bool                m_HasStrideOption = false;
+    CommandMode         m_Mode            = CommandMode::kAnalyze;
+    std::FILE*          m_InStream        = nullptr;
+    std::vector<double> m_Timestamps; //!< --timestamps
+    std::string         m_WatchDir;   //!< --watch
+    vidup*              m_Handle = nullptr;
 
     //! @return exit code
     int parseOptions(int argc, const char* argv[])
@@ -1102,20 +480,91 @@ private:
                 m_IsDryRun = true;
             } else if ( arg == "--force" ) {
                 m_IsForced = true;
+            } else if ( arg == "--verify" ) {
+                m_IsVerifying = true;
+            } else if ( arg == "--archive" ) {
+                m_IsArchiving = true;
             } else if ( arg == "-v" ) {
-                g_isVerbose = true;
+                m_IsVerbose = true;
+                vidup_set_verbose(1);
+            } else if ( arg == "--trace" ) {
+                m_iArg += 1;
+                if ( m_iArg >= argc ) {
+                    usage();
+                    return 1;
+                }
+                if ( vidup_set_trace(argv[m_iArg]) ) {
+                    return 1;
+                }
             } else if ( arg == "--stdin" ) {
                 m_InStream = stdin;
+            } else if ( arg == "--resume" ) {
+                m_IsResuming = true;
+            } else if ( arg == "--stream" ) {
+                m_Mode = CommandMode::kStream;
+            } else if ( arg == "--watch" ) {
+                m_iArg += 1;
+                if ( m_iArg >= argc ) {
+                    usage();
+                    return 1;
+                }
+                m_Mode     = CommandMode::kWatch;
+                m_WatchDir = argv[m_iArg];
+            } else if ( arg == "--reindex" ) {
+                m_Mode = CommandMode::kReindex;
+            } else if ( arg == "--hash64" ) {
+                m_HasHashOption = true;
+            } else if ( arg == "--frame-stride" ) {
+                m_iArg += 1;
+                if ( parseArgvInt(argc, argv, m_iArg, m_FrameStride) || m_FrameStride < 1 ) {
+                    usage();
+                    return 1;
+                }
+                m_HasStrideOption = true;
             } else if ( arg == "--delete" ) {
                 m_Mode = CommandMode::kDelete;
             } else if ( arg == "--search" ) {
                 m_Mode = CommandMode::kSearch;
+            } else if ( arg == "--similar" ) {
+                m_Mode = CommandMode::kSimilar;
             } else if ( arg == "--top" ) {
                 m_Mode = CommandMode::kTop;
             } else if ( arg == "--files" ) {
                 m_Mode = CommandMode::kFiles;
             } else if ( arg == "--file-scenes" ) {
                 m_Mode = CommandMode::kFileScenes;
+            } else if ( arg == "--archive-frames" ) {
+                m_Mode = CommandMode::kArchiveFrames;
+            } else if ( arg == "--bench-intersect" ) {
+                m_Mode = CommandMode::kBenchIntersect;
+            } else if ( arg == "--bench-read" ) {
+                m_Mode = CommandMode::kBenchRead;
+            } else if ( arg == "--bench-detect" ) {
+                m_Mode = CommandMode::kBenchDetect;
+            } else if ( arg == "--timestamps" ) {
+                m_iArg += 1;
+                if ( m_iArg >= argc ) {
+                    usage();
+                    return 1;
+                }
+                if ( readTimestamps(argv[m_iArg], m_Timestamps) ) {
+                    return 1;
+                }
+            } else if ( arg == "--timeout-ms" ) {
+                m_iArg += 1;
+                if ( parseArgvInt(argc, argv, m_iArg, m_TimeoutMs) || m_TimeoutMs < 1 ) {
+                    usage();
+                    return 1;
+                }
+            } else if ( arg == "--cpu-share" || arg == "--io-limit" || arg == "--write-limit" ) {
+                double* limit = arg == "--cpu-share" ? &m_CpuShare
+                              : arg == "--io-limit"  ? &m_IoLimitMib
+                                                     : &m_WriteLimit;
+                m_iArg += 1;
+                if ( parseArgvDouble(argc, argv, m_iArg, *limit) || *limit <= 0 ) {
+                    usage();
+                    return 1;
+                }
             } else if ( arg == "--frame-rate" ) {
                 m_iArg += 1;
                 if ( parseArgvInt(argc, argv, m_iArg, m_FrameRate) ) {
@@ -1136,36 +585,460 @@ private:
 
     void usage()
     {
-        std::puts("usage: vidup --init");
-        std::puts("       vidup [--dry-run] [--force] [-v] [--frame-rate n] file");
-        std::puts("       vidup [--dry-run] [--force] [-v] [--frame-rate n] --stdin filename");
+        std::puts("usage: vidup --init [--hash64] [--frame-stride k]");
+        std::puts("       vidup [--dry-run] [--force] [--archive] [-v] [--frame-rate n] file...");
+        std::puts(
+            "       vidup [--dry-run] [--force] [--archive] [-v] [--frame-rate n] --stdin filename"
+        );
+        std::puts(
+            "       vidup [--dry-run] [-v] [--frame-rate n] --resume (--stdin filename | file)"
+        );
+        std::puts("       vidup [--dry-run] [--force] [--archive] [-v] --timestamps tsfile file");
+        std::puts(
+            "       vidup [--dry-run] [--force] [--archive] [-v] --timestamps tsfile"
+            " --stdin filename"
+        );
+        std::puts("       vidup [--dry-run] [--force] [--archive] [-v] --stream");
+        std::puts(
+            "       vidup [--dry-run] [--force] [--archive] [-v] [--frame-rate n] --watch dir"
+        );
+        std::puts("       vidup --reindex [--hash64] [--frame-stride k]");
+        std::puts(
+            "       (registering and --reindex also take"
+            " [--cpu-share cores] [--io-limit MiB/s] [--write-limit scenes/s])"
+        );
         std::puts("       vidup --delete filename");
-        std::puts("       vidup --search filename");
+        std::puts("       vidup --search [--verify] [--timeout-ms n] filename");
         std::puts("       vidup --top [n]"); // n はシーン数なので出力の数とは一致しない
+        std::puts("       vidup --similar filename [k]");
+        std::puts("       vidup --trace trace.json ...");
         // std::puts("       vidup --files"); // for debug
         // std::puts("       vidup --file-scenes filename"); // for debug
+        // std::puts("       vidup --archive-frames filename [first [count]]"); // for debug
+        // std::puts("       vidup --bench-intersect"); // for debug
+        // std::puts("       vidup --bench-read file..."); // for debug
+        // std::puts("       vidup --bench-detect [--frame-stride k] file"); // for debug
+    }
+
+    //! vidup_register() のフラグ
+    int registerFlags() const
+    {
+        return (m_IsForced ? VIDUP_FORCE : 0) | (m_IsArchiving ? VIDUP_ARCHIVE : 0)
+             | (m_IsDryRun ? VIDUP_DRY_RUN : 0);
+    }
+
+    //! 入力を解析して登録する
+    //!
+    //! @return exit code
+    //!
+    //! isRegistered が nullptr でなければ、このとき登録したかどうかを入れる。
+    int analyzeInput(
+        const fs::path& inName, const FrameReader& reader, bool* isRegistered = nullptr
+    )
+    {
+        return registerInput(
+            inName,
+            [&](unsigned& nScenes) {
+                return vidup_register(
+                    m_Handle,
+                    inName.c_str(),
+                    m_FrameRate,
+                    m_Timestamps.data(),
+                    m_Timestamps.size(),
+                    callFrameReader,
+                    const_cast<FrameReader*>(&reader),
+                    registerFlags() | VIDUP_CHECKPOINT | (m_IsResuming ? VIDUP_RESUME : 0),
+                    &nScenes
+                );
+            },
+            isRegistered
+        );
+    }
+
+    //! 途中で止まった inName の解析の続きまで m_InStream を進める
+    //!
+    //! @return exit code
+    //!
+    //! 読み込み位置を変えられなければ (パイプなど) 読み飛ばす。
+    int skipToCheckpoint(const fs::path& inName)
+    {
+        std::uint32_t iFrame = 0;
+        if ( vidup_checkpoint(m_Handle, inName.c_str(), &iFrame) ) {
+            return 1;
+        }
+        if ( iFrame == 0 ) {
+            return 0;
+        }
+        std::fprintf(stderr, "resuming \"%s\" from frame %u\n", inName.c_str(), iFrame);
+
+        if ( fseeko(m_InStream, off_t(iFrame) * off_t(kFrameSize), SEEK_SET) != 0 ) {
+            std::uint8_t buffer[kFrameSize * 256];
+            for ( std::uint32_t rest = iFrame; rest > 0; ) {
+                std::size_t nFrames = std::fread(
+                    buffer, kFrameSize, std::min<std::uint32_t>(rest, 256), m_InStream
+                );
+                if ( nFrames == 0 ) {
+                    break;
+                }
+                rest -= std::uint32_t(nFrames);
+            }
+        }
+
+        // 続きのフレームがなければ別の入力
+        int c = std::fgetc(m_InStream);
+        if ( c == EOF ) {
+            std::fprintf(stderr, "the input ends before frame %u.\n", iFrame);
+            return 1;
+        }
+        std::ungetc(c, m_InStream);
+        return 0;
+    }
+
+    //! メモリ上のフレームをコピーせずに解析して登録する
+    //!
+    //! @return exit code
+    int analyzeFrames(const fs::path& inName, const std::uint8_t* frames, std::size_t nFrames)
+    {
+        return registerInput(inName, [&](unsigned& nScenes) {
+            return vidup_register_frames(
+                m_Handle, inName.c_str(), frames, nFrames, m_FrameRate, registerFlags(), &nScenes
+            );
+        });
+    }
+
+    //! 登録済みでなければ registerScenes で登録して結果を出力する
+    //!
+    //! @return exit code
+    //!
+    //! registerScenes は vidup_status を返す。isRegistered が nullptr でなければ、
+    //! 登録できたら true、登録済みで飛ばしたか失敗したら false を入れる。
+    int registerInput(
+        const fs::path&                              inName,
+        const std::function<int(unsigned& nScenes)>& registerScenes,
+        bool*                                        isRegistered = nullptr
+    )
+    {
+        if ( isRegistered ) {
+            *isRegistered = false;
+        }
+        if ( ! m_IsForced ) {
+            int isExisting = 0;
+            if ( vidup_is_registered(m_Handle, inName.c_str(), &isExisting) ) {
+                return 1;
+            }
+            if ( isExisting ) {
+                std::fprintf(stderr, "\"%s\" already exists.\n", inName.c_str());
+                return 0;
+            }
+        }
+
+        std::fprintf(stderr, "analyzing \"%s\"\n", inName.c_str());
+        unsigned nScenes = 0;
+        int      status  = registerScenes(nScenes);
+        if ( status == VIDUP_INTERRUPTED ) {
+            std::uint32_t iFrame = 0;
+            if ( vidup_checkpoint(m_Handle, inName.c_str(), &iFrame) == VIDUP_OK && iFrame > 0 ) {
+                std::fprintf(stderr, "interrupted. resume from frame %u with --resume.\n", iFrame);
+            } else {
+                std::fprintf(stderr, "interrupted. \"%s\" is not registered.\n", inName.c_str());
+            }
+            return interruptedExitCode();
+        }
+        if ( status ) {
+            return 1;
+        }
+
+        if ( isRegistered ) {
+            *isRegistered = true;
+        }
+        std::fprintf(stderr, "%u scenes registered.\n", nScenes);
+        return 0;
+    }
+
+    //! 複数のファイルを先読みしながら解析して登録する
+    //!
+    //! @return exit code
+    //!
+    //! 読み込みは BulkReader に任せ、読み終わった順に解析する。
+    //! 登録済みのファイルは読み込む前に除く。isKeepingOn なら登録に失敗しても残りのファイルを
+    //! 続けて登録する (--watch)。
+    int analyzeFiles(const std::vector<std::string>& inPaths, bool isKeepingOn = false)
+    {
+        std::vector<std::string> paths;
+        for ( const std::string& inPath : inPaths ) {
+            fs::path inName       = fs::path(inPath).stem();
+            int      isRegistered = 0;
+            if ( vidup_is_registered(m_Handle, inName.c_str(), &isRegistered) ) {
+                return 1;
+            }
+            if ( isRegistered && ! m_IsForced ) {
+                std::fprintf(stderr, "\"%s\" already exists.\n", inName.c_str());
+                continue;
+            }
+            paths.push_back(inPath);
+        }
+
+        BulkReader reader(paths);
+        reader.start();
+        if ( m_IsVerbose ) {
+            bool isUring = reader.backend() == BulkReader::Backend::kUring;
+            std::fprintf(stderr, "reading with %s\n", isUring ? "io_uring" : "read");
+        }
+
+        int                       exitCode = 0;
+        std::unique_ptr<BulkFile> file;
+        while ( reader.next(file) ) {
+            // 解析し終わったファイルまでで止める
+            if ( g_Signal ) {
+                std::fprintf(stderr, "interrupted.\n");
+                return interruptedExitCode();
+            }
+
+            if ( file->error ) {
+                std::fprintf(stderr, "%s: %s\n", file->path.c_str(), std::strerror(file->error));
+                exitCode = 1;
+                continue;
+            }
+
+            // 半端なフレームは捨てる
+            fs::path    inName  = fs::path(file->path).stem();
+            std::size_t nFrames = file->data.size() / kFrameSize;
+            if ( int status = analyzeFrames(inName, file->data.data(), nFrames); status ) {
+                if ( ! isKeepingOn || g_Signal ) {
+                    return status;
+                }
+                std::fprintf(stderr, "failed to register \"%s\".\n", inName.c_str());
+                exitCode = status;
+            }
+        }
+
+        return exitCode;
+    }
+
+    //! 複数の動画を続けて流し込んだストリームを解析して登録する
+    //!
+    //! @return exit code
+    //!
+    //! 動画ごとに "VIDUP1 <フレームレート> <バイト数> <名前>\n" の行に続けて
+    //! <バイト数> のフレームを置く。コミットは何本かずつまとめ、入力が途切れたらすぐにする。
+    int analyzeStream(int inFd)
+    {
+        StreamReader inStream(inFd);
+        bool         isTransaction = false;
+        int          nUncommitted  = 0;
+
+        auto commit = [&] {
+            if ( isTransaction && vidup_commit(m_Handle) ) {
+                return 1;
+            }
+            isTransaction = false;
+            nUncommitted  = 0;
+            return 0;
+        };
+        auto rollback = [&] {
+            if ( isTransaction ) {
+                vidup_rollback(m_Handle);
+            }
+            return 1;
+        };
+
+        while ( true ) {
+            // 次の動画がまだ来ていなければ、待つ前にコミットしておく
+            if ( nUncommitted >= kStreamCommitInterval || inStream.isIdle() ) {
+                if ( commit() ) {
+                    return 1;
+                }
+            }
+
+            // 登録し終わった動画までをコミットして止める
+            char header[4096];
+            if ( g_Signal || ! inStream.readLine(header, sizeof(header)) ) {
+                break;
+            }
+
+            // "VIDUP1 <フレームレート> <バイト数> <名前>\n"
+            char               magic[8]  = { 0 };
+            int                frameRate = 0;
+            unsigned long long length    = 0;
+            int                iName     = 0;
+            std::size_t        lineSize  = std::strlen(header);
+            if ( lineSize == 0 || header[lineSize - 1] != '\n'
+                 || std::sscanf(header, "%7s %d %llu %n", magic, &frameRate, &length, &iName) != 3
+                 || std::strcmp(magic, kStreamMagic) != 0 || frameRate <= 0
+                 || iName >= int(lineSize) - 1 ) {
+                // ここまでの動画は揃っているので登録する
+                std::fprintf(stderr, "invalid stream header: %s\n", header);
+                commit();
+                return 1;
+            }
+            header[lineSize - 1] = '\0';
+            fs::path inName      = fs::path(&header[iName]).stem();
+
+            if ( ! isTransaction && ! m_IsDryRun ) {
+                if ( vidup_begin(m_Handle) ) {
+                    return 1;
+                }
+                isTransaction = true;
+            }
+
+            // length バイトを超えて読まない
+            unsigned long long rest   = length;
+            auto               frames = [&](std::uint8_t* dest, std::size_t maxFrames) {
+                std::size_t nFrames = std::min<unsigned long long>(maxFrames, rest / kFrameSize);
+                std::size_t size    = inStream.read(dest, nFrames * kFrameSize);
+                rest -= size;
+                return size / kFrameSize;
+            };
+            m_FrameRate       = frameRate;
+            bool isRegistered = false;
+            if ( int exitCode = analyzeInput(inName, frames, &isRegistered); exitCode ) {
+                // 割り込まれた動画は取り消されているので、ここまでの動画は登録する
+                if ( g_Signal ) {
+                    return commit() ? 1 : exitCode;
+                }
+                return rollback();
+            }
+
+            // 登録済みで読まなかった分と、半端なフレームを読み飛ばす
+            std::uint8_t buffer[kFrameSize * 16];
+            while ( rest > 0 ) {
+                std::size_t size
+                    = inStream.read(buffer, std::min<unsigned long long>(sizeof(buffer), rest));
+                if ( size == 0 ) {
+                    break;
+                }
+                rest -= size;
+            }
+            if ( rest > 0 ) {
+                // 途中で切れた動画だけ消して、ここまでの動画は登録する。
+                // 前から登録済みで飛ばした動画は消さない
+                std::fprintf(stderr, "\"%s\" is truncated.\n", inName.c_str());
+                if ( isRegistered && ! m_IsDryRun && vidup_delete(m_Handle, inName.c_str()) ) {
+                    return rollback();
+                }
+                commit();
+                return 1;
+            }
+
+            nUncommitted += 1;
+        }
+
+        if ( commit() ) {
+            return 1;
+        }
+        return g_Signal ? interruptedExitCode() : 0;
     }
 
+    //! dir に書き終わったファイルを待ち続けて登録する
+    //!
     //! @return exit code
-    int openDatabase(const fs::path& dbPath)
+    //!
+    //! 落ち着いたファイルは analyzeFiles() でまとめて読み込んで解析する。
+    //! 読めなかったファイルや登録に失敗したファイルは報告して、監視を続ける。
+    int watch(const std::string& dir)
     {
-        closeDatabase();
-        if ( int err = sqlite3_open(dbPath.c_str(), &m_Db); err ) {
-            std::fprintf(stderr, "sqlite3_open: %s\n", sqlite3_errmsg(m_Db));
+        DirWatcher watcher(dir);
+        if ( ! watcher.start() ) {
             return 1;
         }
+        std::fprintf(stderr, "watching \"%s\"\n", dir.c_str());
+
+        while ( true ) {
+            std::vector<std::string> paths;
+            if ( ! watcher.wait(paths) ) {
+                return 1;
+            }
+            if ( g_Signal ) {
+                return interruptedExitCode();
+            }
+            if ( ! paths.empty() && analyzeFiles(paths, true) && g_Signal ) {
+                return interruptedExitCode();
+            }
+        }
+    }
+
+    //! inName と同じシーンを含むファイルを出力する
+    //!
+    //! @return vidup_status
+    int searchFile(const fs::path& inName)
+    {
+        vidup_results* results = nullptr;
+        int            flags   = m_IsVerifying ? VIDUP_VERIFY : 0;
+        int            status  = vidup_search_timeout(
+            m_Handle, inName.c_str(), 10, flags, m_TimeoutMs, &results
+        );
+        if ( status ) {
+            return status;
+        }
 
-        if ( int err = enableForeignKeys(m_Db); err ) {
+        std::size_t nResults = vidup_results_count(results);
+        for ( std::size_t i = 0; i < nResults; i += 1 ) {
+            const vidup_result* result = vidup_results_get(results, i);
+            if ( m_IsVerbose ) {
+                std::fprintf(stderr, "%8.1f seconds matched: ", result->seconds);
+            }
+            std::fprintf(
+                stderr,
+                "%8d %s%s\n",
+                result->scenes,
+                result->name,
+                result->is_unverified ? " (unverified)" : ""
+            );
+        }
+        if ( vidup_results_is_partial(results) ) {
+            std::fprintf(stderr, "timed out after %d ms; the results are partial.\n", m_TimeoutMs);
+        } else if ( nResults == 0 ) {
+            std::fprintf(stderr, "no duplicated videos.\n");
+        }
+
+        vidup_results_free(results);
+        return VIDUP_OK;
+    }
+
+    //! 同じシーンを含むファイルの組を出力する
+    //!
+    //! @return exit code
+    int top(int limit)
+    {
+        vidup_results* results = nullptr;
+        if ( vidup_top(m_Handle, limit, &results) ) {
             return 1;
         }
 
+        std::size_t nResults = vidup_results_count(results);
+        for ( std::size_t i = 0; i < nResults; i += 1 ) {
+            const vidup_result* result = vidup_results_get(results, i);
+            std::fprintf(
+                stderr,
+                "---- %8.1f seconds matched\n%s\n%s\n",
+                result->seconds,
+                result->name,
+                result->other_name
+            );
+        }
+
+        vidup_results_free(results);
         return 0;
     }
 
-    void closeDatabase()
+    //! 特徴ベクトルが inName に近いファイルを出力する
+    //!
+    //! @return vidup_status
+    int similarFiles(const fs::path& inName, int k)
     {
-        sqlite3_close(m_Db);
-        m_Db = nullptr;
+        vidup_results* results = nullptr;
+        if ( int status = vidup_similar(m_Handle, inName.c_str(), k, &results); status ) {
+            return status;
+        }
+
+        std::size_t nResults = vidup_results_count(results);
+        for ( std::size_t i = 0; i < nResults; i += 1 ) {
+            const vidup_result* result = vidup_results_get(results, i);
+            std::fprintf(stderr, "%8.3f %s\n", result->distance, result->name);
+        }
+
+        vidup_results_free(results);
+        return VIDUP_OK;
     }
 };
 
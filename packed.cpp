@@ -0,0 +1,184 @@
+#include "packed.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+void packFrames(
+    const std::uint8_t* __restrict frames, std::size_t nFrames, std::uint8_t* __restrict packed
+)
+{
+    const __m256i highMask = _mm256_set1_epi16(0x00F0);
+
+    std::size_t size = nFrames * kPackedFrameSize;
+    for ( std::size_t i = 0; i < size; i += 32 ) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&frames[i * 2]));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&frames[i * 2 + 32]));
+
+        // 16-bit ごとに (先の画素 & 0xF0) | (後の画素 >> 4) にして 8-bit に詰める
+        a = _mm256_or_si256(_mm256_and_si256(a, highMask), _mm256_srli_epi16(a, 12));
+        b = _mm256_or_si256(_mm256_and_si256(b, highMask), _mm256_srli_epi16(b, 12));
+        __m256i result = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&packed[i]), result);
+    }
+}
+
+void unpackFrame(const std::uint8_t* __restrict packed, std::uint8_t* __restrict frame)
+{
+    for ( std::size_t i = 0; i < kPackedFrameSize; i += 4 ) {
+        std::uint32_t word;
+        std::memcpy(&word, &packed[i], sizeof(word));
+        std::uint64_t pixels = unpackWord(word);
+        std::memcpy(&frame[i * 2], &pixels, sizeof(pixels));
+    }
+}
+
+double rmsePacked(const std::uint8_t* __restrict frame1, const std::uint8_t* __restrict frame2)
+{
+    const __m256i lowMask = _mm256_set1_epi8(0x0F);
+    const __m256i ones    = _mm256_set1_epi16(1);
+
+    __m256i sum = _mm256_setzero_si256();
+    for ( std::size_t i = 0; i < kPackedFrameSize; i += 32 ) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&frame1[i]));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&frame2[i]));
+
+        // 4-bit の差は [-15, 15] なので、絶対値の自乗和は 16-bit に収まる
+        __m256i low = _mm256_abs_epi8(
+            _mm256_sub_epi8(_mm256_and_si256(a, lowMask), _mm256_and_si256(b, lowMask))
+        );
+        __m256i high = _mm256_abs_epi8(_mm256_sub_epi8(
+            _mm256_and_si256(_mm256_srli_epi16(a, 4), lowMask),
+            _mm256_and_si256(_mm256_srli_epi16(b, 4), lowMask)
+        ));
+        __m256i squares = _mm256_add_epi16(
+            _mm256_maddubs_epi16(low, low), _mm256_maddubs_epi16(high, high)
+        );
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(squares, ones));
+    }
+
+    __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    sum128         = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0x4E));
+    sum128         = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0xB1));
+    std::uint32_t rse = std::uint32_t(_mm_cvtsi128_si32(sum128));
+
+    // 戻した画素の差は 16 倍なので rmse() の kFrameSize*gray で割るのと同じになる
+    return std::sqrt(float(rse) / (kPackedFrameSize * 2));
+}
+
+void compressFrames(
+    const std::uint8_t* packed, std::size_t nFrames, std::vector<std::uint8_t>& out
+)
+{
+    std::size_t size   = nFrames * kPackedFrameSize;
+    std::size_t nZeros = 0;
+
+    auto flushZeros = [&] {
+        while ( nZeros > 0 ) {
+            std::size_t n = std::min<std::size_t>(nZeros, 256);
+            out.push_back(0);
+            out.push_back(std::uint8_t(n - 1));
+            nZeros -= n;
+        }
+    };
+
+    for ( std::size_t i = 0; i < size; i += sizeof(std::uint64_t) ) {
+        std::uint64_t word;
+        std::memcpy(&word, &packed[i], sizeof(word));
+        if ( i >= kPackedFrameSize ) {
+            std::uint64_t previous;
+            std::memcpy(&previous, &packed[i - kPackedFrameSize], sizeof(previous));
+            word ^= previous;
+        }
+
+        // 変わらない 8 バイトはまとめて数える
+        if ( word == 0 ) {
+            nZeros += sizeof(word);
+            continue;
+        }
+        for ( std::size_t k = 0; k < sizeof(word); k += 1 ) {
+            std::uint8_t delta = std::uint8_t(word >> (k * 8));
+            if ( delta == 0 ) {
+                nZeros += 1;
+            } else {
+                flushZeros();
+                out.push_back(delta);
+            }
+        }
+    }
+    flushZeros();
+}
+
+bool decompressFrames(
+    const std::uint8_t* __restrict data,
+    std::size_t size,
+    std::size_t nFrames,
+    std::uint8_t* __restrict packed
+)
+{
+    std::size_t packedSize = nFrames * kPackedFrameSize;
+    std::size_t o          = 0;
+
+    for ( std::size_t i = 0; i < size; i += 1 ) {
+        if ( data[i] != 0 ) {
+            if ( o >= packedSize ) {
+                return false;
+            }
+            packed[o] = data[i];
+            o += 1;
+            continue;
+        }
+
+        if ( i + 1 >= size ) {
+            return false;
+        }
+        std::size_t n = std::size_t(data[i + 1]) + 1;
+        if ( o + n > packedSize ) {
+            return false;
+        }
+        std::memset(&packed[o], 0, n);
+        o += n;
+        i += 1;
+    }
+    if ( o != packedSize ) {
+        return false;
+    }
+
+    // 直前のフレームとの XOR を戻す
+    for ( std::size_t k = kPackedFrameSize; k < packedSize; k += 1 ) {
+        packed[k] ^= packed[k - kPackedFrameSize];
+    }
+    return true;
+}
+
+void FrameArchiveBuilder::add(const std::uint8_t* frames, std::size_t nFrames)
+{
+    while ( nFrames > 0 ) {
+        std::size_t nPending = m_Pending.size() / kPackedFrameSize;
+        std::size_t n        = std::min(nFrames, kArchiveBlockFrames - nPending);
+
+        m_Pending.resize(m_Pending.size() + n * kPackedFrameSize);
+        packFrames(frames, n, &m_Pending[nPending * kPackedFrameSize]);
+        m_nFrames += std::uint32_t(n);
+        frames += n * kPackedFrameSize * 2;
+        nFrames -= n;
+
+        if ( nPending + n == kArchiveBlockFrames ) {
+            flush();
+        }
+    }
+}
+
+void FrameArchiveBuilder::finish()
+{
+    if ( ! m_Pending.empty() ) {
+        flush();
+    }
+}
+
+void FrameArchiveBuilder::flush()
+{
+    m_Blocks.emplace_back();
+    compressFrames(m_Pending.data(), m_Pending.size() / kPackedFrameSize, m_Blocks.back());
+    m_Pending.clear();
+}
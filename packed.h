@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <immintrin.h>
+
+//! 16x16 の 8-bit フレームを 4-bit に詰めたときのバイト数
+static const std::size_t kPackedFrameSize = 16 * 16 / 2;
+
+//! FrameArchiveBuilder が 1 ブロックにまとめるフレーム数
+static const std::size_t kArchiveBlockFrames = 4096;
+
+//! ディザリングしたフレームを 4-bit に詰める
+//!
+//! 各画素の上位 4-bit だけを残し、2 画素を 1 バイトに (先の画素を上位に) 入れる。
+void packFrames(const std::uint8_t* frames, std::size_t nFrames, std::uint8_t* packed);
+
+//! packFrames() で詰めたフレームを 1 枚戻す
+void unpackFrame(const std::uint8_t* packed, std::uint8_t* frame);
+
+//! 詰めた 4 バイトを戻した 8 バイトを返す
+inline std::uint64_t unpackWord(std::uint32_t packed)
+{
+    // バイト内の 2 画素を入れ替えてから各バイトの上位 4-bit に散らす
+    std::uint32_t swapped = ((packed >> 4) & 0x0F0F0F0F) | ((packed & 0x0F0F0F0F) << 4);
+    return _pdep_u64(swapped, 0xF0F0F0F0F0F0F0F0ull);
+}
+
+//! 詰めたまま 2 枚のフレームの root mean squared error を求める
+//!
+//! 戻したフレームで求めた値と一致する。
+double rmsePacked(const std::uint8_t* frame1, const std::uint8_t* frame2);
+
+//! 詰めたフレームの列を圧縮する
+//!
+//! 直前のフレームとの XOR をとり、0 の連続を (0, 長さ - 1) の 2 バイトにする。
+//! 動きの少ないシーンはほとんど 0 になる。先頭のフレームは 0 のフレームとの XOR なので、
+//! 呼び出しごとに単独で戻せる。
+void compressFrames(
+    const std::uint8_t* packed, std::size_t nFrames, std::vector<std::uint8_t>& out
+);
+
+//! compressFrames() で圧縮した nFrames フレームを戻す
+//!
+//! @return 壊れていたら false
+bool decompressFrames(
+    const std::uint8_t* data, std::size_t size, std::size_t nFrames, std::uint8_t* packed
+);
+
+//! フレームを詰めて kArchiveBlockFrames ずつ圧縮したブロックを作る
+//!
+//! ブロックは単独で戻せるので、フレーム番号からブロックを選んで途中から読める。
+class FrameArchiveBuilder {
+public:
+    //! ディザリングした nFrames フレームを加える
+    void add(const std::uint8_t* frames, std::size_t nFrames);
+
+    //! 半端なフレームを最後のブロックにする
+    void finish();
+
+    std::uint32_t frameCount() const { return m_nFrames; }
+
+    //! 圧縮したブロック
+    const std::vector<std::vector<std::uint8_t>>& blocks() const { return m_Blocks; }
+
+private:
+    std::uint32_t                          m_nFrames = 0;
+    std::vector<std::uint8_t>              m_Pending; //!< 圧縮前のフレーム (4-bit)
+    std::vector<std::vector<std::uint8_t>> m_Blocks;
+
+    void flush();
+};
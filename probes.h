@@ -0,0 +1,70 @@
+#pragma once
+
+#include <type_traits>
+
+//! bpftrace などからつなぐ USDT プローブ
+//!
+//! sys/sdt.h と同じ形式の .note.stapsdt を書くので systemtap-sdt-dev がなくてもビルドでき、
+//! `bpftrace -l 'usdt:./vidup:*'` で一覧できる。プローブの位置は nop 1 つで、つながって
+//! いなければ引数をレジスタかメモリに置くほかに何もしない。引数は整数だけ (x86-64 用)。
+//!
+//!     VIDUP_PROBE2(scene_registered, fileId, hash);
+
+//! 引数のバイト数 (%n で符号を反転して書くので、符号付きなら正にする)
+#define VIDUP_PROBE_SIZE(x)                                                                        \
+    ((std::is_signed<typename std::decay<decltype(x)>::type>::value ? 1 : -1) * int(sizeof(x)))
+
+#define VIDUP_PROBE_OPERAND(n, x)                                                                  \
+    [vidup_size##n] "n"(VIDUP_PROBE_SIZE(x)), [vidup_arg##n] "nor"(x)
+
+//! 引数の大きさと場所 ("-8@%rax" なら符号付き 8 バイトで rax にある)
+#define VIDUP_PROBE_FORMAT(n) "%n[vidup_size" #n "]@%[vidup_arg" #n "]"
+
+//! nop とその位置、プローブ名、引数の形式を .note.stapsdt に書く
+#define VIDUP_PROBE_NOTE(name, format)                                                             \
+    "990: nop\n"                                                                                   \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                                  \
+    ".balign 4\n"                                                                                  \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                                             \
+    "991: .asciz \"stapsdt\"\n"                                                                    \
+    "992: .balign 4\n"                                                                             \
+    "993: .8byte 990b\n"                                                                           \
+    ".8byte _.stapsdt.base\n"                                                                      \
+    ".8byte 0\n"                                                                                   \
+    ".asciz \"vidup\"\n"                                                                           \
+    ".asciz \"" #name "\"\n"                                                                       \
+    ".asciz \"" format "\"\n"                                                                      \
+    "994: .balign 4\n"                                                                             \
+    ".popsection\n"                                                                                \
+    ".ifndef _.stapsdt.base\n"                                                                     \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"                        \
+    ".weak _.stapsdt.base\n"                                                                       \
+    ".hidden _.stapsdt.base\n"                                                                     \
+    "_.stapsdt.base: .space 1\n"                                                                   \
+    ".size _.stapsdt.base, 1\n"                                                                    \
+    ".popsection\n"                                                                                \
+    ".endif\n"
+
+#define VIDUP_PROBE1(name, a)                                                                      \
+    __asm__ __volatile__(                                                                          \
+        VIDUP_PROBE_NOTE(name, VIDUP_PROBE_FORMAT(1))                                              \
+        :                                                                                          \
+        : VIDUP_PROBE_OPERAND(1, a)                                                                \
+    )
+
+#define VIDUP_PROBE2(name, a, b)                                                                   \
+    __asm__ __volatile__(                                                                          \
+        VIDUP_PROBE_NOTE(name, VIDUP_PROBE_FORMAT(1) " " VIDUP_PROBE_FORMAT(2))                    \
+        :                                                                                          \
+        : VIDUP_PROBE_OPERAND(1, a), VIDUP_PROBE_OPERAND(2, b)                                     \
+    )
+
+#define VIDUP_PROBE3(name, a, b, c)                                                                \
+    __asm__ __volatile__(                                                                          \
+        VIDUP_PROBE_NOTE(                                                                          \
+            name,                                                                                  \
+            VIDUP_PROBE_FORMAT(1) " " VIDUP_PROBE_FORMAT(2) " " VIDUP_PROBE_FORMAT(3)              \
+        )                                                                                          \
+        :                                                                                          \
+        : VIDUP_PROBE_OPERAND(1, a), VIDUP_PROBE_OPERAND(2, b), VIDUP_PROBE_OPERAND(3, c)          \
+    )
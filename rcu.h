@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <immintrin.h>
+
+//! 読み手がロックを取らずに読める、差し替え式の版 (read-copy-update)
+//!
+//! 書き手は新しい版を作って publish() で差し替え、古い版はエポックで遅延解放する。
+//! 読み手は Reader の間、空いている枠に今のエポックを書いてから版を読む。
+//! 古い版は、それを外したときより前のエポックの読み手がいなくなってから消す。
+//! 書き手どうしは呼び出し側で直列化する。
+template <typename T>
+class RcuCell {
+public:
+    //! 同時に読める読み手の数 (超えた読み手は枠が空くまで待つ)
+    static const std::size_t kMaxReaders = 64;
+
+    //! 生きている間、読んだ版が消されない
+    class Reader {
+    public:
+        explicit Reader(const RcuCell& cell)
+            : m_Cell(cell)
+        {
+            // 読み手どうしで同じ枠を取り合わないように、スレッドごとに探し始める枠を変える
+            std::size_t first = std::hash<std::thread::id>()(std::this_thread::get_id());
+            for ( int spin = 0;; spin += 1 ) {
+                std::uint64_t epoch = cell.m_Epoch.load();
+                for ( std::size_t i = 0; i < kMaxReaders; i += 1 ) {
+                    std::size_t   slot = (first + i) % kMaxReaders;
+                    std::uint64_t idle = 0;
+                    if ( cell.m_Slots[slot].epoch.compare_exchange_strong(idle, epoch) ) {
+                        m_Slot  = slot;
+                        m_Value = cell.m_Value.load();
+                        return;
+                    }
+                }
+                wait(spin);
+            }
+        }
+
+        ~Reader() { m_Cell.m_Slots[m_Slot].epoch.store(0, std::memory_order_release); }
+
+        Reader(const Reader&)            = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        //! 読んだ版 (なければ nullptr)
+        const T* get() const { return m_Value; }
+
+    private:
+        const RcuCell& m_Cell;
+        std::size_t    m_Slot  = 0;
+        const T*       m_Value = nullptr;
+    };
+
+    RcuCell() = default;
+
+    ~RcuCell()
+    {
+        delete m_Value.load();
+        for ( const auto& retired : m_Retired ) {
+            delete retired.second;
+        }
+    }
+
+    RcuCell(const RcuCell&)            = delete;
+    RcuCell& operator=(const RcuCell&) = delete;
+
+    //! 今の版 (書き手が読む)
+    const T* current() const { return m_Value.load(); }
+
+    //! 版を差し替える (nullptr なら外すだけ)
+    //!
+    //! 古い版は、今読んでいる読み手がいなくなった後の publish() で消す。
+    void publish(std::unique_ptr<const T> value)
+    {
+        const T*      old   = m_Value.exchange(value.release());
+        std::uint64_t epoch = m_Epoch.fetch_add(1);
+        if ( old ) {
+            m_Retired.emplace_back(epoch, old);
+        }
+
+        // 外したときのエポック以前に入った読み手がいなければ消せる
+        std::uint64_t oldest = UINT64_MAX;
+        for ( const Slot& slot : m_Slots ) {
+            std::uint64_t readerEpoch = slot.epoch.load();
+            if ( readerEpoch != 0 ) {
+                oldest = std::min(oldest, readerEpoch);
+            }
+        }
+        auto end = std::remove_if(m_Retired.begin(), m_Retired.end(), [&](const auto& retired) {
+            if ( retired.first >= oldest ) {
+                return false;
+            }
+            delete retired.second;
+            return true;
+        });
+        m_Retired.erase(end, m_Retired.end());
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<std::uint64_t> epoch { 0 }; //!< 読み手が入ったときのエポック (0 なら空き)
+    };
+
+    std::atomic<const T*>                           m_Value { nullptr };
+    std::atomic<std::uint64_t>                      m_Epoch { 1 };
+    mutable Slot                                    m_Slots[kMaxReaders];
+    std::vector<std::pair<std::uint64_t, const T*>> m_Retired; //!< (外したときのエポック, 版)
+
+    //! しばらく回ってから譲る
+    static void wait(int spin)
+    {
+        if ( spin < 64 ) {
+            _mm_pause();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+};
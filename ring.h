@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#include <immintrin.h>
+
+//! 単一生産者・単一消費者の固定長リングバッファ
+//!
+//! push() は満杯の間、pop() は空の間待つので、遅い段が速い段を止める (背圧)。
+//! close() 後の push() は失敗し、pop() は残りを取り出し終えたら失敗する。
+//! 消費者が close() すると生産者を止められる。
+template <typename T>
+class SpscRing {
+public:
+    //! capacity は 2 のべき乗に切り上げる
+    explicit SpscRing(std::size_t capacity)
+    {
+        std::size_t size = 1;
+        while ( size < capacity ) {
+            size *= 2;
+        }
+        m_Slots.resize(size);
+        m_Mask = size - 1;
+    }
+
+    //! @return 閉じられていたら false
+    bool push(const T& value)
+    {
+        std::size_t tail   = m_Tail.load(std::memory_order_relaxed);
+        auto        isFull = [&] { return tail - m_Head.load(std::memory_order_acquire) > m_Mask; };
+        if ( isFull() ) {
+            m_nFull += 1;
+            for ( int spin = 0; isFull(); spin += 1 ) {
+                if ( m_IsClosed.load(std::memory_order_acquire) ) {
+                    return false;
+                }
+                wait(spin);
+            }
+        }
+        if ( m_IsClosed.load(std::memory_order_acquire) ) {
+            return false;
+        }
+
+        m_Slots[tail & m_Mask] = value;
+        m_Tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    //! @return 閉じられていて空なら false
+    bool pop(T& value)
+    {
+        std::size_t head = m_Head.load(std::memory_order_relaxed);
+        if ( head == m_Tail.load(std::memory_order_acquire) ) {
+            m_nEmpty += 1;
+            for ( int spin = 0; head == m_Tail.load(std::memory_order_acquire); spin += 1 ) {
+                // close() 前の push() を取りこぼさないように閉じた後でもう一度見る
+                if ( m_IsClosed.load(std::memory_order_acquire) ) {
+                    if ( head == m_Tail.load(std::memory_order_acquire) ) {
+                        return false;
+                    }
+                    break;
+                }
+                wait(spin);
+            }
+        }
+
+        value = m_Slots[head & m_Mask];
+        m_Head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    void close() { m_IsClosed.store(true, std::memory_order_release); }
+
+    //! push() が満杯で待った回数 (生産者のスレッドから読む)
+    std::size_t fullCount() const { return m_nFull; }
+
+    //! pop() が空で待った回数 (消費者のスレッドから読む)
+    std::size_t emptyCount() const { return m_nEmpty; }
+
+private:
+    std::vector<T> m_Slots;
+    std::size_t    m_Mask;
+
+    alignas(64) std::atomic<std::size_t> m_Head { 0 }; //!< 消費者だけが書く
+    std::size_t m_nEmpty = 0;
+    alignas(64) std::atomic<std::size_t> m_Tail { 0 }; //!< 生産者だけが書く
+    std::size_t m_nFull = 0;
+    alignas(64) std::atomic<bool> m_IsClosed { false };
+
+    //! しばらく回ってから譲り、それでも長く待つなら眠る
+    //!
+    //! 読み込みを待つ検出段のように長く待つ段が CPU を使い続けないようにする。
+    static void wait(int spin)
+    {
+        if ( spin < 64 ) {
+            _mm_pause();
+        } else if ( spin < 128 ) {
+            std::this_thread::yield();
+        } else if ( spin < 256 ) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+};
@@ -0,0 +1,376 @@
+#include "roaring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <utility>
+
+RoaringBitmap::Container* RoaringBitmap::findContainer(std::uint16_t key)
+{
+    auto it = std::lower_bound(
+        m_Containers.begin(),
+        m_Containers.end(),
+        key,
+        [](const Container& a, std::uint16_t b) { return a.key < b; }
+    );
+    if ( it == m_Containers.end() || it->key != key ) {
+        return nullptr;
+    }
+    return &*it;
+}
+
+const RoaringBitmap::Container* RoaringBitmap::findContainer(std::uint16_t key) const
+{
+    return const_cast<RoaringBitmap*>(this)->findContainer(key);
+}
+
+void RoaringBitmap::toBitmap(Container& container)
+{
+    container.bits.assign(kBitmapWords, 0);
+    for ( std::uint16_t low : container.array ) {
+        container.bits[low / 64] |= std::uint64_t(1) << (low % 64);
+    }
+    container.array.clear();
+    container.array.shrink_to_fit();
+}
+
+void RoaringBitmap::toArray(Container& container)
+{
+    container.array.clear();
+    container.array.reserve(container.cardinality);
+    for ( std::size_t i = 0; i < kBitmapWords; i += 1 ) {
+        std::uint64_t word = container.bits[i];
+        while ( word ) {
+            container.array.push_back(std::uint16_t(i * 64 + _tzcnt_u64(word)));
+            word &= word - 1;
+        }
+    }
+    container.bits.clear();
+    container.bits.shrink_to_fit();
+}
+
+void RoaringBitmap::add(std::uint32_t value)
+{
+    std::uint16_t key = std::uint16_t(value >> 16);
+    std::uint16_t low = std::uint16_t(value);
+
+    auto it = std::lower_bound(
+        m_Containers.begin(),
+        m_Containers.end(),
+        key,
+        [](const Container& a, std::uint16_t b) { return a.key < b; }
+    );
+    if ( it == m_Containers.end() || it->key != key ) {
+        Container container;
+        container.key = key;
+        it            = m_Containers.insert(it, std::move(container));
+    }
+
+    Container& container = *it;
+    if ( container.bits.empty() ) {
+        auto pos = std::lower_bound(container.array.begin(), container.array.end(), low);
+        if ( pos != container.array.end() && *pos == low ) {
+            return;
+        }
+        container.array.insert(pos, low);
+        container.cardinality += 1;
+        if ( container.cardinality > kMaxArraySize ) {
+            toBitmap(container);
+        }
+    } else {
+        std::uint64_t& word = container.bits[low / 64];
+        std::uint64_t  mask = std::uint64_t(1) << (low % 64);
+        if ( ! (word & mask) ) {
+            word |= mask;
+            container.cardinality += 1;
+        }
+    }
+}
+
+bool RoaringBitmap::remove(std::uint32_t value)
+{
+    std::uint16_t key = std::uint16_t(value >> 16);
+    std::uint16_t low = std::uint16_t(value);
+
+    Container* container = findContainer(key);
+    if ( ! container ) {
+        return false;
+    }
+
+    if ( container->bits.empty() ) {
+        auto pos = std::lower_bound(container->array.begin(), container->array.end(), low);
+        if ( pos == container->array.end() || *pos != low ) {
+            return false;
+        }
+        container->array.erase(pos);
+    } else {
+        std::uint64_t& word = container->bits[low / 64];
+        std::uint64_t  mask = std::uint64_t(1) << (low % 64);
+        if ( ! (word & mask) ) {
+            return false;
+        }
+        word &= ~mask;
+    }
+    container->cardinality -= 1;
+
+    if ( container->cardinality == 0 ) {
+        m_Containers.erase(m_Containers.begin() + (container - m_Containers.data()));
+    } else if ( ! container->bits.empty() && container->cardinality <= kMaxArraySize ) {
+        toArray(*container);
+    }
+
+    return true;
+}
+
+bool RoaringBitmap::contains(std::uint32_t value) const
+{
+    const Container* container = findContainer(std::uint16_t(value >> 16));
+    if ( ! container ) {
+        return false;
+    }
+
+    std::uint16_t low = std::uint16_t(value);
+    if ( container->bits.empty() ) {
+        return std::binary_search(container->array.begin(), container->array.end(), low);
+    } else {
+        return (container->bits[low / 64] >> (low % 64)) & 1;
+    }
+}
+
+std::uint64_t RoaringBitmap::cardinality() const
+{
+    std::uint64_t count = 0;
+    for ( const Container& container : m_Containers ) {
+        count += container.cardinality;
+    }
+    return count;
+}
+
+void RoaringBitmap::unionContainer(Container& dest, const Container& src)
+{
+    if ( dest.bits.empty() && src.bits.empty() ) {
+        std::vector<std::uint16_t> merged;
+        merged.reserve(dest.array.size() + src.array.size());
+        std::set_union(
+            dest.array.begin(),
+            dest.array.end(),
+            src.array.begin(),
+            src.array.end(),
+            std::back_inserter(merged)
+        );
+        dest.array       = std::move(merged);
+        dest.cardinality = std::uint32_t(dest.array.size());
+        if ( dest.cardinality > kMaxArraySize ) {
+            toBitmap(dest);
+        }
+        return;
+    }
+
+    if ( dest.bits.empty() ) {
+        toBitmap(dest);
+    }
+
+    std::uint32_t cardinality = 0;
+    if ( src.bits.empty() ) {
+        for ( std::uint16_t low : src.array ) {
+            dest.bits[low / 64] |= std::uint64_t(1) << (low % 64);
+        }
+        for ( std::size_t i = 0; i < kBitmapWords; i += 1 ) {
+            cardinality += std::uint32_t(_mm_popcnt_u64(dest.bits[i]));
+        }
+    } else {
+        for ( std::size_t i = 0; i < kBitmapWords; i += 1 ) {
+            dest.bits[i] |= src.bits[i];
+            cardinality += std::uint32_t(_mm_popcnt_u64(dest.bits[i]));
+        }
+    }
+    dest.cardinality = cardinality;
+}
+
+void RoaringBitmap::unionWith(const RoaringBitmap& other)
+{
+    std::vector<Container> merged;
+    merged.reserve(m_Containers.size() + other.m_Containers.size());
+
+    auto a = m_Containers.begin();
+    auto b = other.m_Containers.begin();
+    while ( a != m_Containers.end() || b != other.m_Containers.end() ) {
+        if ( b == other.m_Containers.end() || (a != m_Containers.end() && a->key < b->key) ) {
+            merged.push_back(std::move(*a));
+            ++a;
+        } else if ( a == m_Containers.end() || b->key < a->key ) {
+            merged.push_back(*b);
+            ++b;
+        } else {
+            unionContainer(*a, *b);
+            merged.push_back(std::move(*a));
+            ++a;
+            ++b;
+        }
+    }
+
+    m_Containers = std::move(merged);
+}
+
+std::uint64_t RoaringBitmap::andCardinality(const Container& a, const Container& b)
+{
+    if ( ! a.bits.empty() && ! b.bits.empty() ) {
+        std::uint64_t count = 0;
+        for ( std::size_t i = 0; i < kBitmapWords; i += 1 ) {
+            count += _mm_popcnt_u64(a.bits[i] & b.bits[i]);
+        }
+        return count;
+    }
+
+    if ( a.bits.empty() && b.bits.empty() ) {
+        std::uint64_t count = 0;
+        auto          ia    = a.array.begin();
+        auto          ib    = b.array.begin();
+        while ( ia != a.array.end() && ib != b.array.end() ) {
+            if ( *ia < *ib ) {
+                ++ia;
+            } else if ( *ib < *ia ) {
+                ++ib;
+            } else {
+                count += 1;
+                ++ia;
+                ++ib;
+            }
+        }
+        return count;
+    }
+
+    // 配列とビットマップ
+    const Container& array  = a.bits.empty() ? a : b;
+    const Container& bitmap = a.bits.empty() ? b : a;
+    std::uint64_t    count  = 0;
+    for ( std::uint16_t low : array.array ) {
+        count += (bitmap.bits[low / 64] >> (low % 64)) & 1;
+    }
+    return count;
+}
+
+std::uint64_t RoaringBitmap::andCardinality(const RoaringBitmap& other) const
+{
+    std::uint64_t count = 0;
+
+    auto a = m_Containers.begin();
+    auto b = other.m_Containers.begin();
+    while ( a != m_Containers.end() && b != other.m_Containers.end() ) {
+        if ( a->key < b->key ) {
+            ++a;
+        } else if ( b->key < a->key ) {
+            ++b;
+        } else {
+            count += andCardinality(*a, *b);
+            ++a;
+            ++b;
+        }
+    }
+
+    return count;
+}
+
+// 形式: nContainers(u32) { key(u16) isBitmap(u8) cardinality(u32) payload }*
+// payload は配列なら cardinality 個の u16、ビットマップなら 1024 個の u64。
+void RoaringBitmap::serialize(std::vector<std::uint8_t>& out) const
+{
+    auto append = [&](const void* p, std::size_t size) {
+        const std::uint8_t* bytes = static_cast<const std::uint8_t*>(p);
+        out.insert(out.end(), bytes, bytes + size);
+    };
+
+    std::uint32_t nContainers = std::uint32_t(m_Containers.size());
+    append(&nContainers, sizeof(nContainers));
+    for ( const Container& container : m_Containers ) {
+        std::uint8_t isBitmap = ! container.bits.empty();
+        append(&container.key, sizeof(container.key));
+        append(&isBitmap, sizeof(isBitmap));
+        append(&container.cardinality, sizeof(container.cardinality));
+        if ( isBitmap ) {
+            append(container.bits.data(), kBitmapWords * sizeof(std::uint64_t));
+        } else {
+            append(container.array.data(), container.array.size() * sizeof(std::uint16_t));
+        }
+    }
+}
+
+bool RoaringBitmap::deserialize(const std::uint8_t* data, std::size_t size)
+{
+    // コンテナごとの key, isBitmap, cardinality
+    static const std::size_t kHeaderSize
+        = sizeof(std::uint16_t) + sizeof(std::uint8_t) + sizeof(std::uint32_t);
+
+    std::size_t offset = 0;
+    auto        read   = [&](void* p, std::size_t n) {
+        if ( n > size - offset ) {
+            return false;
+        }
+        std::memcpy(p, data + offset, n);
+        offset += n;
+        return true;
+    };
+
+    m_Containers.clear();
+
+    // 壊れた値で大きな領域を確保しないように、大きさは残りのバイト数と比べてから確保する
+    std::uint32_t nContainers = 0;
+    if ( ! read(&nContainers, sizeof(nContainers)) || nContainers > 0x10000
+         || nContainers > (size - offset) / kHeaderSize ) {
+        return false;
+    }
+
+    std::vector<Container> containers;
+    containers.reserve(nContainers);
+    for ( std::uint32_t i = 0; i < nContainers; i += 1 ) {
+        Container    container;
+        std::uint8_t isBitmap = 0;
+        if ( ! read(&container.key, sizeof(container.key)) || ! read(&isBitmap, sizeof(isBitmap))
+             || ! read(&container.cardinality, sizeof(container.cardinality)) ) {
+            return false;
+        }
+        // findContainer() の二分探索のために key は狭義の昇順
+        if ( ! containers.empty() && container.key <= containers.back().key ) {
+            return false;
+        }
+
+        if ( isBitmap ) {
+            std::size_t bytes = kBitmapWords * sizeof(std::uint64_t);
+            if ( bytes > size - offset ) {
+                return false;
+            }
+            container.bits.resize(kBitmapWords);
+            read(container.bits.data(), bytes);
+
+            std::uint32_t cardinality = 0;
+            for ( std::uint64_t word : container.bits ) {
+                cardinality += std::uint32_t(_mm_popcnt_u64(word));
+            }
+            if ( cardinality == 0 || cardinality != container.cardinality ) {
+                return false;
+            }
+        } else {
+            std::size_t bytes = container.cardinality * sizeof(std::uint16_t);
+            if ( container.cardinality == 0 || container.cardinality > 0x10000
+                 || bytes > size - offset ) {
+                return false;
+            }
+            container.array.resize(container.cardinality);
+            read(container.array.data(), bytes);
+
+            // contains() の二分探索のために要素は狭義の昇順
+            for ( std::size_t j = 1; j < container.array.size(); j += 1 ) {
+                if ( container.array[j - 1] >= container.array[j] ) {
+                    return false;
+                }
+            }
+        }
+        containers.push_back(std::move(container));
+    }
+
+    if ( offset != size ) {
+        return false;
+    }
+    m_Containers = std::move(containers);
+    return true;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <immintrin.h>
+
+//! 32-bit 整数の圧縮ビットマップ (Roaring bitmap)
+//!
+//! 上位 16-bit ごとにコンテナを持ち、要素が少ないコンテナはソート済み配列、
+//! 多いコンテナは 65536-bit のビットマップで表現する。
+class RoaringBitmap {
+public:
+    //! 配列コンテナの最大要素数。これを超えるとビットマップコンテナに変換する。
+    static const std::size_t kMaxArraySize = 4096;
+
+    void add(std::uint32_t value);
+
+    //! @return 削除したら true
+    bool remove(std::uint32_t value);
+
+    bool contains(std::uint32_t value) const;
+
+    std::uint64_t cardinality() const;
+
+    bool empty() const { return m_Containers.empty(); }
+
+    void clear() { m_Containers.clear(); }
+
+    //! this |= other
+    void unionWith(const RoaringBitmap& other);
+
+    //! |this & other|
+    std::uint64_t andCardinality(const RoaringBitmap& other) const;
+
+    //! 要素を昇順に列挙する
+    template <typename F>
+    void forEach(F&& f) const
+    {
+        for ( const Container& container : m_Containers ) {
+            std::uint32_t high = std::uint32_t(container.key) << 16;
+            if ( container.bits.empty() ) {
+                for ( std::uint16_t low : container.array ) {
+                    f(high | low);
+                }
+            } else {
+                for ( std::size_t i = 0; i < kBitmapWords; i += 1 ) {
+                    std::uint64_t word = container.bits[i];
+                    while ( word ) {
+                        std::uint32_t bit = std::uint32_t(_tzcnt_u64(word));
+                        f(high | std::uint32_t(i * 64 + bit));
+                        word &= word - 1;
+                    }
+                }
+            }
+        }
+    }
+
+    //! out に追記する
+    void serialize(std::vector<std::uint8_t>& out) const;
+
+    //! @return 成功なら true
+    bool deserialize(const std::uint8_t* data, std::size_t size);
+
+private:
+    static const std::size_t kBitmapWords = 65536 / 64;
+
+    struct Container {
+        std::uint16_t              key         = 0;
+        std::uint32_t              cardinality = 0;
+        std::vector<std::uint16_t> array; //!< 配列コンテナ (ソート済み)
+        std::vector<std::uint64_t> bits;  //!< ビットマップコンテナ (空なら配列コンテナ)
+    };
+
+    std::vector<Container> m_Containers; //!< key でソート済み
+
+    Container*       findContainer(std::uint16_t key);
+    const Container* findContainer(std::uint16_t key) const;
+
+    static void toBitmap(Container& container);
+    static void toArray(Container& container);
+    static void unionContainer(Container& dest, const Container& src);
+    static std::uint64_t andCardinality(const Container& a, const Container& b);
+};
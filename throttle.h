@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <time.h>
+
+//! 一定の速さで補充されるトークンで処理の速さを抑える
+//!
+//! take() は使った量を差し引き、残高が負になったら 0 に戻るまで待つ。
+//! 使った後で差し引くので、CPU 時間のように後でしかわからない量にも使える。
+//! 残高は burst までしか貯まらないので、しばらく使わなくても一度に使いすぎない。
+//! rate が 0 なら制限しない。複数のスレッドから使える。
+class TokenBucket {
+public:
+    //! 1 秒あたり rate、最大 burst 秒分まで貯める
+    void setRate(double rate, double burstSeconds = 0.1)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Rate   = std::max(rate, 0.0);
+        m_Burst  = m_Rate * burstSeconds;
+        m_Tokens = m_Burst;
+        m_Last   = Clock::now();
+    }
+
+    //! 1 秒あたりの量 (制限しなければ 0)
+    double rate() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_Rate;
+    }
+
+    bool isLimited() const { return rate() > 0; }
+
+    //! amount を使い、使いすぎていたら補充されるまで待つ
+    void take(double amount)
+    {
+        double waitSeconds = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if ( m_Rate <= 0 ) {
+                return;
+            }
+            refill();
+            m_Tokens -= amount;
+            if ( m_Tokens < 0 ) {
+                waitSeconds = -m_Tokens / m_Rate;
+                m_WaitedSeconds += waitSeconds;
+            }
+        }
+        if ( waitSeconds > 0 ) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(waitSeconds));
+        }
+    }
+
+    //! 補充してからの残高が burst まで貯まっていれば (使い切れていなければ) true
+    bool isFull()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        refill();
+        return m_Tokens >= m_Burst;
+    }
+
+    //! take() が待った秒数の合計
+    double waitedSeconds() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_WaitedSeconds;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    mutable std::mutex m_Mutex;
+    double             m_Rate          = 0;
+    double             m_Burst         = 0;
+    double             m_Tokens        = 0;
+    double             m_WaitedSeconds = 0;
+    Clock::time_point  m_Last          = Clock::now();
+
+    void refill()
+    {
+        Clock::time_point now     = Clock::now();
+        double            elapsed = std::chrono::duration<double>(now - m_Last).count();
+
+        m_Tokens = std::min(m_Burst, m_Tokens + elapsed * m_Rate);
+        m_Last   = now;
+    }
+};
+
+//! プロセスの CPU 時間を CPU コア何個分までに抑える
+//!
+//! pace() を呼ぶたびに前の呼び出しからプロセス全体が使った CPU 時間を差し引くので、
+//! どのスレッドから呼んでも二重に数えない。使いすぎていたら呼んだスレッドが待つ。
+class CpuBudget {
+public:
+    //! share はコア何個分か (0 なら制限しない)
+    void setShare(double share)
+    {
+        m_Bucket.setRate(share);
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_LastSeconds = processSeconds();
+    }
+
+    //! コア何個分か (制限しなければ 0)
+    double share() const { return m_Bucket.rate(); }
+
+    bool isLimited() const { return m_Bucket.isLimited(); }
+
+    void pace()
+    {
+        if ( ! m_Bucket.isLimited() ) {
+            return;
+        }
+
+        double used = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            double seconds = processSeconds();
+            used           = seconds - m_LastSeconds;
+            m_LastSeconds  = seconds;
+        }
+        m_Bucket.take(used);
+    }
+
+    //! TokenBucket::isFull()
+    bool isFull() { return m_Bucket.isFull(); }
+
+    //! TokenBucket::waitedSeconds()
+    double waitedSeconds() const { return m_Bucket.waitedSeconds(); }
+
+private:
+    TokenBucket m_Bucket;
+    std::mutex  m_Mutex;
+    double      m_LastSeconds = 0;
+
+    static double processSeconds()
+    {
+        timespec time {};
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+        return double(time.tv_sec) + double(time.tv_nsec) * 1e-9;
+    }
+};
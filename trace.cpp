@@ -0,0 +1,263 @@
+#include "trace.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+std::atomic<bool> g_isTracing { false };
+
+typedef std::chrono::steady_clock Clock;
+
+//! 時刻の原点 (ライブラリを読み込んだ時刻)
+static const Clock::time_point g_Origin = Clock::now();
+
+//! 1 つのチャンクの区間数
+static const std::size_t kTraceChunkSize = 4096;
+
+//! 1 つの行のチャンク数の上限 (超えた区間は捨てる)
+static const std::size_t kTraceMaxChunks = 1024;
+
+struct TraceEvent {
+    const char*  name;
+    std::int64_t beginNs;
+    std::int64_t endNs;
+    std::int64_t count;
+};
+
+//! 1 つの行の区間
+//!
+//! 書くのは行を持っているスレッドだけなので、ロックを取らずに書き足す。
+//! チャンクは動かさないので、書き出すスレッドは count() までを読める。
+class TraceBuffer {
+public:
+    TraceBuffer(int tid, std::string name)
+        : m_Tid(tid)
+        , m_Name(std::move(name))
+    {
+    }
+
+    int                tid() const { return m_Tid; }
+    const std::string& name() const { return m_Name; }
+
+    void add(const TraceEvent& event)
+    {
+        std::size_t n      = m_Count.load(std::memory_order_relaxed);
+        std::size_t iChunk = n / kTraceChunkSize;
+        if ( iChunk >= kTraceMaxChunks ) {
+            m_nDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        TraceEvent* chunk = m_Chunks[iChunk].load(std::memory_order_relaxed);
+        if ( ! chunk ) {
+            chunk = new TraceEvent[kTraceChunkSize];
+            m_Chunks[iChunk].store(chunk, std::memory_order_relaxed);
+        }
+        chunk[n % kTraceChunkSize] = event;
+        m_Count.store(n + 1, std::memory_order_release);
+    }
+
+    std::size_t count() const { return m_Count.load(std::memory_order_acquire); }
+
+    //! i < count() の区間
+    const TraceEvent& at(std::size_t i) const
+    {
+        return m_Chunks[i / kTraceChunkSize].load(std::memory_order_relaxed)[i % kTraceChunkSize];
+    }
+
+    std::size_t droppedCount() const { return m_nDropped.load(std::memory_order_relaxed); }
+
+private:
+    int                      m_Tid;
+    std::string              m_Name;
+    std::atomic<std::size_t> m_Count { 0 };
+    std::atomic<std::size_t> m_nDropped { 0 };
+    std::atomic<TraceEvent*> m_Chunks[kTraceMaxChunks] = {};
+};
+
+//! すべての行と書き出し先
+struct TraceState {
+    std::mutex                mutex;
+    std::FILE*                file = nullptr;
+    std::vector<TraceBuffer*> buffers;     //!< すべての行
+    std::vector<TraceBuffer*> freeBuffers; //!< スレッドが終わって空いている行
+    bool                      isExitHandlerRegistered = false;
+};
+
+//! 終了時に書き出すまで使うので破棄しない
+static TraceState& traceState()
+{
+    static TraceState* state = new TraceState;
+    return *state;
+}
+
+//! name の空いている行を使う (なければ作る)
+static TraceBuffer* acquireBuffer(const std::string& name)
+{
+    TraceState&                 state = traceState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    for ( auto it = state.freeBuffers.begin(); it != state.freeBuffers.end(); ++it ) {
+        if ( (*it)->name() == name ) {
+            TraceBuffer* buffer = *it;
+            state.freeBuffers.erase(it);
+            return buffer;
+        }
+    }
+
+    TraceBuffer* buffer = new TraceBuffer(int(state.buffers.size()) + 1, name);
+    state.buffers.push_back(buffer);
+    return buffer;
+}
+
+static void releaseBuffer(TraceBuffer* buffer)
+{
+    TraceState&                 state = traceState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.freeBuffers.push_back(buffer);
+}
+
+//! スレッドが使っている行 (スレッドが終わったら空ける)
+struct TraceThread {
+    TraceBuffer* buffer = nullptr;
+
+    ~TraceThread()
+    {
+        if ( buffer ) {
+            releaseBuffer(buffer);
+        }
+    }
+};
+
+static thread_local TraceThread t_TraceThread;
+
+//! 記録した区間を書き出す (atexit)
+static void writeTrace()
+{
+    TraceState&                 state = traceState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if ( ! state.file ) {
+        return;
+    }
+    g_isTracing.store(false);
+
+    std::FILE*  file     = state.file;
+    int         pid      = int(getpid());
+    std::size_t nDropped = 0;
+    const char* comma    = "";
+    std::fprintf(file, "{\"traceEvents\":[\n");
+    for ( const TraceBuffer* buffer : state.buffers ) {
+        if ( ! buffer->name().empty() ) {
+            std::fprintf(
+                file,
+                "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}",
+                comma,
+                pid,
+                buffer->tid(),
+                buffer->name().c_str()
+            );
+            comma = ",\n";
+        }
+
+        std::size_t nEvents = buffer->count();
+        for ( std::size_t i = 0; i < nEvents; i += 1 ) {
+            const TraceEvent& event = buffer->at(i);
+            std::fprintf(
+                file,
+                "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                comma,
+                event.name,
+                pid,
+                buffer->tid(),
+                double(event.beginNs) / 1000,
+                double(event.endNs - event.beginNs) / 1000
+            );
+            if ( event.count >= 0 ) {
+                long long count = static_cast<long long>(event.count);
+                std::fprintf(file, ",\"args\":{\"count\":%lld}", count);
+            }
+            std::fputc('}', file);
+            comma = ",\n";
+        }
+        nDropped += buffer->droppedCount();
+    }
+    std::fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    if ( std::fclose(file) ) {
+        std::perror("fclose trace");
+    }
+    state.file = nullptr;
+    if ( nDropped > 0 ) {
+        std::fprintf(stderr, "trace: %zu events were dropped.\n", nDropped);
+    }
+}
+
+int traceStart(const char* path)
+{
+    TraceState&                 state = traceState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    if ( state.file ) {
+        std::fclose(state.file);
+        state.file = nullptr;
+    }
+    if ( ! path ) {
+        g_isTracing.store(false);
+        return 0;
+    }
+
+    // 書き出せない path は終了時ではなくここで知らせる
+    state.file = std::fopen(path, "w");
+    if ( ! state.file ) {
+        std::fprintf(stderr, "%s: %s\n", path, std::strerror(errno));
+        return 1;
+    }
+    if ( ! state.isExitHandlerRegistered ) {
+        if ( std::atexit(writeTrace) ) {
+            std::fprintf(stderr, "atexit failed\n");
+            return 1;
+        }
+        state.isExitHandlerRegistered = true;
+    }
+    g_isTracing.store(true);
+    return 0;
+}
+
+std::int64_t traceNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - g_Origin).count();
+}
+
+void traceThreadName(const char* name)
+{
+    if ( ! g_isTracing.load(std::memory_order_relaxed) ) {
+        return;
+    }
+
+    TraceBuffer*& buffer = t_TraceThread.buffer;
+    if ( buffer && buffer->name() == name ) {
+        return;
+    }
+    if ( buffer ) {
+        releaseBuffer(buffer);
+    }
+    buffer = acquireBuffer(name);
+}
+
+void traceRecord(const char* name, std::int64_t beginNs, std::int64_t endNs, std::int64_t count)
+{
+    TraceBuffer*& buffer = t_TraceThread.buffer;
+    if ( ! buffer ) {
+        buffer = acquireBuffer("");
+    }
+    buffer->add({ name, beginNs, endNs, count });
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+//! 区間を記録しているか
+extern std::atomic<bool> g_isTracing;
+
+//! 区間の記録を始め、プロセスの終了時に path に Chrome trace 形式の JSON で書き出す
+//!
+//! @return 成功なら 0
+//!
+//! path が NULL なら記録をやめて書き出さない。
+int traceStart(const char* path);
+
+//! 記録を始めてからのナノ秒
+std::int64_t traceNow();
+
+//! 今のスレッドの区間を name の行にまとめる
+//!
+//! 終わったスレッドの行は同じ名前の次のスレッドが使うので、ファイルごとに作り直す段も
+//! 1 つの行に並ぶ。記録していなければ何もしない。
+void traceThreadName(const char* name);
+
+//! 今のスレッドの区間を加える
+//!
+//! スレッドごとのバッファに書くのでロックを取らない。count が負なら件数を書き出さない。
+void traceRecord(const char* name, std::int64_t beginNs, std::int64_t endNs, std::int64_t count);
+
+//! スコープの間を区間として記録する
+//!
+//! name は文字列リテラルなど書き出すまで有効なもの。記録していなければ時刻も読まない。
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name)
+        : m_Name(g_isTracing.load(std::memory_order_relaxed) ? name : nullptr)
+        , m_Begin(m_Name ? traceNow() : 0)
+    {
+    }
+
+    ~TraceSpan() { end(); }
+
+    TraceSpan(const TraceSpan&)            = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    //! 区間で扱った件数 (フレーム数、行数など) を添える
+    void setCount(std::int64_t count) { m_Count = count; }
+
+    //! スコープの終わりを待たずに区間を閉じる
+    void end()
+    {
+        if ( m_Name ) {
+            traceRecord(m_Name, m_Begin, traceNow(), m_Count);
+            m_Name = nullptr;
+        }
+    }
+
+private:
+    const char*  m_Name; //!< 記録しなければ nullptr
+    std::int64_t m_Begin;
+    std::int64_t m_Count = -1;
+};
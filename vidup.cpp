@@ -0,0 +1,6929 @@
+#include "vidup.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <immintrin.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sqlite3.h>
+#include <unistd.h>
+
+#include "bulkread.h"
+#include "debug.h"
+#include "hnsw.h"
+#include "intersect.h"
+#include "packed.h"
+#include "probes.h"
+#include "rcu.h"
+#include "ring.h"
+#include "roaring.h"
+#include "throttle.h"
+#include "trace.h"
+
+namespace fs = std::filesystem;
+
+//! 32-bit ハッシュは旧形式 (sqlite3_bind_int) と互換にするため符号拡張して格納する
+typedef std::uint64_t Hash;
+typedef std::uint32_t DurationMs;
+typedef int           FileId; //!< 未設定は -1
+
+//! シーンを一意に識別するための値
+struct SceneId {
+    Hash       hash;
+    DurationMs durationMs;
+};
+
+static inline bool operator==(const SceneId& a, const SceneId& b)
+{
+    return a.hash == b.hash && a.durationMs == b.durationMs;
+}
+
+static inline bool operator<(const SceneId& a, const SceneId& b)
+{
+    if ( a.hash != b.hash ) {
+        return a.hash < b.hash;
+    } else {
+        return a.durationMs < b.durationMs;
+    };
+}
+
+//! SceneId を 64-bit のキーにまとめる
+//!
+//! 32-bit ハッシュなら SceneId と 1 対 1 に対応する。
+//! 64-bit ハッシュは上位と下位を入れ替えて長さと混ぜるので、衝突はハッシュの衝突と同程度。
+static inline std::uint64_t packSceneId(const SceneId& sceneId)
+{
+    return ((sceneId.hash << 32) | (sceneId.hash >> 32)) ^ sceneId.durationMs;
+}
+
+//! packSceneId() のキーとシーンの長さからハッシュを戻す
+static inline Hash unpackSceneHash(std::uint64_t key, DurationMs durationMs)
+{
+    std::uint64_t rotated = key ^ durationMs;
+    return (rotated << 32) | (rotated >> 32);
+}
+
+struct Scene {
+    SceneId sceneId;
+    FileId  fileId;
+};
+
+//! 照合用のシーンの集合
+struct SceneSet {
+    std::vector<std::uint64_t> keys;       //!< packSceneId() の昇順 (重複なし)
+    std::vector<int>           counts;     //!< keys ごとの出現回数
+    std::vector<DurationMs>    durationMs; //!< keys ごとのシーンの長さ
+};
+
+//! getTopHashes() の出力
+struct HashCount {
+    SceneId sceneId;
+    int     count;
+};
+
+//! 検索結果の 1 件 (C API の vidup_result になる)
+struct Match {
+    FileId fileId;
+    FileId otherFileId;          //!< top() の組のもう一方 (ほかは -1)
+    int    scenes;               //!< 一致したシーン数
+    double seconds;              //!< 一致した秒数
+    double distance;             //!< 特徴ベクトルの距離
+    bool   isUnverified = false; //!< 期限までにサムネイルで確かめられなかった
+};
+
+//! シーンハッシュの種類 (meta テーブルの hash_bits)
+enum HashType {
+    kHashCrc32 = 32,
+    kHashCrc64 = 64,
+};
+
+enum FileStatus {
+    kNone     = 0,
+    kAnalyzed = 1,
+};
+
+struct FileEntry {
+    FileId   id;
+    fs::path name;
+    int      status; //!< FileStatus
+};
+
+//! gray 16x16px
+static const std::size_t kFrameSize             = VIDUP_FRAME_SIZE;
+static const double      kSceneChangedThreshold = 4.5;
+
+// 4-bit に詰めたフレームはディザリング後は下位 4-bit が 0 なので可逆
+static_assert(kPackedFrameSize * 2 == kFrameSize, "packed.h assumes 16x16 frames");
+
+//! シーンごとのサムネイル (最初と中央のフレームを 4-bit に詰めたもの)
+static const std::size_t kThumbnailSize = kPackedFrameSize * 2;
+
+//! 中央のフレームを選ぶために、シーンの間に残しておくフレームの数 (偶数)
+//!
+//! これより長いシーンでは間引いたフレームから選ぶので、中央から最大でシーンの長さの
+//! 2 / kMiddleCandidates だけずれる。
+static const std::size_t kMiddleCandidates = 256;
+
+//! 取り込みの読み込み段から検出段に一度に渡すフレーム数
+static const std::size_t kFramesPerBlock = 256;
+
+//! 取り込みの段の間で使い回すフレームブロックの数
+static const std::size_t kFrameBlockCount = 8;
+
+//! 取り込みの検出段から書き込み段に溜められるシーン数
+static const std::size_t kSceneQueueSize = 1024;
+
+//! VIDUP_CHECKPOINT で途中の状態をコミットするフレームの最小の間隔 (30 fps で 5 分)
+//! 間隔を越えた後の最初のシーンの切れ目でコミットする
+static const std::uint32_t kCheckpointFrames = 9000;
+
+//! 取り込みの検出段から書き込み段に溜められる途中の状態の数
+static const std::size_t kCheckpointQueueSize = 4;
+
+//! --reindex でワーカーごとに先に読んでおくファイル数
+static const std::size_t kReindexQueueSize = 2;
+
+//! 含まれるファイル数がこれ以上のシーンはポスティングリストをビットマップでも保持する
+static const int kPostingBitmapThreshold = 64;
+
+//! 要約を引くファイルを絞るバケット数の log2 (シーンのキーで振り分ける)
+static const int kSketchBucketBits = 16;
+
+//! DB のスキーマのバージョン (meta テーブルの schema_version)
+//!
+//! 古い DB は vidup --init で更新する。
+static const std::int64_t kSchemaVersion = 9;
+
+//! ほかの接続がロックしているときに待つ時間
+//!
+//! vidup_similar() は読み込み専用の接続で索引を作るので、その間のコミットは読み終わるまで待つ。
+static const int kBusyTimeoutMs = 10000;
+
+//! ファイルの特徴ベクトルの次元数
+static const std::size_t kEmbeddingSize = 32;
+
+typedef std::array<float, kEmbeddingSize> Embedding;
+
+//! 特徴ベクトルの索引に入れるファイル
+struct AnnEntry {
+    std::string name;
+    Embedding   embedding;
+};
+
+static bool g_isVerbose = false;
+
+//! 画素の下位 4-bit を捨てる (ディザリング) マスク
+static const std::uint64_t kDitherMask = 0xF0F0F0F0F0F0F0F0ull;
+
+//! 32-bit のシーンハッシュを積算する
+//!
+//! 画素の下位 4-bit は捨てるので、ディザリングしていないフレームをそのまま渡せる。
+// TODO: use CLMUL
+static std::uint32_t
+crc32acc(std::uint32_t acc, std::size_t size, const std::uint8_t* __restrict buf)
+{
+    std::uint64_t acc64 = acc;
+    std::size_t   i     = 0;
+    for ( ; i + 8 <= size; i += sizeof(std::uint64_t) ) {
+        std::uint64_t word = *reinterpret_cast<const std::uint64_t*>(&buf[i]) & kDitherMask;
+        acc64              = _mm_crc32_u64(acc64, word);
+    }
+    acc = std::uint32_t(acc64);
+    for ( ; i < size; i += 1 ) {
+        acc = _mm_crc32_u8(acc, buf[i] & 0xF0);
+    }
+    return acc;
+}
+
+//! crc64acc() の下位 32-bit の CRC に入れる前にワードに乗じる奇数
+static const std::uint64_t kMixer = 0x9E3779B97F4A7C15ull;
+
+//! 64-bit のシーンハッシュを積算する
+//!
+//! 上位 32-bit は crc32acc() と同じ値、下位 32-bit は奇数を乗じて攪拌したワードの CRC。
+//! 2 本の CRC は互いに依存しないので並列に実行される。crc32acc() と同じく下位 4-bit は捨てる。
+static std::uint64_t
+crc64acc(std::uint64_t acc, std::size_t size, const std::uint8_t* __restrict buf)
+{
+    std::uint64_t hi = acc >> 32;
+    std::uint64_t lo = acc & 0xFFFFFFFF;
+    std::size_t   i  = 0;
+    for ( ; i + 8 <= size; i += sizeof(std::uint64_t) ) {
+        std::uint64_t word = *reinterpret_cast<const std::uint64_t*>(&buf[i]) & kDitherMask;
+        hi                 = _mm_crc32_u64(hi, word);
+        lo                 = _mm_crc32_u64(lo, word * kMixer);
+    }
+    for ( ; i < size; i += 1 ) {
+        std::uint8_t pixel = buf[i] & 0xF0;
+        hi                 = _mm_crc32_u8(std::uint32_t(hi), pixel);
+        lo                 = _mm_crc32_u8(std::uint32_t(lo), std::uint8_t(pixel * kMixer));
+    }
+    return (hi << 32) | lo;
+}
+
+//! hashType に応じてシーンハッシュを積算する
+static std::uint64_t
+sceneHashAcc(HashType hashType, std::uint64_t acc, std::size_t size, const std::uint8_t* buf)
+{
+    if ( hashType == HashType::kHashCrc64 ) {
+        return crc64acc(acc, size, buf);
+    } else {
+        return crc32acc(std::uint32_t(acc), size, buf);
+    }
+}
+
+//! 4-bit に詰めたフレームを戻したときと同じシーンハッシュを積算する
+//!
+//! 詰めた 4 バイトをレジスタ上で 8 バイトに戻して CRC に入れるので、戻したフレームを作らない。
+static std::uint64_t
+sceneHashAccPacked(HashType hashType, std::uint64_t acc, const std::uint8_t* __restrict packed)
+{
+    if ( hashType == HashType::kHashCrc64 ) {
+        std::uint64_t hi = acc >> 32;
+        std::uint64_t lo = acc & 0xFFFFFFFF;
+        for ( std::size_t i = 0; i < kPackedFrameSize; i += sizeof(std::uint32_t) ) {
+            std::uint32_t word;
+            std::memcpy(&word, &packed[i], sizeof(word));
+            std::uint64_t pixels = unpackWord(word);
+            hi                   = _mm_crc32_u64(hi, pixels);
+            lo                   = _mm_crc32_u64(lo, pixels * kMixer);
+        }
+        return (hi << 32) | lo;
+    }
+
+    std::uint64_t acc64 = std::uint32_t(acc);
+    for ( std::size_t i = 0; i < kPackedFrameSize; i += sizeof(std::uint32_t) ) {
+        std::uint32_t word;
+        std::memcpy(&word, &packed[i], sizeof(word));
+        acc64 = _mm_crc32_u64(acc64, unpackWord(word));
+    }
+    return std::uint32_t(acc64);
+}
+
+//! 積算結果を DB に格納する Hash に変換する
+static Hash makeSceneHash(HashType hashType, std::uint64_t acc)
+{
+    if ( hashType == HashType::kHashCrc64 ) {
+        return acc;
+    } else {
+        return Hash(std::int32_t(std::uint32_t(acc)));
+    }
+}
+
+//! scenes から照合用のシーンの集合を作る
+static void makeSceneSet(const std::vector<Scene>& scenes, SceneSet& sceneSet)
+{
+    std::vector<std::pair<std::uint64_t, DurationMs>> keys;
+
+    keys.reserve(scenes.size());
+    for ( const Scene& scene : scenes ) {
+        keys.emplace_back(packSceneId(scene.sceneId), scene.sceneId.durationMs);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    sceneSet.keys.clear();
+    sceneSet.counts.clear();
+    sceneSet.durationMs.clear();
+    for ( const auto& key : keys ) {
+        if ( ! sceneSet.keys.empty() && sceneSet.keys.back() == key.first ) {
+            sceneSet.counts.back() += 1;
+            continue;
+        }
+        sceneSet.keys.push_back(key.first);
+        sceneSet.counts.push_back(1);
+        sceneSet.durationMs.push_back(key.second);
+    }
+}
+
+//! query のシーンのうち candidate に含まれるものを数える
+//!
+//! matchedScenes は query 側の出現回数で数えたシーン数、
+//! matchedMs は一致したシーンの長さの合計 (query 側の出現回数分)。
+static void matchSceneSets(
+    const SceneSet& query, const SceneSet& candidate, int& matchedScenes, DurationMs& matchedMs
+)
+{
+    std::vector<std::uint32_t> indices(std::min(query.keys.size(), candidate.keys.size()));
+
+    std::size_t n = intersectSorted(
+        query.keys.data(),
+        query.keys.size(),
+        candidate.keys.data(),
+        candidate.keys.size(),
+        indices.data(),
+        nullptr
+    );
+
+    matchedScenes = 0;
+    matchedMs     = 0;
+    for ( std::size_t i = 0; i < n; i += 1 ) {
+        std::uint32_t index = indices[i];
+        matchedScenes += query.counts[index];
+        matchedMs += query.durationMs[index] * query.counts[index];
+    }
+}
+
+//! シーンのキーを要約のバケットに振り分ける
+static std::uint32_t sketchBucket(std::uint64_t key)
+{
+    return std::uint32_t((key * 0x9E3779B97F4A7C15ull) >> (64 - kSketchBucketBits));
+}
+
+//! ファイルに含まれるシーンの Bloom filter
+//!
+//! 偽陽性はあるが偽陰性はないので、共有しうるシーン数の上限を見積もれる。
+//! ビット数はシーン数の 10 倍以上の 2 のべき乗で、偽陽性率は 2% 程度。
+struct SceneBloom {
+    static const int kProbes = 3;
+
+    //! キーから 2 つのハッシュを作る (ダブルハッシング)
+    static void hashKey(std::uint64_t key, std::uint64_t& h1, std::uint64_t& h2)
+    {
+        std::uint64_t h = key * 0x9E3779B97F4A7C15ull;
+        h1              = h ^ (h >> 29);
+        h2              = (h >> 32) | 1;
+    }
+
+    static bool
+    mayContain(const std::uint64_t* words, std::size_t nWords, std::uint64_t h1, std::uint64_t h2)
+    {
+        std::uint64_t mask = nWords * 64 - 1;
+        for ( int i = 0; i < kProbes; i += 1 ) {
+            std::uint64_t bit = (h1 + h2 * i) & mask;
+            if ( ! ((words[bit / 64] >> (bit % 64)) & 1) ) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void build(const SceneSet& sceneSet, std::vector<std::uint64_t>& words)
+    {
+        std::size_t nWords = 1;
+        while ( nWords * 64 < sceneSet.keys.size() * 10 ) {
+            nWords *= 2;
+        }
+        words.assign(nWords, 0);
+
+        std::uint64_t mask = nWords * 64 - 1;
+        for ( std::uint64_t key : sceneSet.keys ) {
+            std::uint64_t h1, h2;
+            hashKey(key, h1, h2);
+            for ( int i = 0; i < kProbes; i += 1 ) {
+                std::uint64_t bit = (h1 + h2 * i) & mask;
+                words[bit / 64] |= std::uint64_t(1) << (bit % 64);
+            }
+        }
+    }
+};
+
+//! root mean squared error
+//!
+//! 画素の下位 4-bit は捨てて (ディザリングして) 比べる。
+static double rmse(const std::uint8_t* __restrict frame1, const std::uint8_t* __restrict frame2)
+{
+    // 8-bit の自乗なので 16-bit、kFrameSize が 16-bit 以下ならオーバーフローしない
+    std::uint32_t rse = 0;
+    for ( std::size_t i = 0; i < kFrameSize; i += 1 ) {
+        std::int16_t delta = std::int16_t(frame1[i] & 0xF0) - (frame2[i] & 0xF0);
+        rse += delta * delta;
+    }
+
+    // divide by kFrameSize*gray
+    return std::sqrt(float(rse) / (kFrameSize * 256));
+}
+
+//! シーンの列からファイルの特徴ベクトルを作る
+//!
+//! 再編集されたファイルでも近い値になるように、シーンの順序によらない統計量だけを使う。
+//!
+//! - [0, 16)  シーンの長さのヒストグラム (100 ms から 2 倍ずつの対数ビン)
+//! - [16, 24) 代表フレームの平均輝度のヒストグラム (シーンの長さで重み付け)
+//! - [24, 32) 代表フレームの輝度とシーンの長さの統計量
+class EmbeddingBuilder {
+public:
+    //! シーンを追加する
+    //!
+    //! frame はシーンの最初のフレーム。
+    void addScene(DurationMs durationMs, const std::uint8_t* __restrict frame)
+    {
+        double luma   = 0;
+        double lumaSq = 0;
+        double top    = 0;
+        double left   = 0;
+        for ( std::size_t y = 0; y < 16; y += 1 ) {
+            for ( std::size_t x = 0; x < 16; x += 1 ) {
+                double value = frame[y * 16 + x];
+                luma += value;
+                lumaSq += value * value;
+                top += y < 8 ? value : -value;
+                left += x < 8 ? value : -value;
+            }
+        }
+        luma /= kFrameSize;
+        lumaSq /= kFrameSize;
+
+        double weight   = durationMs;
+        double contrast = std::sqrt(std::max(0.0, lumaSq - luma * luma));
+        double logMs    = std::log2(std::max(1.0, durationMs / 100.0));
+
+        m_DurationBins[std::min(std::size_t(logMs), kDurationBins - 1)] += 1;
+        m_LumaBins[std::min(std::size_t(luma) * kLumaBins / 256, kLumaBins - 1)] += weight;
+
+        m_nScenes += 1;
+        m_TotalMs += weight;
+        m_LumaSum += luma * weight;
+        m_LumaSqSum += luma * luma * weight;
+        m_ContrastSum += contrast * weight;
+        m_TopSum += top / kFrameSize * weight;
+        m_LeftSum += left / kFrameSize * weight;
+        m_LogMsSum += logMs;
+        m_LogMsSqSum += logMs * logMs;
+    }
+
+    //! 各成分がおおむね [0, 1] に収まるように正規化した特徴ベクトルを返す
+    Embedding finish() const
+    {
+        Embedding embedding {};
+        if ( m_nScenes == 0 ) {
+            return embedding;
+        }
+
+        double totalMs = std::max(m_TotalMs, 1.0);
+        for ( std::size_t i = 0; i < kDurationBins; i += 1 ) {
+            embedding[i] = float(m_DurationBins[i] / m_nScenes);
+        }
+        for ( std::size_t i = 0; i < kLumaBins; i += 1 ) {
+            embedding[kDurationBins + i] = float(m_LumaBins[i] / totalMs);
+        }
+
+        double meanLuma  = m_LumaSum / totalMs;
+        double varLuma   = std::max(0.0, m_LumaSqSum / totalMs - meanLuma * meanLuma);
+        double meanLogMs = m_LogMsSum / m_nScenes;
+        double varLogMs  = std::max(0.0, m_LogMsSqSum / m_nScenes - meanLogMs * meanLogMs);
+        double perMinute = m_nScenes * 60000.0 / totalMs;
+
+        float* stats = &embedding[kDurationBins + kLumaBins];
+        stats[0]     = float(meanLuma / 256);
+        stats[1]     = float(std::sqrt(varLuma) / 128);
+        stats[2]     = float(m_ContrastSum / totalMs / 128);
+        stats[3]     = float(m_TopSum / totalMs / 256 + 0.5);
+        stats[4]     = float(m_LeftSum / totalMs / 256 + 0.5);
+        stats[5]     = float(meanLogMs / kDurationBins);
+        stats[6]     = float(std::sqrt(varLogMs) / 8);
+        stats[7]     = float(std::log2(1 + perMinute) / 8);
+
+        return embedding;
+    }
+
+private:
+    static const std::size_t kDurationBins = 16;
+    static const std::size_t kLumaBins     = 8;
+
+    int    m_nScenes                     = 0;
+    double m_TotalMs                     = 0;
+    double m_DurationBins[kDurationBins] = {};
+    double m_LumaBins[kLumaBins]         = {};
+    double m_LumaSum                     = 0;
+    double m_LumaSqSum                   = 0;
+    double m_ContrastSum                 = 0;
+    double m_TopSum                      = 0;
+    double m_LeftSum                     = 0;
+    double m_LogMsSum                    = 0;
+    double m_LogMsSqSum                  = 0;
+};
+
+//! 最大 maxFrames フレームを dest に読み込む関数
+//!
+//! 読み込んだフレーム数を返す (0 なら終わり)。
+typedef std::function<std::size_t(std::uint8_t* dest, std::size_t maxFrames)> FrameReader;
+
+//! 最大 maxFrames フレームを読み込む
+//!
+//! @return 読み込んだフレーム数 (末尾の半端なフレームは捨てる)
+static std::size_t
+readFrames(const FrameReader& reader, std::uint8_t* __restrict dest, std::size_t maxFrames)
+{
+    std::size_t nFrames = reader(dest, maxFrames);
+
+    // dithering
+    for ( std::size_t i = 0; i < nFrames * kFrameSize; i += 1 ) {
+        dest[i] = dest[i] & 0xF0;
+    }
+
+    return nFrames;
+}
+
+static void debugPrintf(const char* __restrict format, ...)
+{
+    if ( ! g_isVerbose ) {
+        return;
+    }
+    va_list arg;
+    va_start(arg, format);
+    std::vfprintf(stderr, format, arg);
+    va_end(arg);
+}
+
+//! foreign keys を有効化する
+//!
+//! @return 成功なら 0
+//!
+//! 失敗した場合は標準エラーにメッセージを出力する。
+static int enableForeignKeys(sqlite3* db)
+{
+    sqlite3_stmt* stmt   = nullptr;
+    int           status = sqlite3_prepare_v2(db, "PRAGMA foreign_keys = ON", -1, &stmt, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "PRAGMA foreign_keys = ON: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "PRAGMA foreign_keys = ON: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    return 0;
+}
+
+//! 結果を返さない SQL を実行する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! 失敗した場合は標準エラーにメッセージを出力する。
+static int execSql(sqlite3* db, const char* sql)
+{
+    char* message = nullptr;
+    int   status  = sqlite3_exec(db, sql, nullptr, nullptr, &message);
+    if ( status ) {
+        std::fprintf(stderr, "%s: %s\n", sql, message ? message : sqlite3_errmsg(db));
+        sqlite3_free(message);
+        return status;
+    }
+
+    return 0;
+}
+
+//! テーブルを作成する
+//!
+//! @return 成功なら 0
+static int createTables(sqlite3* db)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    // create database files
+    status = sqlite3_prepare_v2(
+        db,
+        "CREATE TABLE IF NOT EXISTS files("
+        "id INTEGER PRIMARY KEY,"
+        "path TEXT UNIQUE,"
+        "status INTEGER"
+        ")",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "CREATE TABLE files: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "CREATE TABLE files: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    // create database scenes
+    status = sqlite3_prepare_v2(
+        db,
+        "CREATE TABLE IF NOT EXISTS scenes("
+        "hash INTEGER,"
+        "duration_ms INTEGER,"
+        "file_id INTEGER,"
+        "FOREIGN KEY (file_id) REFERENCES files(id) ON DELETE CASCADE"
+        ")",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "CREATE TABLE scenes: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "CREATE TABLE scenes: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    // craete index scene_hash_duration_file
+    //
+    // file_id まで含めて getScenesByHash() がインデックスの 1 回のシークで完結するようにする。
+    status = sqlite3_prepare_v2(
+        db,
+        "CREATE INDEX IF NOT EXISTS scene_hash_duration_file"
+        " ON scenes(hash, duration_ms, file_id)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "CREATE INDEX scene_hash_duration_file: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "CREATE INDEX scene_hash_duration_file: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    // 旧形式のインデックスは scene_hash_duration_file で代替できる
+    if ( execSql(db, "DROP INDEX IF EXISTS scene_hash_duration") ) {
+        return 1;
+    }
+
+    // create index scene_file_id
+    status = sqlite3_prepare_v2(
+        db, "CREATE INDEX IF NOT EXISTS scene_file_id ON scenes(file_id)", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "CREATE INDEX scene_file_id: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "CREATE INDEX scene_file_id: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    // create table postings
+    //
+    // 多くのファイルに含まれるシーンは fileId のビットマップでも保持する。
+    if ( execSql(
+             db,
+             "CREATE TABLE IF NOT EXISTS postings("
+             "hash INTEGER,"
+             "duration_ms INTEGER,"
+             "bitmap BLOB,"
+             "PRIMARY KEY (hash, duration_ms)"
+             ")"
+         ) ) {
+        return 1;
+    }
+
+    // create table frequencies
+    //
+    // シーンごとの含まれるファイル数。検索で含まれるファイルの少ないシーンから調べるのに使う。
+    if ( execSql(
+             db,
+             "CREATE TABLE IF NOT EXISTS frequencies("
+             "hash INTEGER,"
+             "duration_ms INTEGER,"
+             "files INTEGER,"
+             "PRIMARY KEY (hash, duration_ms)"
+             ")"
+         ) ) {
+        return 1;
+    }
+
+    // create table embeddings
+    if ( execSql(
+             db,
+             "CREATE TABLE IF NOT EXISTS embeddings("
+             "file_id INTEGER PRIMARY KEY,"
+             "vector BLOB,"
+             "FOREIGN KEY (file_id) REFERENCES files(id) ON DELETE CASCADE"
+             ")"
+         ) ) {
+        return 1;
+    }
+
+    // create table thumbnails
+    //
+    // シーンごとの kThumbnailSize バイトを scenes の rowid 順に並べたもの。
+    if ( execSql(
+             db,
+             "CREATE TABLE IF NOT EXISTS thumbnails("
+             "file_id INTEGER PRIMARY KEY,"
+             "frames BLOB,"
+             "FOREIGN KEY (file_id) REFERENCES files(id) ON DELETE CASCADE"
+             ")"
+         ) ) {
+        return 1;
+    }
+
+    // create table sketches
+    //
+    // 検索の 1 段目でファイル単位に候補を絞り込むための要約。
+    if ( execSql(
+             db,
+             "CREATE TABLE IF NOT EXISTS sketches("
+             "file_id INTEGER PRIMARY KEY,"
+             "total_ms INTEGER,"
+             "bloom BLOB,"
+             "FOREIGN KEY (file_id) REFERENCES files(id) ON DELETE CASCADE"
+             ")"
+         ) ) {
+        return 1;
+    }
+
+    // create table sketch_buckets
+    //
+    // sketchBucket() ごとに、そのバケットのシーンを含むファイルのビットマップ。
+    // 検索の 1 段目で要約を引くファイルを問い合わせと同じバケットのシーンを持つものに絞る。
+    if ( execSql(
+             db,
+             "CREATE TABLE IF NOT EXISTS sketch_buckets("
+             "bucket INTEGER PRIMARY KEY,"
+             "files BLOB"
+             ")"
+         ) ) {
+        return 1;
+    }
+
+    // create table archives
+    //
+    // --archive で登録したファイルのフレームの保管庫。
+    // archive_blocks はフレームを 4-bit に詰めて block_frames ずつ圧縮したもの。
+    if ( execSql(
+             db,
+             "CREATE TABLE IF NOT EXISTS archives("
+             "file_id INTEGER PRIMARY KEY,"
+             "frame_rate INTEGER,"
+             "frame_count INTEGER,"
+             "block_frames INTEGER,"
+             "timestamps BLOB,"
+             "FOREIGN KEY (file_id) REFERENCES files(id) ON DELETE CASCADE"
+             ")"
+         ) ) {
+        return 1;
+    }
+    if ( execSql(
+             db,
+             "CREATE TABLE IF NOT EXISTS archive_blocks("
+             "file_id INTEGER,"
+             "block INTEGER,"
+             "data BLOB,"
+             "PRIMARY KEY (file_id, block),"
+             "FOREIGN KEY (file_id) REFERENCES files(id) ON DELETE CASCADE"
+             ")"
+         ) ) {
+        return 1;
+    }
+
+    // create table search_cache
+    //
+    // searchFile() の結果。search_generation が変わったら使わない。
+    if ( execSql(
+             db,
+             "CREATE TABLE IF NOT EXISTS search_cache("
+             "file_id INTEGER,"
+             "result_limit INTEGER,"
+             "flags INTEGER,"
+             "generation INTEGER,"
+             "results BLOB,"
+             "PRIMARY KEY (file_id, result_limit, flags),"
+             "FOREIGN KEY (file_id) REFERENCES files(id) ON DELETE CASCADE"
+             ")"
+         ) ) {
+        return 1;
+    }
+
+    // create table checkpoints
+    //
+    // VIDUP_CHECKPOINT で解析している途中のファイルの状態。シーンの切れ目でとる。
+    // scenes は閉じたシーンの (ハッシュ, 長さ) の列、embedding は EmbeddingBuilder の中身。
+    if ( execSql(
+             db,
+             "CREATE TABLE IF NOT EXISTS checkpoints("
+             "file_id INTEGER PRIMARY KEY,"
+             "frame_index INTEGER,"
+             "last_frame BLOB,"
+             "scenes BLOB,"
+             "thumbnails BLOB,"
+             "embedding BLOB,"
+             "FOREIGN KEY (file_id) REFERENCES files(id) ON DELETE CASCADE"
+             ")"
+         ) ) {
+        return 1;
+    }
+
+    // create table meta
+    if ( execSql(
+             db,
+             "CREATE TABLE IF NOT EXISTS meta("
+             "key TEXT PRIMARY KEY,"
+             "value INTEGER"
+             ")"
+         ) ) {
+        return 1;
+    }
+
+    return 0;
+}
+
+//! テーブルが存在するか調べる
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int hasTable(sqlite3* db, const char* name, bool& exists)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    exists = false;
+
+    status = sqlite3_prepare_v2(
+        db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "hasTable: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_text(stmt, 1, name, -1, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "hasTable: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_ROW ) {
+        exists = true;
+        status = SQLITE_DONE;
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "hasTable: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! meta テーブルから key の値を取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! key が存在しない場合は value に defaultValue が入る。
+static int
+getMeta(sqlite3* db, const char* key, std::int64_t& value, std::int64_t defaultValue)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    value = defaultValue;
+
+    status = sqlite3_prepare_v2(db, "SELECT value FROM meta WHERE key = ?", -1, &stmt, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "getMeta: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_text(stmt, 1, key, -1, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "getMeta: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_ROW ) {
+        value  = sqlite3_column_int64(stmt, 0);
+        status = SQLITE_DONE;
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getMeta: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! meta テーブルに key の値を設定する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int setMeta(sqlite3* db, const char* key, std::int64_t value)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(
+        db, "INSERT OR REPLACE INTO meta (key, value) VALUES (?, ?)", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "setMeta: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_text(stmt, 1, key, -1, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "setMeta: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int64(stmt, 2, value);
+    if ( status ) {
+        std::fprintf(stderr, "setMeta: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "setMeta: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! meta テーブルの key の値を 1 増やす
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! key が存在しない場合は 1 になる。
+static int incrementMeta(sqlite3* db, const char* key)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(
+        db,
+        "INSERT OR REPLACE INTO meta (key, value)"
+        " VALUES (?1, COALESCE((SELECT value FROM meta WHERE key = ?1), 0) + 1)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "incrementMeta: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_text(stmt, 1, key, -1, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "incrementMeta: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "incrementMeta: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! DB に登録されているシーンの数を数える
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int countAllScenes(sqlite3* db, std::int64_t& count)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    count = 0;
+
+    status = sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM scenes", -1, &stmt, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "countAllScenes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_ROW ) {
+        count  = sqlite3_column_int64(stmt, 0);
+        status = SQLITE_DONE;
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "countAllScenes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! name からファイルの情報を取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! 失敗した場合、entry.id には -1 が入る。
+static int getFileEntry(sqlite3* db, const fs::path& name, FileEntry& entry)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    entry.id = -1;
+
+    status
+        = sqlite3_prepare_v2(db, "SELECT id, status FROM files WHERE path = ?", -1, &stmt, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "SELECT id from files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_text(stmt, 1, name.c_str(), -1, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "SELECT id from files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_DONE ) {
+        sqlite3_finalize(stmt);
+        return 0;
+    } else if ( status != SQLITE_ROW ) {
+        std::fprintf(stderr, "SELECT id from files: %d\n", status);
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    entry.id     = sqlite3_column_int(stmt, 0);
+    entry.name   = name;
+    entry.status = sqlite3_column_int(stmt, 1);
+
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+//! fileId からファイル名を取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int getFileName(sqlite3* db, FileId fileId, fs::path& name)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(db, "SELECT path FROM files WHERE id = ?", -1, &stmt, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "SELECT path from files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "SELECT path from files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_DONE ) {
+        name.clear();
+        sqlite3_finalize(stmt);
+        return 0;
+    } else if ( status != SQLITE_ROW ) {
+        std::fprintf(stderr, "SELECT path from files: %d\n", status);
+        name.clear();
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+//! 最大のファイル ID を取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! ファイル数の見積もりに使う。ファイルがなければ 0。
+static int getMaxFileId(sqlite3* db, FileId& fileId)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    fileId = 0;
+
+    status = sqlite3_prepare_v2(db, "SELECT MAX(id) FROM files", -1, &stmt, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "getMaxFileId: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_ROW ) {
+        fileId = sqlite3_column_int(stmt, 0);
+        status = SQLITE_DONE;
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getMaxFileId: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! fileId のシーンを取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! scenes はクリアされず追記される。
+static int getScenesByFile(sqlite3* db, FileId fileId, std::vector<Scene>& scenes)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT hash, duration_ms FROM scenes WHERE file_id = ? ORDER BY rowid",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getScenesByFile: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "getScenesByFile: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    while ( status == SQLITE_ROW ) {
+        Hash       hash       = sqlite3_column_int64(stmt, 0);
+        DurationMs durationMs = sqlite3_column_int(stmt, 1);
+
+        scenes.emplace_back(Scene { SceneId { hash, durationMs }, fileId });
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getScenesByFile: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! hash のシーンを取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! scenes はクリアされず追記される。
+static int getScenesByHash(sqlite3* db, const SceneId& sceneId, std::vector<Scene>& scenes)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT DISTINCT file_id FROM scenes WHERE (hash = ? AND duration_ms = ?)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getScenesByHash: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int64(stmt, 1, sqlite3_int64(sceneId.hash));
+    if ( status ) {
+        std::fprintf(stderr, "getScenesByHash: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+    status = sqlite3_bind_int(stmt, 2, sceneId.durationMs);
+    if ( status ) {
+        std::fprintf(stderr, "getScenesByHash: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    while ( status == SQLITE_ROW ) {
+        FileId fileId = sqlite3_column_int(stmt, 0);
+
+        scenes.emplace_back(Scene { sceneId, fileId });
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getScenesByHash: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! 重複したハッシュの上位を取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! hashCounts はクリア後にカウントされる。
+//! hashCounts は duration の降順でソートされている。
+static int getTopHashes(sqlite3* db, int limit, std::vector<HashCount>& hashCounts)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    hashCounts.clear();
+
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT hash, duration_ms, COUNT(hash)"
+        " FROM scenes"
+        " GROUP BY hash, duration_ms"
+        " HAVING COUNT(hash) > 1"
+        " ORDER BY duration_ms DESC"
+        " LIMIT ?",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getTopHashes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, limit);
+    if ( status ) {
+        std::fprintf(stderr, "getTopHashes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    while ( status == SQLITE_ROW ) {
+        Hash       hash       = sqlite3_column_int64(stmt, 0);
+        DurationMs durationMs = sqlite3_column_int(stmt, 1);
+        int        count      = sqlite3_column_int(stmt, 2);
+
+        hashCounts.emplace_back(HashCount { SceneId { hash, durationMs }, count });
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getTopHashes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! sceneId のポスティングリストをビットマップで取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! ビットマップが存在しない場合、found に false が入る。
+static int getPosting(sqlite3* db, const SceneId& sceneId, RoaringBitmap& bitmap, bool& found)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    found = false;
+    bitmap.clear();
+
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT bitmap FROM postings WHERE (hash = ? AND duration_ms = ?)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getPosting: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int64(stmt, 1, sqlite3_int64(sceneId.hash));
+    if ( status ) {
+        std::fprintf(stderr, "getPosting: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int(stmt, 2, sceneId.durationMs);
+    if ( status ) {
+        std::fprintf(stderr, "getPosting: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_ROW ) {
+        const std::uint8_t* data
+            = static_cast<const std::uint8_t*>(sqlite3_column_blob(stmt, 0));
+        std::size_t size = std::size_t(sqlite3_column_bytes(stmt, 0));
+        if ( ! bitmap.deserialize(data, size) ) {
+            std::fprintf(stderr, "getPosting: broken bitmap\n");
+            sqlite3_finalize(stmt);
+            return SQLITE_CORRUPT;
+        }
+        found  = true;
+        status = SQLITE_DONE;
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getPosting: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! sceneId のポスティングリストをビットマップで保存する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! bitmap が空ならビットマップを削除する。
+static int putPosting(sqlite3* db, const SceneId& sceneId, const RoaringBitmap& bitmap)
+{
+    sqlite3_stmt*             stmt = nullptr;
+    int                       status;
+    std::vector<std::uint8_t> blob;
+
+    if ( bitmap.empty() ) {
+        status = sqlite3_prepare_v2(
+            db, "DELETE FROM postings WHERE (hash = ? AND duration_ms = ?)", -1, &stmt, nullptr
+        );
+    } else {
+        bitmap.serialize(blob);
+        status = sqlite3_prepare_v2(
+            db,
+            "INSERT OR REPLACE INTO postings (hash, duration_ms, bitmap) VALUES (?, ?, ?)",
+            -1,
+            &stmt,
+            nullptr
+        );
+    }
+    if ( status ) {
+        std::fprintf(stderr, "putPosting: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int64(stmt, 1, sqlite3_int64(sceneId.hash));
+    if ( status ) {
+        std::fprintf(stderr, "putPosting: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int(stmt, 2, sceneId.durationMs);
+    if ( status ) {
+        std::fprintf(stderr, "putPosting: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    if ( ! blob.empty() ) {
+        status = sqlite3_bind_blob(stmt, 3, blob.data(), int(blob.size()), SQLITE_TRANSIENT);
+        if ( status ) {
+            std::fprintf(stderr, "putPosting: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return status;
+        }
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "putPosting: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! sceneId を含むファイル数を取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! 登録されていなければ 0 を返す。
+static int getFrequency(sqlite3* db, const SceneId& sceneId, int& nFiles)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    nFiles = 0;
+
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT files FROM frequencies WHERE (hash = ? AND duration_ms = ?)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getFrequency: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int64(stmt, 1, sqlite3_int64(sceneId.hash));
+    if ( status ) {
+        std::fprintf(stderr, "getFrequency: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int(stmt, 2, sceneId.durationMs);
+    if ( status ) {
+        std::fprintf(stderr, "getFrequency: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_ROW ) {
+        nFiles = sqlite3_column_int(stmt, 0);
+        status = SQLITE_DONE;
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getFrequency: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! sceneId を含むファイル数を保存する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! nFiles が 0 なら行を削除する。
+static int putFrequency(sqlite3* db, const SceneId& sceneId, int nFiles)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    if ( nFiles == 0 ) {
+        status = sqlite3_prepare_v2(
+            db, "DELETE FROM frequencies WHERE (hash = ? AND duration_ms = ?)", -1, &stmt, nullptr
+        );
+    } else {
+        status = sqlite3_prepare_v2(
+            db,
+            "INSERT OR REPLACE INTO frequencies (hash, duration_ms, files) VALUES (?, ?, ?)",
+            -1,
+            &stmt,
+            nullptr
+        );
+    }
+    if ( status ) {
+        std::fprintf(stderr, "putFrequency: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int64(stmt, 1, sqlite3_int64(sceneId.hash));
+    if ( status ) {
+        std::fprintf(stderr, "putFrequency: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int(stmt, 2, sceneId.durationMs);
+    if ( status ) {
+        std::fprintf(stderr, "putFrequency: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    if ( nFiles != 0 ) {
+        status = sqlite3_bind_int(stmt, 3, nFiles);
+        if ( status ) {
+            std::fprintf(stderr, "putFrequency: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return status;
+        }
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "putFrequency: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! sceneId を含むファイルを列挙する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! ビットマップがあればビットマップを、なければ scenes テーブルを引く。
+//! fileIds はクリアされず追記される。
+static int getPostingFiles(sqlite3* db, const SceneId& sceneId, RoaringBitmap& fileIds)
+{
+    RoaringBitmap posting;
+    bool          found = false;
+
+    if ( int status = getPosting(db, sceneId, posting, found); status ) {
+        return status;
+    }
+    if ( found ) {
+        fileIds.unionWith(posting);
+        return 0;
+    }
+
+    std::vector<Scene> scenes;
+    if ( int status = getScenesByHash(db, sceneId, scenes); status ) {
+        return status;
+    }
+    for ( const Scene& scene : scenes ) {
+        fileIds.add(std::uint32_t(scene.fileId));
+    }
+
+    return 0;
+}
+
+//! fileId のシーンをポスティングビットマップとファイル数に反映する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! fileId のシーンを登録した後に呼ぶ。
+//! 含まれるファイル数が kPostingBitmapThreshold に達したシーンはビットマップを作成する。
+//! 検索結果が変わるので search_generation を増やす。
+static int addToPostings(sqlite3* db, FileId fileId)
+{
+    std::vector<Scene> scenesOfFile;
+    if ( int status = getScenesByFile(db, fileId, scenesOfFile); status ) {
+        return status;
+    }
+
+    std::vector<SceneId> sceneIds;
+    for ( const Scene& scene : scenesOfFile ) {
+        sceneIds.push_back(scene.sceneId);
+    }
+    std::sort(sceneIds.begin(), sceneIds.end());
+    sceneIds.erase(std::unique(sceneIds.begin(), sceneIds.end()), sceneIds.end());
+
+    RoaringBitmap posting;
+    for ( const SceneId& sceneId : sceneIds ) {
+        int nFiles = 0;
+        if ( int status = getFrequency(db, sceneId, nFiles); status ) {
+            return status;
+        }
+        nFiles += 1;
+        if ( int status = putFrequency(db, sceneId, nFiles); status ) {
+            return status;
+        }
+
+        bool found = false;
+        if ( int status = getPosting(db, sceneId, posting, found); status ) {
+            return status;
+        }
+
+        if ( ! found ) {
+            if ( nFiles < kPostingBitmapThreshold ) {
+                continue;
+            }
+
+            // 閾値に達したのでビットマップを作成
+            std::vector<Scene> scenes;
+            if ( int status = getScenesByHash(db, sceneId, scenes); status ) {
+                return status;
+            }
+            for ( const Scene& scene : scenes ) {
+                posting.add(std::uint32_t(scene.fileId));
+            }
+        }
+
+        posting.add(std::uint32_t(fileId));
+        if ( int status = putPosting(db, sceneId, posting); status ) {
+            return status;
+        }
+    }
+
+    // キャッシュした検索結果を無効にする
+    return incrementMeta(db, "search_generation");
+}
+
+//! fileId をポスティングビットマップとファイル数から削除する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! fileId のシーンを削除する前に呼ぶ。
+//! 閾値の半分を下回ったビットマップは削除し、scenes テーブルだけで引くようにする。
+//! 検索結果が変わるので search_generation を増やす。
+static int removeFromPostings(sqlite3* db, FileId fileId)
+{
+    std::vector<Scene> scenesOfFile;
+    if ( int status = getScenesByFile(db, fileId, scenesOfFile); status ) {
+        return status;
+    }
+
+    std::vector<SceneId> sceneIds;
+    for ( const Scene& scene : scenesOfFile ) {
+        sceneIds.push_back(scene.sceneId);
+    }
+    std::sort(sceneIds.begin(), sceneIds.end());
+    sceneIds.erase(std::unique(sceneIds.begin(), sceneIds.end()), sceneIds.end());
+
+    RoaringBitmap posting;
+    for ( const SceneId& sceneId : sceneIds ) {
+        int nFiles = 0;
+        if ( int status = getFrequency(db, sceneId, nFiles); status ) {
+            return status;
+        }
+        if ( nFiles > 0 ) {
+            if ( int status = putFrequency(db, sceneId, nFiles - 1); status ) {
+                return status;
+            }
+        }
+
+        bool found = false;
+        if ( int status = getPosting(db, sceneId, posting, found); status ) {
+            return status;
+        }
+        if ( ! found || ! posting.remove(std::uint32_t(fileId)) ) {
+            continue;
+        }
+
+        if ( posting.cardinality() < kPostingBitmapThreshold / 2 ) {
+            posting.clear();
+        }
+        if ( int status = putPosting(db, sceneId, posting); status ) {
+            return status;
+        }
+    }
+
+    // キャッシュした検索結果を無効にする
+    return incrementMeta(db, "search_generation");
+}
+
+//! ポスティングビットマップを scenes テーブルから作り直す
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int rebuildPostings(sqlite3* db)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    if ( (status = execSql(db, "DELETE FROM postings")) ) {
+        return status;
+    }
+
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT DISTINCT s.hash, s.duration_ms, s.file_id"
+        " FROM scenes AS s"
+        " JOIN ("
+        "SELECT hash, duration_ms FROM scenes"
+        " GROUP BY hash, duration_ms"
+        " HAVING COUNT(DISTINCT file_id) >= ?"
+        ") AS h ON (s.hash = h.hash AND s.duration_ms = h.duration_ms)"
+        " ORDER BY s.hash, s.duration_ms",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "rebuildPostings: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, kPostingBitmapThreshold);
+    if ( status ) {
+        std::fprintf(stderr, "rebuildPostings: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    RoaringBitmap posting;
+    SceneId       current { 0, 0 };
+
+    status = sqlite3_step(stmt);
+    while ( status == SQLITE_ROW ) {
+        Hash       hash       = sqlite3_column_int64(stmt, 0);
+        DurationMs durationMs = sqlite3_column_int(stmt, 1);
+        FileId     fileId     = sqlite3_column_int(stmt, 2);
+
+        SceneId sceneId { hash, durationMs };
+        if ( ! posting.empty() && ! (sceneId == current) ) {
+            if ( int err = putPosting(db, current, posting); err ) {
+                sqlite3_finalize(stmt);
+                return err;
+            }
+            posting.clear();
+        }
+        current = sceneId;
+        posting.add(std::uint32_t(fileId));
+
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "rebuildPostings: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    if ( ! posting.empty() ) {
+        return putPosting(db, current, posting);
+    }
+
+    return 0;
+}
+
+//! シーンごとのファイル数を scenes テーブルから作り直す
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int rebuildFrequencies(sqlite3* db)
+{
+    if ( int status = execSql(db, "DELETE FROM frequencies"); status ) {
+        return status;
+    }
+
+    return execSql(
+        db,
+        "INSERT INTO frequencies (hash, duration_ms, files)"
+        " SELECT hash, duration_ms, COUNT(DISTINCT file_id) FROM scenes"
+        " GROUP BY hash, duration_ms"
+    );
+}
+
+//! name を DB に登録する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int registerFile(sqlite3* db, const fs::path& name)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(
+        db, "INSERT INTO files (path, status) VALUES (?, ?)", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_text(stmt, 1, name.c_str(), -1, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 2, FileStatus::kNone);
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "INSERT INTO files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! status を DB に登録する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int updateFileStatus(sqlite3* db, FileId fileId, FileStatus fileStatus)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(db, "UPDATE files SET status = ? WHERE id = ?", -1, &stmt, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "updateFileStatus: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileStatus);
+    if ( status ) {
+        std::fprintf(stderr, "updateFileStatus: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 2, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "updateFileStatus: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "updateFileStatus: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! scene を DB に登録する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int registerScene(sqlite3* db, const Scene& scene)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(
+        db, "INSERT INTO scenes (hash, duration_ms, file_id) VALUES (?, ?, ?)", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO scenes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int64(stmt, 1, sqlite3_int64(scene.sceneId.hash));
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO scenes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+    status = sqlite3_bind_int(stmt, 2, scene.sceneId.durationMs);
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO scenes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+    status = sqlite3_bind_int(stmt, 3, scene.fileId);
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO scenes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "INSERT INTO scenes: %d\n", status);
+        return status;
+    }
+    VIDUP_PROBE3(scene_registered, scene.fileId, scene.sceneId.hash, scene.sceneId.durationMs);
+
+    return 0;
+}
+
+//! 要約のバケットのファイルを取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! 行がなければ files は空になる。
+static int getSketchBucket(sqlite3* db, std::uint32_t bucket, RoaringBitmap& files)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    files.clear();
+
+    status = sqlite3_prepare_v2(
+        db, "SELECT files FROM sketch_buckets WHERE bucket = ?", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getSketchBucket: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int64(stmt, 1, bucket);
+    if ( status ) {
+        std::fprintf(stderr, "getSketchBucket: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_ROW ) {
+        const std::uint8_t* data
+            = static_cast<const std::uint8_t*>(sqlite3_column_blob(stmt, 0));
+        std::size_t size = std::size_t(sqlite3_column_bytes(stmt, 0));
+        if ( ! files.deserialize(data, size) ) {
+            std::fprintf(stderr, "getSketchBucket: broken bitmap\n");
+            sqlite3_finalize(stmt);
+            return SQLITE_CORRUPT;
+        }
+        status = SQLITE_DONE;
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getSketchBucket: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! 要約のバケットのファイルを保存する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! files が空なら行を削除する。
+static int putSketchBucket(sqlite3* db, std::uint32_t bucket, const RoaringBitmap& files)
+{
+    sqlite3_stmt*             stmt = nullptr;
+    int                       status;
+    std::vector<std::uint8_t> blob;
+
+    if ( files.empty() ) {
+        status = sqlite3_prepare_v2(
+            db, "DELETE FROM sketch_buckets WHERE bucket = ?", -1, &stmt, nullptr
+        );
+    } else {
+        files.serialize(blob);
+        status = sqlite3_prepare_v2(
+            db,
+            "INSERT OR REPLACE INTO sketch_buckets (bucket, files) VALUES (?, ?)",
+            -1,
+            &stmt,
+            nullptr
+        );
+    }
+    if ( status ) {
+        std::fprintf(stderr, "putSketchBucket: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int64(stmt, 1, bucket);
+    if ( status ) {
+        std::fprintf(stderr, "putSketchBucket: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    if ( ! blob.empty() ) {
+        status = sqlite3_bind_blob(stmt, 2, blob.data(), int(blob.size()), SQLITE_TRANSIENT);
+        if ( status ) {
+            std::fprintf(stderr, "putSketchBucket: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return status;
+        }
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "putSketchBucket: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! sceneSet のシーンのバケットを重複なく列挙する
+static std::vector<std::uint32_t> getSketchBuckets(const SceneSet& sceneSet)
+{
+    std::vector<std::uint32_t> buckets;
+    buckets.reserve(sceneSet.keys.size());
+    for ( std::uint64_t key : sceneSet.keys ) {
+        buckets.push_back(sketchBucket(key));
+    }
+    std::sort(buckets.begin(), buckets.end());
+    buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+    return buckets;
+}
+
+//! fileId を要約のバケットから削除する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! fileId のシーンを削除する前に呼ぶ。
+static int removeFromSketchBuckets(sqlite3* db, FileId fileId)
+{
+    std::vector<Scene> scenesOfFile;
+    SceneSet           sceneSet;
+    if ( int status = getScenesByFile(db, fileId, scenesOfFile); status ) {
+        return status;
+    }
+    makeSceneSet(scenesOfFile, sceneSet);
+
+    RoaringBitmap files;
+    for ( std::uint32_t bucket : getSketchBuckets(sceneSet) ) {
+        if ( int status = getSketchBucket(db, bucket, files); status ) {
+            return status;
+        }
+        if ( ! files.remove(std::uint32_t(fileId)) ) {
+            continue;
+        }
+        if ( int status = putSketchBucket(db, bucket, files); status ) {
+            return status;
+        }
+    }
+
+    return 0;
+}
+
+//! fileId のシーンから要約を作って DB に登録する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! fileId のシーンを登録した後に呼ぶ。
+//! buckets が nullptr でなければ、sketch_buckets に書かずに buckets の各バケットに加える。
+static int
+registerSketch(sqlite3* db, FileId fileId, std::vector<RoaringBitmap>* buckets = nullptr)
+{
+    sqlite3_stmt*              stmt = nullptr;
+    int                        status;
+    std::vector<Scene>         scenesOfFile;
+    SceneSet                   sceneSet;
+    std::vector<std::uint64_t> bloom;
+    std::int64_t               totalMs = 0;
+
+    if ( (status = getScenesByFile(db, fileId, scenesOfFile)) ) {
+        return status;
+    }
+    for ( const Scene& scene : scenesOfFile ) {
+        totalMs += scene.sceneId.durationMs;
+    }
+    makeSceneSet(scenesOfFile, sceneSet);
+    SceneBloom::build(sceneSet, bloom);
+
+    RoaringBitmap files;
+    for ( std::uint32_t bucket : getSketchBuckets(sceneSet) ) {
+        if ( buckets ) {
+            (*buckets)[bucket].add(std::uint32_t(fileId));
+            continue;
+        }
+        if ( (status = getSketchBucket(db, bucket, files)) ) {
+            return status;
+        }
+        files.add(std::uint32_t(fileId));
+        if ( (status = putSketchBucket(db, bucket, files)) ) {
+            return status;
+        }
+    }
+
+    status = sqlite3_prepare_v2(
+        db,
+        "INSERT OR REPLACE INTO sketches (file_id, total_ms, bloom) VALUES (?, ?, ?)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO sketches: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO sketches: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int64(stmt, 2, totalMs);
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO sketches: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_blob(
+        stmt, 3, bloom.data(), int(bloom.size() * sizeof(std::uint64_t)), SQLITE_TRANSIENT
+    );
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO sketches: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "INSERT INTO sketches: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! fileIds の要約を列挙する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! f(fileId, totalMs, words, nWords) を呼ぶ。words は f の中でだけ有効。
+//! 要約のないファイルは飛ばす。
+template <typename F>
+static int forEachSketch(sqlite3* db, const RoaringBitmap& fileIds, F&& f)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(
+        db, "SELECT total_ms, bloom FROM sketches WHERE file_id = ?", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "forEachSketch: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = SQLITE_DONE;
+    fileIds.forEach([&](std::uint32_t id) {
+        if ( status != SQLITE_DONE ) {
+            return;
+        }
+        FileId fileId = FileId(id);
+        if ( (status = sqlite3_bind_int(stmt, 1, fileId)) ) {
+            return;
+        }
+
+        status = sqlite3_step(stmt);
+        if ( status == SQLITE_ROW ) {
+            std::int64_t         totalMs = sqlite3_column_int64(stmt, 0);
+            const std::uint64_t* words
+                = static_cast<const std::uint64_t*>(sqlite3_column_blob(stmt, 1));
+            std::size_t nWords
+                = std::size_t(sqlite3_column_bytes(stmt, 1)) / sizeof(std::uint64_t);
+
+            // ビット数が 2 のべき乗でなければ壊れている
+            if ( nWords > 0 && (nWords & (nWords - 1)) == 0 ) {
+                f(fileId, totalMs, words, nWords);
+            }
+            status = SQLITE_DONE;
+        }
+        sqlite3_reset(stmt);
+    });
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "forEachSketch: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! すべてのファイルの要約を作り直す
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int rebuildSketches(sqlite3* db)
+{
+    sqlite3_stmt*       stmt = nullptr;
+    int                 status;
+    std::vector<FileId> fileIds;
+
+    status = sqlite3_prepare_v2(db, "SELECT id FROM files WHERE status = ?", -1, &stmt, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "rebuildSketches: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, FileStatus::kAnalyzed);
+    if ( status ) {
+        std::fprintf(stderr, "rebuildSketches: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    while ( status == SQLITE_ROW ) {
+        fileIds.push_back(sqlite3_column_int(stmt, 0));
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "rebuildSketches: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    // バケットはまとめてから書く
+    if ( (status = execSql(db, "DELETE FROM sketch_buckets")) ) {
+        return status;
+    }
+    std::vector<RoaringBitmap> buckets(std::size_t(1) << kSketchBucketBits);
+    for ( FileId fileId : fileIds ) {
+        if ( (status = registerSketch(db, fileId, &buckets)) ) {
+            return status;
+        }
+    }
+    for ( std::size_t bucket = 0; bucket < buckets.size(); bucket += 1 ) {
+        if ( buckets[bucket].empty() ) {
+            continue;
+        }
+        if ( (status = putSketchBucket(db, std::uint32_t(bucket), buckets[bucket])) ) {
+            return status;
+        }
+    }
+
+    return 0;
+}
+
+//! fileId の特徴ベクトルを DB に登録する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! 近似最近傍探索の索引を作り直すため embedding_generation を増やす。
+static int registerEmbedding(sqlite3* db, FileId fileId, const Embedding& embedding)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(
+        db, "INSERT OR REPLACE INTO embeddings (file_id, vector) VALUES (?, ?)", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO embeddings: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO embeddings: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_blob(
+        stmt, 2, embedding.data(), int(sizeof(float) * embedding.size()), SQLITE_TRANSIENT
+    );
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO embeddings: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "INSERT INTO embeddings: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return incrementMeta(db, "embedding_generation");
+}
+
+//! fileId のシーンのサムネイルを DB に登録する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int
+registerThumbnails(sqlite3* db, FileId fileId, const std::vector<std::uint8_t>& thumbnails)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(
+        db, "INSERT OR REPLACE INTO thumbnails (file_id, frames) VALUES (?, ?)", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO thumbnails: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO thumbnails: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_blob(
+        stmt, 2, thumbnails.data(), int(thumbnails.size()), SQLITE_TRANSIENT
+    );
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO thumbnails: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "INSERT INTO thumbnails: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! fileId のシーンのサムネイルを取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! サムネイルがなければ (古い DB で登録したファイル) thumbnails は空になる。
+static int getThumbnails(sqlite3* db, FileId fileId, std::vector<std::uint8_t>& thumbnails)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    thumbnails.clear();
+
+    status = sqlite3_prepare_v2(
+        db, "SELECT frames FROM thumbnails WHERE file_id = ?", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getThumbnails: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "getThumbnails: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_ROW ) {
+        const std::uint8_t* frames = static_cast<const std::uint8_t*>(sqlite3_column_blob(stmt, 0));
+        thumbnails.assign(frames, frames + sqlite3_column_bytes(stmt, 0));
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getThumbnails: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! 解析の途中の状態 (checkpoints テーブル)
+//!
+//! シーンの切れ目でとるので、開いているシーンのハッシュやフレームは持たない。
+//! iFrame から読み直せば、止まらなかったときと同じシーンが続く。
+struct Checkpoint {
+    std::uint32_t             iFrame = 0; //!< 次に解析するフレーム (新しいシーンの先頭)
+    std::vector<std::uint8_t> lastFrame;  //!< iFrame の直前のフレーム (kFrameSize バイト)
+    std::vector<SceneId>      scenes;     //!< 閉じたシーン
+    std::vector<std::uint8_t> thumbnails; //!< 閉じたシーンのサムネイル
+    EmbeddingBuilder          embedding;  //!< 閉じたシーンまでの特徴ベクトル
+};
+
+// 途中の特徴ベクトルはそのまま BLOB にする
+static_assert(
+    std::is_trivially_copyable<EmbeddingBuilder>::value, "EmbeddingBuilder is saved as is"
+);
+
+//! checkpoints テーブルに保存する閉じたシーン 1 件
+struct CheckpointScene {
+    std::uint64_t hash;
+    std::uint64_t durationMs;
+};
+
+//! fileId の解析の途中の状態を DB に保存する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int putCheckpoint(sqlite3* db, FileId fileId, const Checkpoint& checkpoint)
+{
+    sqlite3_stmt*                stmt = nullptr;
+    int                          status;
+    std::vector<CheckpointScene> scenes;
+
+    for ( const SceneId& sceneId : checkpoint.scenes ) {
+        scenes.push_back({ sceneId.hash, sceneId.durationMs });
+    }
+
+    status = sqlite3_prepare_v2(
+        db,
+        "INSERT OR REPLACE INTO checkpoints"
+        " (file_id, frame_index, last_frame, scenes, thumbnails, embedding)"
+        " VALUES (?, ?, ?, ?, ?, ?)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "putCheckpoint: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "putCheckpoint: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int64(stmt, 2, checkpoint.iFrame);
+    if ( status ) {
+        std::fprintf(stderr, "putCheckpoint: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_blob(
+        stmt, 3, checkpoint.lastFrame.data(), int(checkpoint.lastFrame.size()), SQLITE_STATIC
+    );
+    if ( status ) {
+        std::fprintf(stderr, "putCheckpoint: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_blob(
+        stmt, 4, scenes.data(), int(scenes.size() * sizeof(CheckpointScene)), SQLITE_STATIC
+    );
+    if ( status ) {
+        std::fprintf(stderr, "putCheckpoint: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_blob(
+        stmt, 5, checkpoint.thumbnails.data(), int(checkpoint.thumbnails.size()), SQLITE_STATIC
+    );
+    if ( status ) {
+        std::fprintf(stderr, "putCheckpoint: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_blob(
+        stmt, 6, &checkpoint.embedding, int(sizeof(EmbeddingBuilder)), SQLITE_STATIC
+    );
+    if ( status ) {
+        std::fprintf(stderr, "putCheckpoint: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "putCheckpoint: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! fileId の解析の途中の状態を取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! なければ found に false が入る。
+static int getCheckpoint(sqlite3* db, FileId fileId, Checkpoint& checkpoint, bool& found)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    found = false;
+
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT frame_index, last_frame, scenes, thumbnails, embedding"
+        " FROM checkpoints WHERE file_id = ?",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getCheckpoint: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "getCheckpoint: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_ROW ) {
+        const void* lastFrame  = sqlite3_column_blob(stmt, 1);
+        const void* scenes     = sqlite3_column_blob(stmt, 2);
+        const void* thumbnails = sqlite3_column_blob(stmt, 3);
+        std::size_t nScenes    = std::size_t(sqlite3_column_bytes(stmt, 2))
+                            / sizeof(CheckpointScene);
+
+        checkpoint.iFrame = std::uint32_t(sqlite3_column_int64(stmt, 0));
+        checkpoint.lastFrame.resize(std::size_t(sqlite3_column_bytes(stmt, 1)));
+        std::memcpy(checkpoint.lastFrame.data(), lastFrame, checkpoint.lastFrame.size());
+        checkpoint.scenes.resize(nScenes);
+        for ( std::size_t i = 0; i < nScenes; i += 1 ) {
+            CheckpointScene scene;
+            std::memcpy(&scene, &static_cast<const CheckpointScene*>(scenes)[i], sizeof(scene));
+            checkpoint.scenes[i] = { scene.hash, DurationMs(scene.durationMs) };
+        }
+        checkpoint.thumbnails.resize(std::size_t(sqlite3_column_bytes(stmt, 3)));
+        std::memcpy(checkpoint.thumbnails.data(), thumbnails, checkpoint.thumbnails.size());
+
+        // 壊れていたら使わない
+        found = checkpoint.lastFrame.size() == kFrameSize
+             && std::size_t(sqlite3_column_bytes(stmt, 4)) == sizeof(EmbeddingBuilder)
+             && checkpoint.thumbnails.size() == nScenes * kThumbnailSize;
+        if ( found ) {
+            std::memcpy(
+                &checkpoint.embedding, sqlite3_column_blob(stmt, 4), sizeof(EmbeddingBuilder)
+            );
+        }
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getCheckpoint: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! fileId の解析の途中の状態を消す
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int deleteCheckpoint(sqlite3* db, FileId fileId)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(
+        db, "DELETE FROM checkpoints WHERE file_id = ?", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "deleteCheckpoint: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "deleteCheckpoint: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "deleteCheckpoint: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! search_cache の results の 1 件のバイト数
+//!
+//! 1 件は fileId (i32), scenes (i32), seconds (f64) の順に詰める。
+static const std::size_t kCachedMatchSize = 4 + 4 + 8;
+
+//! ハンドルが覚えておく searchFile() の結果
+//!
+//! search_generation が変わったら捨てるので、ほかのプロセスの変更でも古い結果は返さない。
+struct SearchCache {
+    //! (fileId, limit, flags)
+    typedef std::tuple<FileId, int, int> Key;
+
+    std::int64_t                      generation = -1; //!< entries の search_generation
+    std::map<Key, std::vector<Match>> entries;
+};
+
+//! SearchCache に覚えておく結果の数の上限 (超えたら捨てる)
+static const std::size_t kMaxCachedSearches = 1024;
+
+//! キャッシュした searchFile() の結果を取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! generation の結果がなければ found に false が入る。
+static int getCachedSearch(
+    sqlite3*            db,
+    FileId              fileId,
+    int                 limit,
+    int                 flags,
+    std::int64_t        generation,
+    std::vector<Match>& matches,
+    bool&               found
+)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    found = false;
+    matches.clear();
+
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT results FROM search_cache"
+        " WHERE (file_id = ? AND result_limit = ? AND flags = ? AND generation = ?)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getCachedSearch: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "getCachedSearch: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int(stmt, 2, limit);
+    if ( status ) {
+        std::fprintf(stderr, "getCachedSearch: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int(stmt, 3, flags);
+    if ( status ) {
+        std::fprintf(stderr, "getCachedSearch: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int64(stmt, 4, generation);
+    if ( status ) {
+        std::fprintf(stderr, "getCachedSearch: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_ROW ) {
+        const std::uint8_t* data
+            = static_cast<const std::uint8_t*>(sqlite3_column_blob(stmt, 0));
+        std::size_t size = std::size_t(sqlite3_column_bytes(stmt, 0));
+
+        // 大きさが合わなければ壊れているので使わない
+        found = size % kCachedMatchSize == 0;
+        for ( std::size_t offset = 0; found && offset < size; offset += kCachedMatchSize ) {
+            std::int32_t fileId  = 0;
+            std::int32_t scenes  = 0;
+            double       seconds = 0;
+            std::memcpy(&fileId, data + offset, 4);
+            std::memcpy(&scenes, data + offset + 4, 4);
+            std::memcpy(&seconds, data + offset + 8, 8);
+            matches.push_back({ fileId, -1, scenes, seconds, 0 });
+        }
+        status = SQLITE_DONE;
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getCachedSearch: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! searchFile() の結果をキャッシュに保存する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! 保存できなくても検索は成功するので、エラーは出力しない。ほかの接続が書き込んでいれば
+//! (SQLITE_BUSY) 待たずに諦める。
+static int putCachedSearch(
+    sqlite3*                  db,
+    FileId                    fileId,
+    int                       limit,
+    int                       flags,
+    std::int64_t              generation,
+    const std::vector<Match>& matches
+)
+{
+    sqlite3_stmt*             stmt = nullptr;
+    int                       status;
+    std::vector<std::uint8_t> blob(matches.size() * kCachedMatchSize);
+
+    for ( std::size_t i = 0; i < matches.size(); i += 1 ) {
+        std::uint8_t* dest    = &blob[i * kCachedMatchSize];
+        std::int32_t  fileId  = matches[i].fileId;
+        std::int32_t  scenes  = matches[i].scenes;
+        double        seconds = matches[i].seconds;
+        std::memcpy(dest, &fileId, 4);
+        std::memcpy(dest + 4, &scenes, 4);
+        std::memcpy(dest + 8, &seconds, 8);
+    }
+
+    status = sqlite3_prepare_v2(
+        db,
+        "INSERT OR REPLACE INTO search_cache"
+        " (file_id, result_limit, flags, generation, results) VALUES (?, ?, ?, ?, ?)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        return status;
+    }
+
+    // 結果がなければ NULL になる
+    if ( sqlite3_bind_int(stmt, 1, fileId) || sqlite3_bind_int(stmt, 2, limit)
+         || sqlite3_bind_int(stmt, 3, flags) || sqlite3_bind_int64(stmt, 4, generation)
+         || sqlite3_bind_blob(stmt, 5, blob.data(), int(blob.size()), SQLITE_TRANSIENT) ) {
+        status = sqlite3_errcode(db);
+        sqlite3_finalize(stmt);
+        return status ? status : 1;
+    }
+
+    // ロックを待たない
+    sqlite3_busy_timeout(db, 0);
+    status = sqlite3_step(stmt);
+    sqlite3_busy_timeout(db, kBusyTimeoutMs);
+    sqlite3_finalize(stmt);
+
+    return status == SQLITE_DONE ? 0 : status;
+}
+
+//! フレームの保管庫の情報 (archives の行)
+struct ArchiveInfo {
+    int                 frameRate   = 0;
+    std::uint32_t       frameCount  = 0;
+    std::uint32_t       blockFrames = 0; //!< 1 ブロックのフレーム数 (最後のブロックは半端)
+    std::vector<double> timestamps;      //!< 空ならフレームレートから時刻を求める
+};
+
+//! fileId のフレームの保管庫を DB に登録する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int registerArchive(
+    sqlite3*                   db,
+    FileId                     fileId,
+    int                        frameRate,
+    const std::vector<double>& timestamps,
+    const FrameArchiveBuilder& archive
+)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(
+        db,
+        "INSERT OR REPLACE INTO archives"
+        " (file_id, frame_rate, frame_count, block_frames, timestamps) VALUES (?, ?, ?, ?, ?)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO archives: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO archives: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int(stmt, 2, frameRate);
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO archives: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int64(stmt, 3, archive.frameCount());
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO archives: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int64(stmt, 4, kArchiveBlockFrames);
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO archives: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_blob(
+        stmt, 5, timestamps.data(), int(timestamps.size() * sizeof(double)), SQLITE_TRANSIENT
+    );
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO archives: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "INSERT INTO archives: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_prepare_v2(
+        db,
+        "INSERT OR REPLACE INTO archive_blocks (file_id, block, data) VALUES (?, ?, ?)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "INSERT INTO archive_blocks: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    const std::vector<std::vector<std::uint8_t>>& blocks = archive.blocks();
+    for ( std::size_t i = 0; i < blocks.size(); i += 1 ) {
+        status = sqlite3_bind_int(stmt, 1, fileId);
+        if ( status ) {
+            std::fprintf(stderr, "INSERT INTO archive_blocks: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return status;
+        }
+        status = sqlite3_bind_int64(stmt, 2, std::int64_t(i));
+        if ( status ) {
+            std::fprintf(stderr, "INSERT INTO archive_blocks: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return status;
+        }
+        status = sqlite3_bind_blob(stmt, 3, blocks[i].data(), int(blocks[i].size()), SQLITE_STATIC);
+        if ( status ) {
+            std::fprintf(stderr, "INSERT INTO archive_blocks: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return status;
+        }
+
+        status = sqlite3_step(stmt);
+        if ( status != SQLITE_DONE ) {
+            std::fprintf(stderr, "INSERT INTO archive_blocks: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return status;
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    return 0;
+}
+
+//! fileId のフレームの保管庫の情報を取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int getArchive(sqlite3* db, FileId fileId, ArchiveInfo& info, bool& found)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    found = false;
+
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT frame_rate, frame_count, block_frames, timestamps FROM archives WHERE file_id = ?",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getArchive: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "getArchive: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    if ( status == SQLITE_ROW ) {
+        const double* timestamps = static_cast<const double*>(sqlite3_column_blob(stmt, 3));
+        std::size_t   nTimestamps = std::size_t(sqlite3_column_bytes(stmt, 3)) / sizeof(double);
+
+        info.frameRate   = sqlite3_column_int(stmt, 0);
+        info.frameCount  = std::uint32_t(sqlite3_column_int64(stmt, 1));
+        info.blockFrames = std::uint32_t(sqlite3_column_int64(stmt, 2));
+        info.timestamps.assign(timestamps, timestamps + nTimestamps);
+        found  = info.blockFrames > 0;
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getArchive: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+// 保管庫から読み戻すのは --archive-frames だけ
+#ifdef VIDUP_DEBUG_COMMANDS
+
+//! 保管庫から [iFirstFrame, iFirstFrame + nFrames) のフレームを 4-bit に詰めたまま読む
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! 含まれるブロックだけを読んで戻す。保管庫の終わりを超えた分は読まない。
+static int readArchiveFrames(
+    sqlite3*                   db,
+    FileId                     fileId,
+    const ArchiveInfo&         info,
+    std::uint32_t              iFirstFrame,
+    std::size_t                nFrames,
+    std::vector<std::uint8_t>& packed
+)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    packed.clear();
+    if ( iFirstFrame >= info.frameCount || nFrames == 0 ) {
+        return 0;
+    }
+    nFrames = std::min<std::size_t>(nFrames, info.frameCount - iFirstFrame);
+
+    std::uint32_t iEndFrame   = std::uint32_t(iFirstFrame + nFrames);
+    std::uint32_t iFirstBlock = iFirstFrame / info.blockFrames;
+    std::uint32_t iLastBlock  = (iEndFrame - 1) / info.blockFrames;
+
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT block, data FROM archive_blocks"
+        " WHERE file_id = ? AND block BETWEEN ? AND ? ORDER BY block",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "readArchiveFrames: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "readArchiveFrames: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int64(stmt, 2, iFirstBlock);
+    if ( status ) {
+        std::fprintf(stderr, "readArchiveFrames: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+    status = sqlite3_bind_int64(stmt, 3, iLastBlock);
+    if ( status ) {
+        std::fprintf(stderr, "readArchiveFrames: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    std::vector<std::uint8_t> blockFrames(std::size_t(info.blockFrames) * kPackedFrameSize);
+    std::uint32_t             iBlock = iFirstBlock;
+    while ( (status = sqlite3_step(stmt)) == SQLITE_ROW ) {
+        std::uint32_t iBegin = iBlock * info.blockFrames;
+        std::uint32_t nBlock = std::min(info.blockFrames, info.frameCount - iBegin);
+        const std::uint8_t* data = static_cast<const std::uint8_t*>(sqlite3_column_blob(stmt, 1));
+        std::size_t         size = std::size_t(sqlite3_column_bytes(stmt, 1));
+
+        if ( sqlite3_column_int64(stmt, 0) != iBlock
+             || ! decompressFrames(data, size, nBlock, blockFrames.data()) ) {
+            std::fprintf(stderr, "readArchiveFrames: broken block %u of file %d\n", iBlock, fileId);
+            sqlite3_finalize(stmt);
+            return SQLITE_CORRUPT;
+        }
+
+        std::uint32_t iCopyBegin = std::max(iBegin, iFirstFrame);
+        std::uint32_t iCopyEnd   = std::min(iBegin + nBlock, iEndFrame);
+        packed.insert(
+            packed.end(),
+            blockFrames.data() + (iCopyBegin - iBegin) * kPackedFrameSize,
+            blockFrames.data() + (iCopyEnd - iBegin) * kPackedFrameSize
+        );
+        iBlock += 1;
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "readArchiveFrames: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+    if ( iBlock != iLastBlock + 1 ) {
+        std::fprintf(stderr, "readArchiveFrames: missing block %u of file %d\n", iBlock, fileId);
+        return SQLITE_CORRUPT;
+    }
+
+    return 0;
+}
+
+#endif // VIDUP_DEBUG_COMMANDS
+
+//! 圧縮したままの保管庫のブロックをブロック番号の順に取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+static int
+getArchiveBlocks(sqlite3* db, FileId fileId, std::vector<std::vector<std::uint8_t>>& blocks)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    blocks.clear();
+
+    status = sqlite3_prepare_v2(
+        db, "SELECT data FROM archive_blocks WHERE file_id = ? ORDER BY block", -1, &stmt, nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getArchiveBlocks: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "getArchiveBlocks: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    while ( status == SQLITE_ROW ) {
+        const std::uint8_t* data = static_cast<const std::uint8_t*>(sqlite3_column_blob(stmt, 0));
+        blocks.emplace_back(data, data + sqlite3_column_bytes(stmt, 0));
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getArchiveBlocks: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! 登録済みのファイルのうち保管庫のあるものを列挙する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! 保管庫のないファイルは数だけを nUnarchived に返す。
+static int
+getArchivedFiles(sqlite3* db, std::vector<FileId>& fileIds, std::int64_t& nUnarchived)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    fileIds.clear();
+    nUnarchived = 0;
+
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT id, id IN (SELECT file_id FROM archives) FROM files WHERE status = ? ORDER BY id",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getArchivedFiles: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, FileStatus::kAnalyzed);
+    if ( status ) {
+        std::fprintf(stderr, "getArchivedFiles: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    while ( status == SQLITE_ROW ) {
+        if ( sqlite3_column_int(stmt, 1) ) {
+            fileIds.push_back(sqlite3_column_int(stmt, 0));
+        } else {
+            nUnarchived += 1;
+        }
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getArchivedFiles: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! 特徴ベクトルを取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! fileId が負ならすべてのファイルの特徴ベクトルを取得する。
+//! embeddings はクリアされず追記される。
+static int getEmbeddings(
+    sqlite3* db, FileId fileId, std::vector<std::pair<FileId, Embedding>>& embeddings
+)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    if ( fileId < 0 ) {
+        status = sqlite3_prepare_v2(
+            db, "SELECT file_id, vector FROM embeddings", -1, &stmt, nullptr
+        );
+    } else {
+        status = sqlite3_prepare_v2(
+            db, "SELECT file_id, vector FROM embeddings WHERE file_id = ?", -1, &stmt, nullptr
+        );
+    }
+    if ( status ) {
+        std::fprintf(stderr, "getEmbeddings: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    if ( fileId >= 0 ) {
+        status = sqlite3_bind_int(stmt, 1, fileId);
+        if ( status ) {
+            std::fprintf(stderr, "getEmbeddings: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return status;
+        }
+    }
+
+    status = sqlite3_step(stmt);
+    while ( status == SQLITE_ROW ) {
+        Embedding embedding {};
+        if ( std::size_t(sqlite3_column_bytes(stmt, 1)) == sizeof(float) * embedding.size() ) {
+            std::memcpy(embedding.data(), sqlite3_column_blob(stmt, 1), sizeof(embedding));
+            embeddings.emplace_back(sqlite3_column_int(stmt, 0), embedding);
+        }
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getEmbeddings: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! 特徴ベクトルをファイル名とともに取得する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! name が nullptr ならすべてのファイルの特徴ベクトルを取得する。
+//! entries はクリアされず追記される。
+static int getNamedEmbeddings(
+    sqlite3* db, const char* name, std::vector<std::pair<FileId, AnnEntry>>& entries
+)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    if ( ! name ) {
+        status = sqlite3_prepare_v2(
+            db,
+            "SELECT f.id, f.path, e.vector FROM embeddings e JOIN files f ON f.id = e.file_id",
+            -1,
+            &stmt,
+            nullptr
+        );
+    } else {
+        status = sqlite3_prepare_v2(
+            db,
+            "SELECT f.id, f.path, e.vector FROM embeddings e JOIN files f ON f.id = e.file_id"
+            " WHERE f.path = ?",
+            -1,
+            &stmt,
+            nullptr
+        );
+    }
+    if ( status ) {
+        std::fprintf(stderr, "getNamedEmbeddings: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    if ( name ) {
+        status = sqlite3_bind_text(stmt, 1, name, -1, nullptr);
+        if ( status ) {
+            std::fprintf(stderr, "getNamedEmbeddings: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return status;
+        }
+    }
+
+    status = sqlite3_step(stmt);
+    while ( status == SQLITE_ROW ) {
+        AnnEntry entry {};
+        if ( std::size_t(sqlite3_column_bytes(stmt, 2)) == sizeof(entry.embedding) ) {
+            entry.name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+            std::memcpy(
+                entry.embedding.data(), sqlite3_column_blob(stmt, 2), sizeof(entry.embedding)
+            );
+            entries.emplace_back(sqlite3_column_int(stmt, 0), std::move(entry));
+        }
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getNamedEmbeddings: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! ファイルを DB から削除する
+//!
+//! @return 成功なら 0、失敗なら sqlite3 のエラーコード
+//!
+//! ファイルに紐づくシーンもすべて削除される。
+static int deleteFile(sqlite3* db, FileId fileId)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    // scenes は CASCADE で消えるが、ビットマップは自前で消す
+    if ( (status = removeFromPostings(db, fileId)) ) {
+        return status;
+    }
+    if ( (status = removeFromSketchBuckets(db, fileId)) ) {
+        return status;
+    }
+
+    status = sqlite3_prepare_v2(db, "DELETE FROM files WHERE id = ?", -1, &stmt, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "DELETE FROM files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_bind_int(stmt, 1, fileId);
+    if ( status ) {
+        std::fprintf(stderr, "DELETE FROM files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "DELETE FROM files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    // embeddings も CASCADE で消えるので索引を作り直させる
+    return incrementMeta(db, "embedding_generation");
+}
+
+//! フレーム番号から時刻を求める
+//!
+//! タイムスタンプがあればそれを使い、なければ一定のフレームレートとみなす。
+class FrameClock {
+public:
+    //! timestamps はフレームごとの表示時刻 (ms)。空ならフレームレートから求める。
+    FrameClock(int frameRate, std::vector<double> timestamps = {})
+        : m_FrameRate(frameRate)
+        , m_Timestamps(std::move(timestamps))
+    {
+    }
+
+    //! フレーム [iBegin, iEnd) の長さを求める
+    //!
+    //! @return タイムスタンプが足りなければ false
+    //!
+    //! 最後のフレームの長さは直前のフレームと同じとみなす。
+    bool duration(std::uint32_t iBegin, std::uint32_t iEnd, DurationMs& durationMs) const
+    {
+        if ( m_Timestamps.empty() ) {
+            durationMs = (iEnd - iBegin) * 1000 / m_FrameRate;
+            return true;
+        }
+
+        double end;
+        if ( ! timestamp(iEnd, end) ) {
+            return false;
+        }
+        // ファイル上の丸め誤差でフレームレートから求めた値とずれないように少し足す
+        durationMs = DurationMs(std::floor(end - m_Timestamps[iBegin] + 0.005));
+        return true;
+    }
+
+    int frameRate() const { return m_FrameRate; }
+
+    const std::vector<double>& timestamps() const { return m_Timestamps; }
+
+    //! デバッグ表示用の秒
+    double seconds(std::uint32_t i) const
+    {
+        double ms;
+        if ( m_Timestamps.empty() || ! timestamp(i, ms) ) {
+            return double(i) / m_FrameRate;
+        }
+        return (ms - m_Timestamps.front()) / 1000.0;
+    }
+
+private:
+    int                 m_FrameRate;
+    std::vector<double> m_Timestamps;
+
+    bool timestamp(std::uint32_t i, double& ms) const
+    {
+        std::size_t n = m_Timestamps.size();
+        if ( i < n ) {
+            ms = m_Timestamps[i];
+        } else if ( i == n && n >= 2 ) {
+            ms = m_Timestamps[n - 1] * 2 - m_Timestamps[n - 2];
+        } else if ( i == n ) {
+            ms = m_Timestamps[n - 1] + 1000.0 / m_FrameRate;
+        } else {
+            return false;
+        }
+        return true;
+    }
+};
+
+//! フレームを順に受け取ってシーンの切れ目を検出する
+//!
+//! frameStride が 2 以上なら frameStride 先のフレームと比べ、変化が小さければ間のフレームを
+//! 比べずに飛ばす。変化が大きいときだけ間を 1 フレームずつ比べるので、間で大きく変わって
+//! すぐに戻る場合 (フラッシュなど) を除いて全フレームを比べたときと同じ位置で切れる。
+//! このときシーンハッシュはシーンの先頭から frameStride おきのフレームだけで求める。
+//!
+//! isPacked なら 4-bit に詰めたフレーム (kPackedFrameSize バイト) を受け取り、戻さずに比べて
+//! ハッシュを求める。切れ目もハッシュも詰める前のフレームを渡したときと一致する。
+class SceneDetector {
+public:
+    //! シーンの終わりで (シーン, 先頭のフレーム番号, 先頭のフレーム, サムネイル) を渡す
+    //!
+    //! サムネイルは kThumbnailSize バイト。false を返すと検出をやめる。
+    typedef std::function<
+        bool(const SceneId&, std::uint32_t, const std::uint8_t*, const std::uint8_t*)>
+        SceneHandler;
+
+    SceneDetector(
+        const FrameClock& clock,
+        HashType          hashType,
+        int               frameStride,
+        SceneHandler      onScene,
+        bool              isPacked = false
+    )
+        : m_Clock(clock)
+        , m_HashType(hashType)
+        , m_FrameStride(std::uint32_t(std::max(frameStride, 1)))
+        , m_OnScene(std::move(onScene))
+        , m_IsPacked(isPacked)
+        , m_FrameSize(isPacked ? kPackedFrameSize : kFrameSize)
+        , m_Candidates(kMiddleCandidates * kPackedFrameSize)
+    {
+    }
+
+    //! 続きの nFrames フレームを渡す
+    //!
+    //! @return 検出をやめたら false
+    bool push(const std::uint8_t* frames, std::size_t nFrames)
+    {
+        std::size_t j         = 0;
+        std::size_t fineUntil = 0; // ここまでは 1 フレームずつ比べる
+        while ( j < nFrames ) {
+            if ( m_FrameStride > 1 && m_i > 0 && ! m_IsResuming && j >= fineUntil
+                 && j + m_FrameStride <= nFrames ) {
+                const std::uint8_t* ahead = &frames[(j + m_FrameStride - 1) * m_FrameSize];
+
+                m_nComparisons += 1;
+                if ( distance(ahead, m_LastFrame) <= kSceneChangedThreshold ) {
+                    for ( std::size_t k = j; k < j + m_FrameStride; k += 1 ) {
+                        keepFrame(&frames[k * m_FrameSize]);
+                        m_i += 1;
+                    }
+                    m_LastFrame = ahead;
+                    j += m_FrameStride;
+                    continue;
+                }
+                fineUntil = j + m_FrameStride;
+            }
+
+            if ( ! pushFrame(&frames[j * m_FrameSize]) ) {
+                return false;
+            }
+            j += 1;
+        }
+
+        // frames は呼び出し元に返すので最後のフレームだけ残す
+        if ( m_LastFrame != m_LastFrameCopy ) {
+            copyFrame(m_LastFrameCopy, m_LastFrame);
+            m_LastFrame = m_LastFrameCopy;
+        }
+        return true;
+    }
+
+    //! 最後のシーンを終える
+    //!
+    //! @return 失敗したら false
+    bool finish() { return m_IsResuming || endScene(); }
+
+    //! シーンの切れ目 iFrame から続ける
+    //!
+    //! lastFrame は iFrame の直前のフレーム。次に渡すフレームから新しいシーンを始める。
+    void resume(std::uint32_t iFrame, const std::uint8_t* lastFrame)
+    {
+        copyFrame(m_LastFrameCopy, lastFrame);
+        m_LastFrame   = m_LastFrameCopy;
+        m_i           = iFrame;
+        m_iFirstFrame = iFrame;
+        m_IsResuming  = true;
+    }
+
+    //! 最後に受け取ったフレーム (シーンを渡している間は閉じたシーンの最後のフレーム)
+    const std::uint8_t* lastFrame() const { return m_LastFrame; }
+
+    //! タイムスタンプが足りなくてやめたら true
+    bool isShortOfTimestamps() const { return m_IsShortOfTimestamps; }
+
+    std::uint32_t frameCount() const { return m_i; }
+
+    //! フレームを比べた回数
+    std::size_t comparisonCount() const { return m_nComparisons; }
+
+private:
+    const FrameClock& m_Clock;
+    HashType          m_HashType;
+    std::uint32_t     m_FrameStride;
+    SceneHandler      m_OnScene;
+    bool              m_IsPacked;
+    std::size_t       m_FrameSize; //!< 受け取るフレームの大きさ
+
+    std::uint8_t        m_FirstFrame[kFrameSize]    = { 0 }; //!< 詰めていないフレーム
+    std::uint8_t        m_LastFrameCopy[kFrameSize] = { 0 };
+    const std::uint8_t* m_LastFrame                 = m_LastFrameCopy;
+    std::uint64_t       m_Crc                       = 0;
+    std::uint32_t       m_i                         = 0;
+    std::uint32_t       m_iFirstFrame               = 0;
+    std::size_t         m_nComparisons              = 0;
+    bool                m_IsShortOfTimestamps       = false;
+    bool                m_IsResuming                = false; //!< resume() してシーンがない
+
+    std::vector<std::uint8_t> m_Candidates; //!< シーンの先頭から m_CandidateStride おき (4-bit)
+    std::size_t               m_nCandidates     = 0;
+    std::uint32_t             m_CandidateStride = 1;
+    std::uint8_t              m_Thumbnail[kThumbnailSize];
+
+    double distance(const std::uint8_t* frame1, const std::uint8_t* frame2) const
+    {
+        return m_IsPacked ? rmsePacked(frame1, frame2) : rmse(frame1, frame2);
+    }
+
+    //! 受け取ったフレームを写す (詰めていなければディザリングしながら)
+    void copyFrame(std::uint8_t* __restrict dest, const std::uint8_t* __restrict frame) const
+    {
+        if ( m_IsPacked ) {
+            std::memcpy(dest, frame, kPackedFrameSize);
+            return;
+        }
+        for ( std::size_t i = 0; i < kFrameSize; i += 1 ) {
+            dest[i] = frame[i] & 0xF0;
+        }
+    }
+
+    //! フレームを今のシーンに加える
+    //!
+    //! シーンの先頭から m_FrameStride おきのフレームだけをハッシュに含める。
+    void keepFrame(const std::uint8_t* frame)
+    {
+        std::uint32_t offset = m_i - m_iFirstFrame;
+        if ( offset % m_FrameStride == 0 ) {
+            if ( m_IsPacked ) {
+                m_Crc = sceneHashAccPacked(m_HashType, m_Crc, frame);
+            } else {
+                m_Crc = sceneHashAcc(m_HashType, m_Crc, kFrameSize, frame);
+            }
+        }
+        keepCandidate(offset, frame);
+    }
+
+    //! 中央のフレームの候補として残す
+    //!
+    //! 候補が埋まったら 1 つおきに捨てて間隔を倍にするので、残すフレームの数は
+    //! シーンの長さによらず kMiddleCandidates 以下になる。
+    void keepCandidate(std::uint32_t offset, const std::uint8_t* frame)
+    {
+        if ( offset % m_CandidateStride != 0 ) {
+            return;
+        }
+        if ( m_nCandidates == kMiddleCandidates ) {
+            for ( std::size_t i = 1; i < kMiddleCandidates / 2; i += 1 ) {
+                std::memcpy(
+                    &m_Candidates[i * kPackedFrameSize],
+                    &m_Candidates[i * 2 * kPackedFrameSize],
+                    kPackedFrameSize
+                );
+            }
+            m_nCandidates = kMiddleCandidates / 2;
+            m_CandidateStride *= 2;
+        }
+
+        std::uint8_t* dest = &m_Candidates[m_nCandidates * kPackedFrameSize];
+        if ( m_IsPacked ) {
+            std::memcpy(dest, frame, kPackedFrameSize);
+        } else {
+            packFrames(frame, 1, dest);
+        }
+        m_nCandidates += 1;
+    }
+
+    //! 直前のフレームと比べる
+    bool pushFrame(const std::uint8_t* frame)
+    {
+        double error = distance(frame, m_LastFrame);
+        m_nComparisons += 1;
+        debugPrintf(
+            "%8d (%6.1f): %6.1f: %0*llX",
+            m_i,
+            m_Clock.seconds(m_i),
+            error,
+            int(m_HashType / 4),
+            static_cast<unsigned long long>(m_Crc)
+        );
+        if ( error > kSceneChangedThreshold || m_IsResuming ) {
+            // scene changed
+            if ( m_i > 0 && ! m_IsResuming ) {
+                debugPrintf(" scene changed\n");
+                if ( ! endScene() ) {
+                    return false;
+                }
+            } else {
+                debugPrintf("\n");
+            }
+            m_Crc             = 0;
+            m_iFirstFrame     = m_i;
+            m_IsResuming      = false;
+            m_nCandidates     = 0;
+            m_CandidateStride = 1;
+            if ( m_IsPacked ) {
+                unpackFrame(frame, m_FirstFrame);
+            } else {
+                copyFrame(m_FirstFrame, frame);
+            }
+        } else {
+            debugPrintf("\n");
+        }
+
+        keepFrame(frame);
+        m_LastFrame = frame;
+        m_i += 1;
+        return true;
+    }
+
+    //! [m_iFirstFrame, m_i) をシーンとして渡す
+    bool endScene()
+    {
+        DurationMs durationMs = 0;
+        if ( ! m_Clock.duration(m_iFirstFrame, m_i, durationMs) ) {
+            m_IsShortOfTimestamps = true;
+            return false;
+        }
+
+        // 最初と中央のフレーム (中央は残した候補のうち中央を超えない最後のもの)
+        std::uint32_t nFrames = m_i - m_iFirstFrame;
+        std::uint32_t iMiddle = nFrames > 0 ? (nFrames - 1) / 2 : 0;
+        std::memset(m_Thumbnail, 0, sizeof(m_Thumbnail));
+        if ( m_nCandidates > 0 ) {
+            std::memcpy(m_Thumbnail, &m_Candidates[0], kPackedFrameSize);
+            std::memcpy(
+                &m_Thumbnail[kPackedFrameSize],
+                &m_Candidates[iMiddle / m_CandidateStride * kPackedFrameSize],
+                kPackedFrameSize
+            );
+        }
+
+        Hash hash = makeSceneHash(m_HashType, m_Crc);
+        VIDUP_PROBE3(scene_boundary, m_iFirstFrame, m_i, hash);
+        return m_OnScene({ hash, durationMs }, m_iFirstFrame, m_FirstFrame, m_Thumbnail);
+    }
+};
+
+//! 取り込みの速さの上限 (vidup_set_throttle())
+struct Throttle {
+    CpuBudget   cpu;   //!< プロセスの CPU 時間
+    TokenBucket input; //!< 解析するフレームのバイト数
+    TokenBucket write; //!< DB に書き込むシーン数
+};
+
+//! 取り込みの読み込み段から検出段に渡すフレームのまとまり
+struct FrameBlock {
+    std::size_t  nFrames;
+    std::uint8_t frames[kFramesPerBlock * kFrameSize];
+};
+
+//! 生きている間、このスレッドで SIGINT と SIGTERM を止めておく
+//!
+//! プロセスに送られたシグナルは止めていないスレッドのどれかに届く。読み込み段のほかのスレッドで
+//! 止めておけば、入力を待っている読み込み段に届いて、その読み込みが EINTR で戻る。
+//! 止めている間にこのスレッドに残ったシグナルは、元に戻したときに受け取る。
+//! スレッドはシグナルマスクを引き継ぐので、生きている間に作ったスレッドでも止まる。
+class InterruptSignalBlocker {
+public:
+    InterruptSignalBlocker()
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, &m_Saved);
+    }
+
+    ~InterruptSignalBlocker() { pthread_sigmask(SIG_SETMASK, &m_Saved, nullptr); }
+
+    InterruptSignalBlocker(const InterruptSignalBlocker&)            = delete;
+    InterruptSignalBlocker& operator=(const InterruptSignalBlocker&) = delete;
+
+private:
+    sigset_t m_Saved; //!< 止める前のシグナルマスク
+};
+
+//! 読み込み段: 空きブロックにフレームを読み込んで検出段に渡す
+//!
+//! isInterrupted が立ったら読むのをやめて isStopped を立てる。
+//! 割り込まれて途中で終わった読み込みを入力の終わりと取り違えないように、読んだ後にも見る。
+static void readStage(
+    const FrameReader&       reader,
+    SpscRing<FrameBlock*>&   freeBlocks,
+    SpscRing<FrameBlock*>&   filledBlocks,
+    TokenBucket&             input,
+    const std::atomic<bool>& isInterrupted,
+    bool&                    isStopped
+)
+{
+    FrameBlock* block;
+    traceThreadName("read");
+    while ( ! isInterrupted.load() && freeBlocks.pop(block) ) {
+        {
+            TraceSpan span("read");
+            block->nFrames = readFrames(reader, block->frames, kFramesPerBlock);
+            span.setCount(std::int64_t(block->nFrames));
+        }
+        if ( isInterrupted.load() ) {
+            break;
+        }
+        if ( block->nFrames == 0 || ! filledBlocks.push(block) ) {
+            break;
+        }
+        input.take(double(block->nFrames * kFrameSize));
+    }
+    isStopped = isInterrupted.load();
+    filledBlocks.close();
+}
+
+//! 検出段: シーンの切れ目を検出してシーンを書き込み段に渡す
+//!
+//! 特徴ベクトルと (archive があれば) フレームの保管庫も検出段で作る。
+//! タイムスタンプが足りなければ止めて isShortOfTimestamps を立てる。
+//! checkpoints があれば kCheckpointFrames ごとに次のシーンの切れ目で途中の状態を渡し、
+//! 続けて fileId が -1 のシーンを目印に渡す。resume があればその続きから検出する。
+//! 読み込み段が isStopped で止まったら、読み込み済みのフレームを検出してから最後のシーンを
+//! 閉じずに、最後の切れ目までの途中の状態を渡す。
+static void detectStage(
+    SpscRing<FrameBlock*>&     freeBlocks,
+    SpscRing<FrameBlock*>&     filledBlocks,
+    SpscRing<Scene>&           scenes,
+    SpscRing<Checkpoint*>*     checkpoints,
+    FileId                     fileId,
+    const FrameClock&          clock,
+    HashType                   hashType,
+    int                        frameStride,
+    const Checkpoint*          resume,
+    EmbeddingBuilder&          embedding,
+    std::vector<std::uint8_t>& thumbnails,
+    FrameArchiveBuilder*       archive,
+    CpuBudget&                 cpu,
+    const bool&                isStopped,
+    bool&                      isShortOfTimestamps
+)
+{
+    bool          isFinishing                   = false; // 最後のシーンの後は続きがない
+    std::uint32_t boundary                      = 0;     // 最後のシーンの切れ目
+    std::uint8_t  boundaryLastFrame[kFrameSize] = { 0 }; // その直前のフレーム
+    if ( resume ) {
+        boundary = resume->iFrame;
+        std::memcpy(boundaryLastFrame, resume->lastFrame.data(), kFrameSize);
+    }
+    std::uint32_t nextCheckpoint = boundary + kCheckpointFrames;
+
+    // 最後の切れ目までの状態を渡す (シーンは書き込み段が持っているので、それ以外を渡す)
+    auto pushCheckpoint = [&] {
+        std::unique_ptr<Checkpoint> checkpoint(new Checkpoint);
+        checkpoint->iFrame = boundary;
+        checkpoint->lastFrame.assign(boundaryLastFrame, boundaryLastFrame + kFrameSize);
+        checkpoint->thumbnails = thumbnails;
+        checkpoint->embedding  = embedding;
+        if ( ! checkpoints->push(checkpoint.get()) ) {
+            return false;
+        }
+        checkpoint.release();
+        return scenes.push({ {}, -1 });
+    };
+
+    SceneDetector detector(
+        clock,
+        hashType,
+        frameStride,
+        [&](const SceneId&      sceneId,
+            std::uint32_t,
+            const std::uint8_t* firstFrame,
+            const std::uint8_t* thumbnail) {
+            if ( ! scenes.push({ sceneId, fileId }) ) {
+                return false;
+            }
+            embedding.addScene(sceneId.durationMs, firstFrame);
+            thumbnails.insert(thumbnails.end(), thumbnail, thumbnail + kThumbnailSize);
+
+            if ( ! checkpoints || isFinishing ) {
+                return true;
+            }
+            boundary = detector.frameCount();
+            std::memcpy(boundaryLastFrame, detector.lastFrame(), kFrameSize);
+            if ( boundary < nextCheckpoint ) {
+                return true;
+            }
+            nextCheckpoint = boundary + kCheckpointFrames;
+            return pushCheckpoint();
+        }
+    );
+    bool        isCancelled = false;
+    FrameBlock* block;
+
+    if ( resume ) {
+        detector.resume(resume->iFrame, resume->lastFrame.data());
+    }
+
+    // シーンハッシュはフレームごとに検出と一緒に計算するので detect の区間に含まれる
+    traceThreadName("detect");
+    while ( ! isCancelled && filledBlocks.pop(block) ) {
+        {
+            TraceSpan span("detect");
+            span.setCount(std::int64_t(block->nFrames));
+            if ( archive ) {
+                archive->add(block->frames, block->nFrames);
+            }
+            isCancelled = ! detector.push(block->frames, block->nFrames);
+            if ( ! freeBlocks.push(block) ) {
+                isCancelled = true;
+            }
+        }
+        cpu.pace();
+    }
+
+    if ( isCancelled ) {
+        // 上流を止める
+        filledBlocks.close();
+        freeBlocks.close();
+    } else if ( isStopped ) {
+        // 開いているシーンは捨てて、続きは最後の切れ目から解析し直す
+        if ( checkpoints && boundary > 0 ) {
+            pushCheckpoint();
+        }
+    } else {
+        isFinishing = true;
+        detector.finish();
+        if ( archive ) {
+            archive->finish();
+        }
+    }
+    isShortOfTimestamps = detector.isShortOfTimestamps();
+    debugPrintf(
+        "%u frames, %zu comparisons\n", detector.frameCount(), detector.comparisonCount()
+    );
+    if ( checkpoints ) {
+        checkpoints->close();
+    }
+    scenes.close();
+}
+
+//! シーンを登録し終わったファイルの特徴ベクトルなどを登録して解析済みにする
+//!
+//! @return 成功なら 0
+//!
+//! archive があればフレームの保管庫も登録する。
+static int finishFile(
+    sqlite3*                         db,
+    FileId                           fileId,
+    const FrameClock&                clock,
+    const Embedding&                 embedding,
+    const std::vector<std::uint8_t>& thumbnails,
+    const FrameArchiveBuilder*       archive
+)
+{
+    if ( registerEmbedding(db, fileId, embedding) ) {
+        return 1;
+    }
+    if ( registerThumbnails(db, fileId, thumbnails) ) {
+        return 1;
+    }
+    if ( archive ) {
+        if ( registerArchive(db, fileId, clock.frameRate(), clock.timestamps(), *archive) ) {
+            return 1;
+        }
+        debugPrintf(
+            "archived %u frames in %zu blocks\n", archive->frameCount(), archive->blocks().size()
+        );
+    }
+    if ( addToPostings(db, fileId) ) {
+        return 1;
+    }
+    if ( registerSketch(db, fileId) ) {
+        return 1;
+    }
+    return updateFileStatus(db, fileId, FileStatus::kAnalyzed);
+}
+
+//! シーンを解析して DB に登録する
+//!
+//! @return vidup_status
+//!
+//! 読み込み、シーン検出、DB への書き込みをそれぞれのスレッドで並行に進める。
+//! 段の間は固定長のリングバッファでつなぐので、全体の速さは最も遅い段で決まる。
+//! DB への書き込みは呼び出したスレッドで行い、ファイル単位のセーブポイントにまとめる。
+//! 呼び出し元がトランザクション中ならその一部になる。
+//! isArchiving ならフレームを保管庫にも登録する。登録したシーン数を nScenes に返す。
+//! 読み込み段、検出段、書き込み段はそれぞれ throttle の入力、CPU、書き込みの上限で待つ。
+//!
+//! isCheckpointing なら途中の状態を checkpoints テーブルに定期的にコミットし、失敗しても
+//! 最後の状態を残す。トランザクション中と isArchiving のときはコミットできないのでとらない。
+//! シーンは解析し終わるまで途中の状態に持ち、scenes テーブルには最後にまとめて登録する。
+//! resume があれば reader は resume->iFrame から読み、その続きを解析する。
+//!
+//! isInterrupted が立ったら読み込みを止め、読み込み済みのフレームを解析してから、
+//! このファイルの変更を取り消して (isCheckpointing なら最後の切れ目までを途中の状態に
+//! コミットして) VIDUP_INTERRUPTED を返す。
+static int analyzeScenes(
+    sqlite3*                 db,
+    const FrameReader&       reader,
+    FileId                   fileId,
+    const FrameClock&        clock,
+    HashType                 hashType,
+    int                      frameStride,
+    bool                     isArchiving,
+    bool                     isCheckpointing,
+    const Checkpoint*        resume,
+    Throttle&                throttle,
+    const std::atomic<bool>& isInterrupted,
+    std::uint32_t&           nScenes
+)
+{
+    std::vector<FrameBlock>   blocks(kFrameBlockCount);
+    SpscRing<FrameBlock*>     freeBlocks(kFrameBlockCount);
+    SpscRing<FrameBlock*>     filledBlocks(kFrameBlockCount);
+    SpscRing<Scene>           scenes(kSceneQueueSize);
+    SpscRing<Checkpoint*>     checkpoints(kCheckpointQueueSize);
+    EmbeddingBuilder          embedding;
+    std::vector<std::uint8_t> thumbnails;
+    std::vector<SceneId>      sceneIds; //!< isCheckpointing で登録を待っているシーン
+    FrameArchiveBuilder       archive;
+    bool                      isStopped           = false; //!< 読み込み段が割り込まれた
+    bool                      isShortOfTimestamps = false;
+    TraceSpan                 span("analyze");
+
+    isCheckpointing = isCheckpointing && db && ! isArchiving && sqlite3_get_autocommit(db);
+    nScenes         = 0;
+    if ( resume ) {
+        embedding  = resume->embedding;
+        thumbnails = resume->thumbnails;
+        sceneIds   = resume->scenes;
+        nScenes    = std::uint32_t(sceneIds.size());
+    }
+
+    for ( FrameBlock& block : blocks ) {
+        freeBlocks.push(&block);
+    }
+
+    if ( db && execSql(db, "SAVEPOINT analyze") ) {
+        return 1;
+    }
+
+    std::thread readThread(
+        readStage,
+        std::cref(reader),
+        std::ref(freeBlocks),
+        std::ref(filledBlocks),
+        std::ref(throttle.input),
+        std::cref(isInterrupted),
+        std::ref(isStopped)
+    );
+
+    // 割り込みのシグナルが入力を待っている読み込み段に届くように、ほかのスレッドでは止める
+    InterruptSignalBlocker signalBlocker;
+    std::thread            detectThread(
+        detectStage,
+        std::ref(freeBlocks),
+        std::ref(filledBlocks),
+        std::ref(scenes),
+        isCheckpointing ? &checkpoints : nullptr,
+        fileId,
+        std::cref(clock),
+        hashType,
+        frameStride,
+        resume,
+        std::ref(embedding),
+        std::ref(thumbnails),
+        isArchiving && db ? &archive : nullptr,
+        std::ref(throttle.cpu),
+        std::cref(isStopped),
+        std::ref(isShortOfTimestamps)
+    );
+
+    // 書き込み段
+    bool  failed = false;
+    Scene scene;
+    while ( scenes.pop(scene) ) {
+        if ( scene.fileId < 0 ) {
+            // ここまでのシーンと検出段の状態をコミットする
+            Checkpoint* checkpoint = nullptr;
+            checkpoints.pop(checkpoint);
+            std::unique_ptr<Checkpoint> checkpointOwner(checkpoint);
+            TraceSpan                   checkpointSpan("write checkpoint");
+            checkpointSpan.setCount(std::int64_t(sceneIds.size()));
+            checkpoint->scenes = sceneIds;
+            if ( putCheckpoint(db, fileId, *checkpoint) || execSql(db, "RELEASE analyze")
+                 || execSql(db, "SAVEPOINT analyze") ) {
+                failed = true;
+                break;
+            }
+            debugPrintf("checkpoint at frame %u\n", checkpoint->iFrame);
+            continue;
+        }
+
+        if ( isCheckpointing ) {
+            sceneIds.push_back(scene.sceneId);
+        } else if ( db ) {
+            TraceSpan sceneSpan("write scene");
+            if ( registerScene(db, scene) ) {
+                failed = true;
+                break;
+            }
+        }
+        nScenes += 1;
+        if ( db ) {
+            throttle.write.take(1);
+        }
+    }
+    if ( failed ) {
+        scenes.close();
+        checkpoints.close();
+    }
+
+    detectThread.join();
+    readThread.join();
+    checkpoints.close(); // isCheckpointing でなければ検出段は閉じない
+    for ( Checkpoint* checkpoint = nullptr; checkpoints.pop(checkpoint); ) {
+        delete checkpoint;
+    }
+    if ( isShortOfTimestamps ) {
+        std::fprintf(stderr, "there are fewer timestamps than frames.\n");
+        failed = true;
+    }
+    debugPrintf(
+        "pipeline stalls: reader %zu, detector %zu (input) %zu (output), writer %zu\n",
+        freeBlocks.emptyCount(),
+        filledBlocks.emptyCount(),
+        scenes.fullCount(),
+        scenes.emptyCount()
+    );
+
+    if ( isStopped && ! failed ) {
+        debugPrintf("interrupted after %u scenes\n", nScenes);
+    }
+    if ( db && ! failed && ! isStopped && isCheckpointing ) {
+        TraceSpan scenesSpan("write scenes");
+        scenesSpan.setCount(std::int64_t(sceneIds.size()));
+        for ( const SceneId& sceneId : sceneIds ) {
+            if ( registerScene(db, { sceneId, fileId }) ) {
+                failed = true;
+                break;
+            }
+        }
+        failed = failed || deleteCheckpoint(db, fileId);
+    }
+    if ( db && ! failed && ! isStopped ) {
+        TraceSpan            fileSpan("write file");
+        FrameArchiveBuilder* archived = isArchiving ? &archive : nullptr;
+        failed = finishFile(db, fileId, clock, embedding.finish(), thumbnails, archived) != 0;
+    }
+    span.setCount(std::int64_t(nScenes));
+
+    // 割り込まれたら最後にコミットした途中の状態まで戻す
+    if ( db ) {
+        if ( failed || isStopped ) {
+            execSql(db, "ROLLBACK TO analyze");
+            execSql(db, "RELEASE analyze");
+        } else if ( execSql(db, "RELEASE analyze") ) {
+            failed = true;
+        }
+    }
+    if ( failed ) {
+        return VIDUP_ERROR;
+    }
+    return isStopped ? VIDUP_INTERRUPTED : VIDUP_OK;
+}
+
+//! 呼び出し元のフレームを順に受け取ってシーンを解析する
+//!
+//! analyzeScenes() と違ってスレッドを使わず、push() に渡されたフレームを写さずにその場で
+//! 検出する。閉じたシーンはすぐに onScene に渡し、DB には registerTo() でまとめて登録するので、
+//! push() の間は DB に触れない。
+class SceneAnalyzer {
+public:
+    //! シーンが閉じるたびに (シーン, 先頭のフレーム番号) を渡す
+    typedef std::function<void(const SceneId&, std::uint32_t)> SceneHandler;
+
+    SceneAnalyzer(
+        int                      frameRate,
+        std::vector<double>      timestamps,
+        HashType                 hashType,
+        int                      frameStride,
+        bool                     isArchiving,
+        Throttle&                throttle,
+        const std::atomic<bool>& isInterrupted,
+        SceneHandler             onScene = {}
+    )
+        : m_Clock(frameRate, std::move(timestamps))
+        , m_Detector(
+              m_Clock,
+              hashType,
+              frameStride,
+              [this](
+                  const SceneId&      sceneId,
+                  std::uint32_t       iFirstFrame,
+                  const std::uint8_t* firstFrame,
+                  const std::uint8_t* thumbnail
+              ) {
+                  m_Scenes.push_back(sceneId);
+                  m_Embedding.addScene(sceneId.durationMs, firstFrame);
+                  m_Thumbnails.insert(m_Thumbnails.end(), thumbnail, thumbnail + kThumbnailSize);
+                  if ( m_OnScene ) {
+                      m_OnScene(sceneId, iFirstFrame);
+                  }
+                  return true;
+              }
+          )
+        , m_IsArchiving(isArchiving)
+        , m_Throttle(throttle)
+        , m_IsInterrupted(isInterrupted)
+        , m_OnScene(std::move(onScene))
+    {
+    }
+
+    SceneAnalyzer(const SceneAnalyzer&)            = delete;
+    SceneAnalyzer& operator=(const SceneAnalyzer&) = delete;
+
+    //! 続きの nFrames フレームを渡す
+    //!
+    //! @return タイムスタンプが足りなければ false
+    //!
+    //! isInterrupted が立ったらブロックの切れ目で止めて isStopped() を立て、残りは捨てる。
+    bool push(const std::uint8_t* frames, std::size_t nFrames)
+    {
+        // 呼び出し元のフレームは書き換えられないのでディザリングしない。
+        // 検出も保管庫も下位 4-bit を捨てて読むので、ディザリングしたときと同じになる
+        while ( nFrames > 0 ) {
+            if ( m_IsInterrupted.load() ) {
+                m_IsStopped = true;
+                break;
+            }
+            std::size_t n = std::min(nFrames, kFramesPerBlock);
+            TraceSpan   span("detect");
+            span.setCount(std::int64_t(n));
+
+            if ( m_IsArchiving ) {
+                m_Archive.add(frames, n);
+            }
+            if ( ! m_Detector.push(frames, n) ) {
+                return false;
+            }
+            frames += n * kFrameSize;
+            nFrames -= n;
+
+            m_Throttle.input.take(double(n * kFrameSize));
+            m_Throttle.cpu.pace();
+        }
+        return true;
+    }
+
+    //! 最後のシーンを閉じる
+    //!
+    //! @return タイムスタンプが足りなければ false
+    bool finish()
+    {
+        if ( m_IsArchiving ) {
+            m_Archive.finish();
+        }
+        return m_Detector.finish();
+    }
+
+    //! isInterrupted で止まった
+    bool isStopped() const { return m_IsStopped; }
+
+    //! 検出したシーン
+    const std::vector<SceneId>& scenes() const { return m_Scenes; }
+
+    //! 検出したシーンを fileId として登録して解析済みにする
+    //!
+    //! @return vidup_status
+    //!
+    //! finish() の後に呼ぶ。ファイル単位のセーブポイントにまとめ、isInterrupted が立ったら
+    //! 取り消して VIDUP_INTERRUPTED を返す。
+    int registerTo(sqlite3* db, FileId fileId)
+    {
+        if ( execSql(db, "SAVEPOINT analyze") ) {
+            return VIDUP_ERROR;
+        }
+
+        bool failed = false;
+        {
+            TraceSpan span("write scenes");
+            span.setCount(std::int64_t(m_Scenes.size()));
+            for ( const SceneId& sceneId : m_Scenes ) {
+                if ( m_IsInterrupted.load() ) {
+                    m_IsStopped = true;
+                    failed      = true;
+                    break;
+                }
+                if ( registerScene(db, { sceneId, fileId }) ) {
+                    failed = true;
+                    break;
+                }
+                m_Throttle.write.take(1);
+            }
+        }
+        if ( ! failed ) {
+            TraceSpan            span("write file");
+            FrameArchiveBuilder* archive = m_IsArchiving ? &m_Archive : nullptr;
+            failed = finishFile(db, fileId, m_Clock, m_Embedding.finish(), m_Thumbnails, archive)
+                  != 0;
+        }
+
+        if ( failed ) {
+            execSql(db, "ROLLBACK TO analyze");
+            execSql(db, "RELEASE analyze");
+            return m_IsStopped ? VIDUP_INTERRUPTED : VIDUP_ERROR;
+        }
+        return execSql(db, "RELEASE analyze") ? VIDUP_ERROR : VIDUP_OK;
+    }
+
+private:
+    FrameClock                m_Clock;
+    SceneDetector             m_Detector;
+    bool                      m_IsArchiving;
+    Throttle&                 m_Throttle;
+    const std::atomic<bool>&  m_IsInterrupted;
+    bool                      m_IsStopped = false; //!< isInterrupted で止まった
+    SceneHandler              m_OnScene;
+    std::vector<SceneId>      m_Scenes;
+    EmbeddingBuilder          m_Embedding;
+    std::vector<std::uint8_t> m_Thumbnails;
+    FrameArchiveBuilder       m_Archive;
+};
+
+//! --reindex で 1 ファイル分のシーンを検出する仕事
+struct ReindexJob {
+    FileId                                 fileId;
+    ArchiveInfo                            info;
+    std::vector<std::vector<std::uint8_t>> blocks; //!< 圧縮したままの保管庫のブロック
+};
+
+//! ReindexJob の結果
+struct ReindexResult {
+    FileId                    fileId;
+    bool                      failed = false; //!< 保管庫が壊れていた
+    std::uint32_t             nFrames = 0;
+    std::vector<Scene>        scenes;
+    Embedding                 embedding;
+    std::vector<std::uint8_t> thumbnails;
+};
+
+//! --reindex のワーカー: 保管庫のブロックを 4-bit に詰めたまま戻してシーンを検出する
+static void reindexStage(
+    SpscRing<ReindexJob*>&    jobs,
+    SpscRing<ReindexResult*>& results,
+    HashType                  hashType,
+    int                       frameStride,
+    CpuBudget&                cpu
+)
+{
+    std::vector<std::uint8_t> packed;
+    ReindexJob*               job;
+
+    traceThreadName("reindex");
+    while ( jobs.pop(job) ) {
+        std::unique_ptr<ReindexJob> jobOwner(job);
+        TraceSpan                   span("detect");
+        ReindexResult*              result = new ReindexResult;
+        const ArchiveInfo&          info   = job->info;
+        FrameClock                  clock(info.frameRate, info.timestamps);
+        EmbeddingBuilder            embedding;
+        SceneDetector               detector(
+            clock,
+            hashType,
+            frameStride,
+            [&](const SceneId&      sceneId,
+                std::uint32_t,
+                const std::uint8_t* firstFrame,
+                const std::uint8_t* thumbnail) {
+                result->scenes.push_back({ sceneId, job->fileId });
+                embedding.addScene(sceneId.durationMs, firstFrame);
+                result->thumbnails.insert(
+                    result->thumbnails.end(), thumbnail, thumbnail + kThumbnailSize
+                );
+                return true;
+            },
+            true
+        );
+
+        std::size_t nBlocks = (std::size_t(info.frameCount) + info.blockFrames - 1)
+            / info.blockFrames;
+        result->fileId      = job->fileId;
+        result->failed      = job->blocks.size() != nBlocks;
+        packed.resize(std::size_t(info.blockFrames) * kPackedFrameSize);
+        for ( std::size_t i = 0; ! result->failed && i < nBlocks; i += 1 ) {
+            const std::vector<std::uint8_t>& block   = job->blocks[i];
+            std::uint32_t                    iBegin  = std::uint32_t(i) * info.blockFrames;
+            std::uint32_t                    nFrames = std::min(
+                info.blockFrames, info.frameCount - iBegin
+            );
+
+            result->failed = ! decompressFrames(block.data(), block.size(), nFrames, packed.data())
+                || ! detector.push(packed.data(), nFrames);
+            cpu.pace();
+        }
+        result->failed = result->failed || ! detector.finish()
+            || detector.frameCount() != info.frameCount;
+        result->nFrames   = detector.frameCount();
+        result->embedding = embedding.finish();
+        span.setCount(std::int64_t(result->nFrames));
+
+        if ( ! results.push(result) ) {
+            delete result;
+            break;
+        }
+    }
+    results.close();
+}
+
+//! 保管庫のフレームからすべてのファイルのシーンを検出し直す
+//!
+//! @return vidup_status (isInterrupted が立ったら元のままで VIDUP_INTERRUPTED)
+//!
+//! ファイルごとに保管庫を読んでワーカーに順に割り振り、CPU の数だけ並行に検出する。
+//! 結果はファイルの順に索引のない scenes_new に書き込み、最後に索引をまとめて作る。
+//! SQLite は索引をソートしてから組み立てるので、1 行ずつ索引を更新するより速い。
+//! 全体を 1 つのトランザクションにして古い scenes と入れ替えるので、途中で失敗しても元のまま。
+//! throttle の CPU の上限があれば、ワーカーはコア何個分かの数までにして、
+//! 予算を使い切って待ったら割り振るワーカーを減らし、待たずに余っていたら増やす。
+static int reindex(
+    sqlite3*                 db,
+    HashType                 hashType,
+    int                      frameStride,
+    Throttle&                throttle,
+    const std::atomic<bool>& isInterrupted
+)
+{
+    std::vector<FileId> fileIds;
+    std::int64_t        nUnarchived = 0;
+    if ( getArchivedFiles(db, fileIds, nUnarchived) ) {
+        return 1;
+    }
+    if ( nUnarchived > 0 ) {
+        std::fprintf(
+            stderr,
+            "%lld files are not archived. register them again with --archive.\n",
+            static_cast<long long>(nUnarchived)
+        );
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    if ( execSql(db, "BEGIN") ) {
+        return 1;
+    }
+    bool failed = execSql(db, "DROP TABLE IF EXISTS scenes_new")
+        || execSql(
+                      db,
+                      "CREATE TABLE scenes_new("
+                      "hash INTEGER,"
+                      "duration_ms INTEGER,"
+                      "file_id INTEGER,"
+                      "FOREIGN KEY (file_id) REFERENCES files(id) ON DELETE CASCADE"
+                      ")"
+        );
+
+    sqlite3_stmt* stmt = nullptr;
+    if ( ! failed
+         && sqlite3_prepare_v2(
+             db,
+             "INSERT INTO scenes_new (hash, duration_ms, file_id) VALUES (?, ?, ?)",
+             -1,
+             &stmt,
+             nullptr
+         ) ) {
+        std::fprintf(stderr, "INSERT INTO scenes_new: %s\n", sqlite3_errmsg(db));
+        failed = true;
+    }
+
+    std::size_t nWorkers = std::max(1u, std::thread::hardware_concurrency());
+    if ( throttle.cpu.isLimited() ) {
+        nWorkers = std::min(nWorkers, std::size_t(std::ceil(throttle.cpu.share())));
+        nWorkers = std::max<std::size_t>(nWorkers, 1);
+    }
+    std::vector<std::unique_ptr<SpscRing<ReindexJob*>>>    jobs;
+    std::vector<std::unique_ptr<SpscRing<ReindexResult*>>> results;
+    std::vector<std::thread>                               workers;
+    for ( std::size_t i = 0; i < nWorkers; i += 1 ) {
+        jobs.emplace_back(new SpscRing<ReindexJob*>(kReindexQueueSize));
+        results.emplace_back(new SpscRing<ReindexResult*>(kReindexQueueSize));
+        workers.emplace_back(
+            reindexStage,
+            std::ref(*jobs[i]),
+            std::ref(*results[i]),
+            hashType,
+            frameStride,
+            std::ref(throttle.cpu)
+        );
+    }
+
+    std::size_t              nActive = nWorkers; //!< 仕事を割り振るワーカーの数
+    std::vector<std::size_t> nQueued(nWorkers);  //!< ワーカーごとの受け取っていない仕事
+    std::deque<std::size_t>  assigned;           //!< 割り振ったワーカー (割り振った順)
+    unsigned long long       nFrames     = 0;
+    unsigned long long       nScenes     = 0;
+    unsigned long long       archiveSize = 0;
+
+    // 割り振った順に受け取って書き込む
+    auto collect = [&] {
+        ReindexResult* result = nullptr;
+        std::size_t    worker = assigned.front();
+        if ( ! results[worker]->pop(result) ) {
+            return 1;
+        }
+        std::unique_ptr<ReindexResult> resultOwner(result);
+        assigned.pop_front();
+        nQueued[worker] -= 1;
+
+        if ( result->failed ) {
+            fs::path name;
+            getFileName(db, result->fileId, name);
+            std::fprintf(stderr, "the archive of \"%s\" is broken.\n", name.c_str());
+            return 1;
+        }
+        TraceSpan span("write scenes");
+        span.setCount(std::int64_t(result->scenes.size()));
+        for ( const Scene& scene : result->scenes ) {
+            if ( sqlite3_bind_int64(stmt, 1, sqlite3_int64(scene.sceneId.hash))
+                 || sqlite3_bind_int(stmt, 2, scene.sceneId.durationMs)
+                 || sqlite3_bind_int(stmt, 3, scene.fileId) || sqlite3_step(stmt) != SQLITE_DONE ) {
+                std::fprintf(stderr, "INSERT INTO scenes_new: %s\n", sqlite3_errmsg(db));
+                return 1;
+            }
+            sqlite3_reset(stmt);
+            VIDUP_PROBE3(
+                scene_registered, scene.fileId, scene.sceneId.hash, scene.sceneId.durationMs
+            );
+        }
+        if ( registerThumbnails(db, result->fileId, result->thumbnails)
+             || registerEmbedding(db, result->fileId, result->embedding) ) {
+            return 1;
+        }
+
+        nFrames += result->nFrames;
+        nScenes += result->scenes.size();
+        throttle.write.take(double(result->scenes.size()));
+        return 0;
+    };
+
+    // 割り振れる仕事が一番少ないワーカー (どれも kReindexQueueSize なら nWorkers)
+    auto idleWorker = [&] {
+        std::size_t worker = nWorkers;
+        for ( std::size_t i = 0; i < nActive; i += 1 ) {
+            if ( nQueued[i] < kReindexQueueSize
+                 && (worker == nWorkers || nQueued[i] < nQueued[worker]) ) {
+                worker = i;
+            }
+        }
+        return worker;
+    };
+
+    double lastWaitedSeconds = 0; // CPU の予算で待った秒数
+    for ( std::size_t i = 0; ! failed && i < fileIds.size(); i += 1 ) {
+        if ( isInterrupted.load() ) {
+            failed = true;
+            break;
+        }
+        if ( throttle.cpu.isLimited() ) {
+            double      waitedSeconds = throttle.cpu.waitedSeconds();
+            std::size_t nPrevious     = nActive;
+            if ( waitedSeconds > lastWaitedSeconds && nActive > 1 ) {
+                nActive -= 1;
+            } else if ( waitedSeconds == lastWaitedSeconds && throttle.cpu.isFull()
+                        && nActive < nWorkers ) {
+                nActive += 1;
+            }
+            if ( nActive != nPrevious ) {
+                debugPrintf("reindex: %zu active workers\n", nActive);
+            }
+            lastWaitedSeconds = waitedSeconds;
+        }
+
+        // ワーカーごとに kReindexQueueSize を超えて割り振らない
+        std::size_t worker = idleWorker();
+        while ( ! failed && worker == nWorkers ) {
+            failed = collect();
+            worker = idleWorker();
+        }
+
+        std::unique_ptr<ReindexJob> job(new ReindexJob);
+        bool                        found   = false;
+        std::size_t                 jobSize = 0;
+        job->fileId                         = fileIds[i];
+        {
+            TraceSpan span("read archive");
+            failed = failed || getArchive(db, job->fileId, job->info, found) || ! found
+                || getArchiveBlocks(db, job->fileId, job->blocks);
+            for ( const std::vector<std::uint8_t>& block : job->blocks ) {
+                jobSize += block.size();
+            }
+            span.setCount(std::int64_t(jobSize));
+        }
+        if ( failed ) {
+            break;
+        }
+        archiveSize += jobSize;
+        throttle.input.take(double(jobSize));
+
+        jobs[worker]->push(job.release());
+        assigned.push_back(worker);
+        nQueued[worker] += 1;
+    }
+    while ( ! failed && ! assigned.empty() ) {
+        failed = collect();
+    }
+
+    // 失敗したらワーカーを止めて、受け取っていない仕事と結果を捨てる
+    for ( std::size_t i = 0; i < nWorkers; i += 1 ) {
+        jobs[i]->close();
+        if ( failed ) {
+            results[i]->close();
+        }
+    }
+    for ( std::size_t i = 0; i < nWorkers; i += 1 ) {
+        workers[i].join();
+
+        ReindexJob*    job;
+        ReindexResult* result;
+        while ( jobs[i]->pop(job) ) {
+            delete job;
+        }
+        while ( results[i]->pop(result) ) {
+            delete result;
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    double detectSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                               .count();
+
+    // 入れ替えて索引を作り直す
+    TraceSpan rebuildSpan("rebuild indexes");
+    failed = failed || execSql(db, "DROP TABLE scenes")
+        || execSql(db, "ALTER TABLE scenes_new RENAME TO scenes") || createTables(db)
+        || rebuildPostings(db) || rebuildFrequencies(db) || rebuildSketches(db)
+        || setMeta(db, "hash_bits", hashType) || setMeta(db, "frame_stride", frameStride)
+        || incrementMeta(db, "embedding_generation") || incrementMeta(db, "search_generation");
+    if ( failed ) {
+        execSql(db, "ROLLBACK");
+        return isInterrupted.load() ? VIDUP_INTERRUPTED : VIDUP_ERROR;
+    }
+    if ( execSql(db, "COMMIT") ) {
+        return VIDUP_ERROR;
+    }
+    rebuildSpan.end();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                         .count();
+    std::fprintf(
+        stderr,
+        "reindexed %zu files, %llu frames, %llu scenes in %.2f s with %zu threads"
+        " (detection %.2f s, %.0f frames/s, %.1f MiB/s of archive)\n",
+        fileIds.size(),
+        nFrames,
+        nScenes,
+        seconds,
+        nWorkers,
+        detectSeconds,
+        double(nFrames) / detectSeconds,
+        double(archiveSize) / detectSeconds / (1024 * 1024)
+    );
+
+    return 0;
+}
+
+//! 2 つのサムネイルの最初と中央のフレームがどちらも近ければ true
+static bool isSimilarThumbnail(const std::uint8_t* a, const std::uint8_t* b)
+{
+    std::uint8_t frameA[kFrameSize];
+    std::uint8_t frameB[kFrameSize];
+
+    for ( std::size_t offset = 0; offset < kThumbnailSize; offset += kPackedFrameSize ) {
+        unpackFrame(a + offset, frameA);
+        unpackFrame(b + offset, frameB);
+        if ( rmse(frameA, frameB) > kSceneChangedThreshold ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//! 一致したシーンをサムネイルで確かめて数え直す
+//!
+//! @return 成功なら 0
+//!
+//! ハッシュと長さが同じで、サムネイルも近いシーンが candidateId にあるシーンだけを数える。
+//! どちらかのファイルにサムネイルがなければ数え直さない。
+static int verifyByThumbnails(
+    sqlite3*                         db,
+    const std::vector<Scene>&        query,
+    const std::vector<std::uint8_t>& queryThumbnails,
+    FileId                           candidateId,
+    int&                             matchedScenes,
+    DurationMs&                      matchedMs
+)
+{
+    std::vector<Scene>        candidate;
+    std::vector<std::uint8_t> candidateThumbnails;
+
+    if ( getScenesByFile(db, candidateId, candidate) ) {
+        return 1;
+    }
+    if ( getThumbnails(db, candidateId, candidateThumbnails) ) {
+        return 1;
+    }
+    if ( queryThumbnails.size() != query.size() * kThumbnailSize
+         || candidateThumbnails.size() != candidate.size() * kThumbnailSize ) {
+        return 0;
+    }
+
+    // candidate のシーンをキー順に並べる
+    std::vector<std::pair<std::uint64_t, std::size_t>> keys;
+    for ( std::size_t j = 0; j < candidate.size(); j += 1 ) {
+        keys.emplace_back(packSceneId(candidate[j].sceneId), j);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    matchedScenes = 0;
+    matchedMs     = 0;
+    for ( std::size_t i = 0; i < query.size(); i += 1 ) {
+        std::uint64_t key = packSceneId(query[i].sceneId);
+        auto          it  = std::lower_bound(
+            keys.begin(), keys.end(), std::make_pair(key, std::size_t(0))
+        );
+        for ( ; it != keys.end() && it->first == key; ++it ) {
+            const std::uint8_t* a = &queryThumbnails[i * kThumbnailSize];
+            const std::uint8_t* b = &candidateThumbnails[it->second * kThumbnailSize];
+            if ( isSimilarThumbnail(a, b) ) {
+                matchedScenes += 1;
+                matchedMs += query[i].sceneId.durationMs;
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+//! searchFile() の段ごとの件数
+struct SearchStats {
+    int          filesScanned   = 0; //!< 1 段目で要約を調べたファイル
+    int          candidates     = 0; //!< 1 段目を通過したファイル
+    int          filesVerified  = 0; //!< 2 段目でシーンを照合したファイル
+    int          scenesCompared = 0; //!< 2 段目で照合した候補側のシーン
+    int          filesMatched   = 0; //!< 照合して一致したファイル
+    int          scenesProbed   = 0; //!< searchByScenes() で調べたシーン
+    std::int64_t rowsRead       = 0; //!< searchByScenes() で引いた行
+    int          scenesRejected = 0; //!< サムネイルが似ていなくて除いたシーン
+};
+
+//! searchFile() の候補
+struct SearchCandidate {
+    FileId     fileId;
+    int        upperBound; //!< 共有しうるシーン数の上限
+    int        matchedScenes;
+    DurationMs matchedMs;
+    bool       isUnverified = false; //!< 期限までにサムネイルで確かめられなかった
+};
+
+//! 一致したシーン数が同じなら、一致した時間が長い方を上位にする
+static bool isBetterCandidate(const SearchCandidate& a, const SearchCandidate& b)
+{
+    if ( a.matchedScenes != b.matchedScenes ) {
+        return a.matchedScenes > b.matchedScenes;
+    }
+    if ( a.matchedMs != b.matchedMs ) {
+        return a.matchedMs > b.matchedMs;
+    }
+    return a.fileId < b.fileId;
+}
+
+//! 要約で候補を絞ってから照合する (searchFile() の既定)
+//!
+//! @return 成功なら 0
+//!
+//! 1 段目は問い合わせのシーンと同じバケットのシーンを持つファイルだけについて、
+//! ファイル単位の要約 (Bloom filter と合計時間) から共有シーン数の上限を見積もり、
+//! 2 段目は上限の大きい候補から順にシーン単位で照合する。
+//! 上位 limit 件の一致数が残りの候補の上限を上回ったら照合をやめる。
+static int searchBySketches(
+    sqlite3*                      db,
+    FileId                        fileId,
+    const std::vector<Scene>&     scenesOfFile,
+    const SceneSet&               querySet,
+    int                           limit,
+    std::vector<SearchCandidate>& results,
+    SearchStats&                  stats
+)
+{
+    // 1 段目: ファイル単位で候補を絞り込む
+    //
+    // 問い合わせのシーンと同じバケットのシーンを持つファイルの要約だけを引く。
+    // ポスティングビットマップがあるシーンはビットマップで正確に、
+    // それ以外はバケットと Bloom filter で判定する。候補の合計時間より長いシーンは含まれえない。
+    struct Probe {
+        std::uint64_t h1;
+        std::uint64_t h2;
+        int           count;
+        DurationMs    durationMs;
+        int           iPosting; //!< postings の添字 (なければ -1)
+        std::size_t   iBucket;  //!< buckets の添字
+    };
+    std::vector<Probe>           probes;
+    std::vector<RoaringBitmap>   postings;
+    std::vector<SearchCandidate> candidates;
+
+    std::vector<std::uint32_t> bucketIds = getSketchBuckets(querySet);
+    std::vector<RoaringBitmap> buckets(bucketIds.size());
+    RoaringBitmap              fileIds;
+    for ( std::size_t i = 0; i < bucketIds.size(); i += 1 ) {
+        if ( getSketchBucket(db, bucketIds[i], buckets[i]) ) {
+            return 1;
+        }
+        fileIds.unionWith(buckets[i]);
+    }
+
+    for ( std::size_t i = 0; i < querySet.keys.size(); i += 1 ) {
+        std::size_t iBucket
+            = std::lower_bound(bucketIds.begin(), bucketIds.end(), sketchBucket(querySet.keys[i]))
+            - bucketIds.begin();
+        Probe probe { 0, 0, querySet.counts[i], querySet.durationMs[i], -1, iBucket };
+        SceneBloom::hashKey(querySet.keys[i], probe.h1, probe.h2);
+        probes.push_back(probe);
+    }
+    std::vector<bool> isPostingLoaded(probes.size(), false);
+    for ( const Scene& scene : scenesOfFile ) {
+        std::size_t i = std::lower_bound(
+                            querySet.keys.begin(), querySet.keys.end(), packSceneId(scene.sceneId)
+                        )
+            - querySet.keys.begin();
+        if ( isPostingLoaded[i] ) {
+            continue;
+        }
+        isPostingLoaded[i] = true;
+
+        RoaringBitmap posting;
+        bool          found = false;
+        if ( getPosting(db, scene.sceneId, posting, found) ) {
+            return 1;
+        }
+        if ( found ) {
+            probes[i].iPosting = int(postings.size());
+            postings.push_back(std::move(posting));
+        }
+    }
+
+    int status = forEachSketch(
+        db,
+        fileIds,
+        [&](FileId id, std::int64_t totalMs, const std::uint64_t* words, std::size_t nWords) {
+            stats.filesScanned += 1;
+            if ( id == fileId ) {
+                return;
+            }
+
+            int upperBound = 0;
+            for ( const Probe& probe : probes ) {
+                if ( probe.durationMs > totalMs ) {
+                    continue;
+                }
+                bool mayContain = probe.iPosting >= 0
+                    ? postings[probe.iPosting].contains(std::uint32_t(id))
+                    : buckets[probe.iBucket].contains(std::uint32_t(id))
+                        && SceneBloom::mayContain(words, nWords, probe.h1, probe.h2);
+                if ( mayContain ) {
+                    upperBound += probe.count;
+                }
+            }
+            if ( upperBound > 0 ) {
+                candidates.push_back(SearchCandidate { id, upperBound, 0, 0 });
+            }
+        }
+    );
+    if ( status ) {
+        return 1;
+    }
+    stats.candidates = int(candidates.size());
+
+    std::stable_sort(candidates.begin(), candidates.end(), [&](const auto& a, const auto& b) {
+        return a.upperBound > b.upperBound;
+    });
+
+    // 2 段目: 上限の大きい候補から順にシーン単位で照合する
+    SceneSet candidateSet;
+
+    for ( SearchCandidate& candidate : candidates ) {
+        // 上限が limit 件目に届かなければ、以降の候補も上位には入らない
+        if ( int(results.size()) >= limit
+             && candidate.upperBound < results[limit - 1].matchedScenes ) {
+            break;
+        }
+
+        std::vector<Scene> scenesOfCandidate;
+        if ( getScenesByFile(db, candidate.fileId, scenesOfCandidate) ) {
+            return 1;
+        }
+        makeSceneSet(scenesOfCandidate, candidateSet);
+        matchSceneSets(querySet, candidateSet, candidate.matchedScenes, candidate.matchedMs);
+        stats.filesVerified += 1;
+        stats.scenesCompared += int(scenesOfCandidate.size());
+
+        if ( candidate.matchedScenes == 0 ) {
+            continue;
+        }
+        stats.filesMatched += 1;
+
+        results.insert(
+            std::upper_bound(results.begin(), results.end(), candidate, isBetterCandidate),
+            candidate
+        );
+        if ( int(results.size()) > limit ) {
+            results.pop_back();
+        }
+    }
+
+    return 0;
+}
+
+//! searchByScenes() で調べるシーン
+struct SceneProbe {
+    std::size_t iKey;   //!< SceneSet の添字
+    int         nFiles; //!< シーンを含むファイル数 (kUnknownFiles なら分からない)
+};
+
+//! 期限までに取得できなかったシーンの SceneProbe::nFiles (最後に調べる)
+static const int kUnknownFiles = std::numeric_limits<int>::max();
+
+//! querySet のシーンごとに含まれるファイル数を取得する
+//!
+//! @return 成功なら 0
+//!
+//! シーンを一時テーブルに入れ、frequencies と 1 回の問い合わせで結合する。
+//! deadline を過ぎたら残りの行は読まずに返し、取得できなかったシーンは kUnknownFiles にする。
+static int getSceneProbes(
+    sqlite3*                              db,
+    const SceneSet&                       querySet,
+    std::chrono::steady_clock::time_point deadline,
+    std::vector<SceneProbe>&              probes
+)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    probes.clear();
+    for ( std::size_t i = 0; i < querySet.keys.size(); i += 1 ) {
+        probes.push_back({ i, kUnknownFiles });
+    }
+
+    if ( execSql(
+             db,
+             "CREATE TEMP TABLE IF NOT EXISTS query_scenes("
+             "i INTEGER PRIMARY KEY,"
+             "hash INTEGER,"
+             "duration_ms INTEGER"
+             ")"
+         )
+         || execSql(db, "DELETE FROM temp.query_scenes") ) {
+        return 1;
+    }
+
+    status = sqlite3_prepare_v2(
+        db,
+        "INSERT INTO temp.query_scenes (i, hash, duration_ms) VALUES (?, ?, ?)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getSceneProbes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+    for ( std::size_t i = 0; i < querySet.keys.size(); i += 1 ) {
+        DurationMs durationMs = querySet.durationMs[i];
+        Hash       hash       = unpackSceneHash(querySet.keys[i], durationMs);
+        if ( sqlite3_bind_int64(stmt, 1, sqlite3_int64(i))
+             || sqlite3_bind_int64(stmt, 2, sqlite3_int64(hash))
+             || sqlite3_bind_int(stmt, 3, durationMs) || sqlite3_step(stmt) != SQLITE_DONE ) {
+            std::fprintf(stderr, "getSceneProbes: %s\n", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return 1;
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    // frequencies にないシーンは 0 ファイル
+    status = sqlite3_prepare_v2(
+        db,
+        "SELECT q.i, IFNULL(f.files, 0) FROM temp.query_scenes AS q"
+        " LEFT JOIN frequencies AS f ON (f.hash = q.hash AND f.duration_ms = q.duration_ms)",
+        -1,
+        &stmt,
+        nullptr
+    );
+    if ( status ) {
+        std::fprintf(stderr, "getSceneProbes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+    while ( (status = sqlite3_step(stmt)) == SQLITE_ROW ) {
+        std::int64_t i = sqlite3_column_int64(stmt, 0);
+        if ( i >= 0 && std::size_t(i) < probes.size() ) {
+            probes[std::size_t(i)].nFiles = sqlite3_column_int(stmt, 1);
+        }
+        if ( std::chrono::steady_clock::now() >= deadline ) {
+            status = SQLITE_DONE;
+            break;
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "getSceneProbes: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+    return 0;
+}
+
+//! 含まれるファイルの少ないシーンから順にファイルを列挙して数える
+//!
+//! @return 成功なら 0
+//!
+//! 残りのシーンがすべて一致しても limit 件目の一致数に届かなくなったら、新しいファイルは
+//! 数えずに、上位に残りうる候補だけを数え続ける。ビットマップのある大きなシーンはこのとき
+//! 列挙せずに候補ごとに引く。結果は searchBySketches() と一致する。
+//!
+//! シーンごとに期限を確かめ、過ぎたらそこまでに数えた上位 limit 件を返して isPartial を
+//! 立てる。最初のシーンは期限を過ぎていても調べるので、一致があれば空にはならない。
+static int searchByScenes(
+    sqlite3*                              db,
+    FileId                                fileId,
+    const SceneSet&                       querySet,
+    std::vector<SceneProbe>               probes,
+    int                                   limit,
+    std::chrono::steady_clock::time_point deadline,
+    std::vector<SearchCandidate>&         results,
+    SearchStats&                          stats,
+    bool&                                 isPartial
+)
+{
+    std::stable_sort(probes.begin(), probes.end(), [](const SceneProbe& a, const SceneProbe& b) {
+        return a.nFiles < b.nFiles;
+    });
+
+    // 残りのシーンで増えうる一致数
+    int remaining = 0;
+    for ( const SceneProbe& probe : probes ) {
+        remaining += querySet.counts[probe.iKey];
+    }
+
+    std::map<FileId, SearchCandidate> matched;
+    bool                              isClosed = false; // 新しいファイルは上位に入りえない
+    std::vector<Scene>                scenes;
+    RoaringBitmap                     posting;
+    std::vector<int>                  scores;
+
+    for ( const SceneProbe& probe : probes ) {
+        if ( stats.scenesProbed > 0 && std::chrono::steady_clock::now() >= deadline ) {
+            isPartial = true;
+            break;
+        }
+
+        int        count      = querySet.counts[probe.iKey];
+        DurationMs durationMs = querySet.durationMs[probe.iKey];
+        SceneId    sceneId { unpackSceneHash(querySet.keys[probe.iKey], durationMs), durationMs };
+        auto       addFile = [&](FileId id) {
+            if ( id == fileId ) {
+                return;
+            }
+            auto it = matched.find(id);
+            if ( it == matched.end() ) {
+                if ( isClosed ) {
+                    return;
+                }
+                it = matched.emplace(id, SearchCandidate { id, 0, 0, 0 }).first;
+            }
+            it->second.matchedScenes += count;
+            it->second.matchedMs += durationMs * count;
+        };
+        remaining -= count;
+
+        // 引いた行数を数える (ビットマップは 1 行)
+        std::int64_t rowsBefore = stats.rowsRead;
+        VIDUP_PROBE2(index_probe_start, sceneId.hash, probe.nFiles);
+
+        bool found = false;
+        if ( probe.nFiles >= kPostingBitmapThreshold / 2 ) {
+            if ( getPosting(db, sceneId, posting, found) ) {
+                return 1;
+            }
+            stats.rowsRead += found ? 1 : 0;
+        }
+        if ( found && isClosed ) {
+            for ( auto& entry : matched ) {
+                if ( posting.contains(std::uint32_t(entry.first)) ) {
+                    addFile(entry.first);
+                }
+            }
+        } else if ( found ) {
+            posting.forEach([&](std::uint32_t id) { addFile(FileId(id)); });
+        } else {
+            scenes.clear();
+            if ( getScenesByHash(db, sceneId, scenes) ) {
+                return 1;
+            }
+            stats.rowsRead += std::int64_t(scenes.size());
+            for ( const Scene& scene : scenes ) {
+                addFile(scene.fileId);
+            }
+        }
+        stats.scenesProbed += 1;
+        VIDUP_PROBE2(index_probe_end, sceneId.hash, stats.rowsRead - rowsBefore);
+
+        // limit 件目の一致数に届かない候補を除く
+        if ( int(matched.size()) < limit ) {
+            continue;
+        }
+        scores.clear();
+        for ( const auto& entry : matched ) {
+            scores.push_back(entry.second.matchedScenes);
+        }
+        std::nth_element(
+            scores.begin(), scores.begin() + (limit - 1), scores.end(), std::greater<int>()
+        );
+        int threshold = scores[limit - 1];
+        if ( remaining < threshold ) {
+            isClosed = true;
+            for ( auto it = matched.begin(); it != matched.end(); ) {
+                if ( it->second.matchedScenes + remaining < threshold ) {
+                    it = matched.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+
+    for ( const auto& entry : matched ) {
+        results.push_back(entry.second);
+    }
+    stats.filesMatched = int(results.size());
+    std::sort(results.begin(), results.end(), isBetterCandidate);
+    if ( int(results.size()) > limit ) {
+        results.resize(limit);
+    }
+
+    return 0;
+}
+
+//! 類似のファイルを検索する
+//!
+//! @return 成功なら 0
+//!
+//! 一致したファイルを一致数の多い順に matches に返す。
+//! timeoutMs が正なら searchByScenes() で選択度の高いシーンから調べ、期限までに見つかった
+//! 上位を返す。期限に間に合わなければ isPartial を立てる。0 なら searchBySketches() で
+//! 最後まで調べる。
+//!
+//! isVerifying なら上位 limit 件の一致をサムネイルで確かめて数え直す。
+//! 期限までに確かめられなかった一致は数え直さずに返し、isUnverified を立てる。
+//!
+//! 最後まで調べた結果は search_generation とともに cache に覚えておき、シーンの登録や削除で
+//! search_generation が変わるまで同じ引数の検索に返す。ほかのプロセスの検索にも返せるように
+//! search_cache にも保存するが、期限付きの検索は書き込みを待たないように保存しない。
+static int searchFile(
+    sqlite3*            db,
+    SearchCache&        cache,
+    FileId              fileId,
+    int                 limit,
+    bool                isVerifying,
+    int                 timeoutMs,
+    std::vector<Match>& matches,
+    bool&               isPartial
+)
+{
+    auto deadline = timeoutMs > 0
+        ? std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs)
+        : std::chrono::steady_clock::time_point::max();
+
+    std::vector<Scene>           scenesOfFile;
+    SceneSet                     querySet;
+    SearchStats                  stats;
+    std::vector<SearchCandidate> results;
+    TraceSpan                    span("search");
+
+    isPartial = false;
+
+    // 索引が変わっていなければ前回の結果をそのまま返す
+    int              cacheFlags = isVerifying ? 1 : 0;
+    SearchCache::Key cacheKey(fileId, limit, cacheFlags);
+    std::int64_t     generation = 0;
+    bool             isCached   = false;
+    if ( getMeta(db, "search_generation", generation, 0) ) {
+        return 1;
+    }
+    if ( cache.generation != generation ) {
+        cache.entries.clear();
+        cache.generation = generation;
+    }
+    {
+        TraceSpan cacheSpan("read cache");
+        auto      it = cache.entries.find(cacheKey);
+        if ( it != cache.entries.end() ) {
+            matches  = it->second;
+            isCached = true;
+        } else {
+            if ( getCachedSearch(db, fileId, limit, cacheFlags, generation, matches, isCached) ) {
+                return 1;
+            }
+        }
+    }
+    if ( isCached ) {
+        debugPrintf("cached at generation %lld\n", static_cast<long long>(generation));
+        if ( cache.entries.size() < kMaxCachedSearches ) {
+            cache.entries.emplace(cacheKey, matches);
+        }
+        return 0;
+    }
+
+    // fileId のシーンを列挙
+    {
+        TraceSpan querySpan("read query");
+        if ( getScenesByFile(db, fileId, scenesOfFile) ) {
+            return 1;
+        }
+        makeSceneSet(scenesOfFile, querySet);
+        querySpan.setCount(std::int64_t(scenesOfFile.size()));
+    }
+
+    // 引く行数の見積もりがファイル数より多ければ要約を走査する方が速い
+    std::vector<SceneProbe> probes;
+    std::int64_t            nRows     = 0;
+    FileId                  maxFileId = 0;
+    {
+        TraceSpan planSpan("plan");
+        if ( getSceneProbes(db, querySet, deadline, probes) ) {
+            return 1;
+        }
+        for ( const SceneProbe& probe : probes ) {
+            nRows += probe.nFiles < kPostingBitmapThreshold ? probe.nFiles : 1;
+        }
+        if ( getMaxFileId(db, maxFileId) ) {
+            return 1;
+        }
+        planSpan.setCount(nRows);
+    }
+    bool isProbing = timeoutMs > 0 || nRows <= maxFileId;
+
+    if ( isProbing ) {
+        TraceSpan probeSpan("probe scenes");
+        if ( searchByScenes(
+                 db, fileId, querySet, probes, limit, deadline, results, stats, isPartial
+             ) ) {
+            return 1;
+        }
+        probeSpan.setCount(stats.rowsRead);
+    } else {
+        TraceSpan scanSpan("scan sketches");
+        if ( searchBySketches(db, fileId, scenesOfFile, querySet, limit, results, stats) ) {
+            return 1;
+        }
+        scanSpan.setCount(stats.filesScanned);
+    }
+
+    if ( isVerifying ) {
+        TraceSpan                 verifySpan("verify thumbnails");
+        std::vector<std::uint8_t> queryThumbnails;
+        if ( getThumbnails(db, fileId, queryThumbnails) ) {
+            return 1;
+        }
+
+        for ( SearchCandidate& result : results ) {
+            if ( std::chrono::steady_clock::now() >= deadline ) {
+                result.isUnverified = true;
+                isPartial           = true;
+                continue;
+            }
+
+            int matchedScenes = result.matchedScenes;
+            if ( verifyByThumbnails(
+                     db,
+                     scenesOfFile,
+                     queryThumbnails,
+                     result.fileId,
+                     result.matchedScenes,
+                     result.matchedMs
+                 ) ) {
+                return 1;
+            }
+            stats.scenesRejected += matchedScenes - result.matchedScenes;
+        }
+
+        results.erase(
+            std::remove_if(
+                results.begin(),
+                results.end(),
+                [](const SearchCandidate& result) { return result.matchedScenes == 0; }
+            ),
+            results.end()
+        );
+        std::sort(results.begin(), results.end(), isBetterCandidate);
+    }
+
+    if ( isProbing ) {
+        debugPrintf(
+            "%d of %zu scenes probed (%lld rows, %lld estimated), %d files matched%s\n",
+            stats.scenesProbed,
+            querySet.keys.size(),
+            static_cast<long long>(stats.rowsRead),
+            static_cast<long long>(nRows),
+            stats.filesMatched,
+            isPartial ? " (timed out)" : ""
+        );
+    } else {
+        debugPrintf(
+            "stage 1: %d files scanned, %d candidates\n"
+            "stage 2: %d files verified (%d scenes), %d files matched\n",
+            stats.filesScanned,
+            stats.candidates,
+            stats.filesVerified,
+            stats.scenesCompared,
+            stats.filesMatched
+        );
+    }
+    if ( isVerifying ) {
+        debugPrintf("thumbnails: %d scenes rejected\n", stats.scenesRejected);
+    }
+
+    matches.clear();
+    for ( const auto& result : results ) {
+        Match match { result.fileId, -1, result.matchedScenes, result.matchedMs / 1000.0, 0 };
+        match.isUnverified = result.isUnverified;
+        matches.push_back(match);
+    }
+
+    // 途中までの結果はキャッシュしない。書き込めなくても検索は成功とする。
+    if ( ! isPartial ) {
+        if ( cache.entries.size() >= kMaxCachedSearches ) {
+            cache.entries.clear();
+        }
+        cache.entries[cacheKey] = matches;
+    }
+    if ( ! isPartial && timeoutMs <= 0 ) {
+        TraceSpan cacheSpan("write cache");
+        putCachedSearch(db, fileId, limit, cacheFlags, generation, matches);
+    }
+
+    return 0;
+}
+
+//! 類似のシーン上位 limit 件を含むファイルの組を列挙する
+//!
+//! @return 成功なら 0
+//!
+//! 組を共有している時間の長い順に matches に返す。
+static int top(sqlite3* db, int limit, std::vector<Match>& matches)
+{
+    std::vector<HashCount> hashCounts;
+
+    if ( getTopHashes(db, limit, hashCounts) ) {
+        return 1;
+    }
+
+    // hashCounts と同じハッシュを含むシーンを列挙
+    std::vector<Scene> foundScenes;
+    RoaringBitmap      fileIds;
+    for ( const HashCount& hashCount : hashCounts ) {
+        RoaringBitmap posting;
+        if ( getPostingFiles(db, hashCount.sceneId, posting) ) {
+            return 1;
+        }
+        posting.forEach([&](std::uint32_t id) {
+            foundScenes.emplace_back(Scene { hashCount.sceneId, FileId(id) });
+        });
+        fileIds.unionWith(posting);
+
+        // 同じシーンを含むファイル名を列挙
+        debugPrintf("---- %8.1f seconds matched\n", hashCount.sceneId.durationMs / 1000.0);
+    }
+
+    // ファイルを列挙
+    std::vector<FileId> orderedFileIds;
+
+    fileIds.forEach([&](std::uint32_t id) { orderedFileIds.push_back(FileId(id)); });
+
+    // foundScenes をファイルとハッシュをキーに分類
+    // TODO: unorderd_multimap でいいのでは
+    std::map<FileId, std::vector<const Scene*>>  fileScenes;
+    std::map<SceneId, std::vector<const Scene*>> hashScenes;
+
+    for ( const Scene& scene : foundScenes ) {
+        fileScenes[scene.fileId].push_back(&scene);
+        hashScenes[scene.sceneId].push_back(&scene);
+    }
+
+    // 注目しているファイルと共有している時間を積算
+    //
+    // A → B と B → A は同じになるため、一度積算したら fileIds から削除する。
+    std::map<FileId, std::map<FileId, DurationMs>> relationMap;
+
+    for ( FileId fileId : orderedFileIds ) {
+        fileIds.remove(std::uint32_t(fileId));
+        auto& relation = relationMap[fileId];
+
+        for ( const Scene* fileScene : fileScenes[fileId] ) {
+            for ( const Scene* hashScene : hashScenes[fileScene->sceneId] ) {
+                if ( ! fileIds.contains(std::uint32_t(hashScene->fileId)) ) {
+                    // B → A はやらない
+                    continue;
+                }
+                relation[hashScene->fileId] += fileScene->sceneId.durationMs;
+            }
+        }
+    }
+
+    // 積算結果を vector に詰替え
+    std::vector<std::tuple<FileId, FileId, DurationMs>> relations;
+
+    // for ( const std::pair<FileId, std::map<FileId, DurationMs>>& relation : relationMap ) {
+    for ( const auto& relation : relationMap ) {
+        for ( const auto& fileDuration : relation.second ) {
+            relations.emplace_back(relation.first, fileDuration.first, fileDuration.second);
+        }
+    }
+
+    // duration でソート
+    std::sort(relations.begin(), relations.end(), [&](const auto& a, const auto& b) {
+        return std::get<2>(a) > std::get<2>(b);
+    });
+
+    matches.clear();
+    for ( const auto& relation : relations ) {
+        matches.push_back(
+            { std::get<0>(relation), std::get<1>(relation), 0, std::get<2>(relation) / 1000.0f, 0 }
+        );
+    }
+
+    return 0;
+}
+
+//! 近似最近傍探索の索引を DB の特徴ベクトルに合わせる
+//!
+//! @return 成功なら 0
+//!
+//! annPath の索引が DB と同じ世代ならそのまま使う。
+//! 違えば増えたファイルを追加、消えたファイルを削除して annPath に保存する。
+static int syncAnnIndex(sqlite3* db, const fs::path& annPath, HnswIndex& index)
+{
+    std::int64_t generation = 0;
+    if ( getMeta(db, "embedding_generation", generation, 0) ) {
+        return 1;
+    }
+
+    bool isLoaded = index.load(annPath.c_str());
+    if ( isLoaded && index.generation() == std::uint64_t(generation) ) {
+        return 0;
+    }
+
+    std::vector<std::pair<FileId, Embedding>> embeddings;
+    if ( getEmbeddings(db, -1, embeddings) ) {
+        return 1;
+    }
+
+    // 墓標が多すぎたら作り直す
+    if ( ! isLoaded || index.deletedCount() * 2 > index.size() ) {
+        index = HnswIndex(kEmbeddingSize);
+    }
+
+    std::vector<std::uint32_t> labels = index.labels();
+    RoaringBitmap              current;
+    for ( const auto& embedding : embeddings ) {
+        current.add(std::uint32_t(embedding.first));
+    }
+    for ( std::uint32_t label : labels ) {
+        if ( ! current.contains(label) ) {
+            index.remove(label);
+        }
+    }
+    for ( const auto& embedding : embeddings ) {
+        // files.id は使い回されるので (--force で登録し直したときなど)、同じ label でも
+        // ベクトルが変わっていたら入れ替える
+        std::uint32_t label  = std::uint32_t(embedding.first);
+        const float*  stored = index.find(label);
+        if ( stored && std::memcmp(stored, embedding.second.data(), sizeof(Embedding)) != 0 ) {
+            index.remove(label);
+        }
+        index.add(label, embedding.second.data());
+    }
+    index.setGeneration(std::uint64_t(generation));
+
+    debugPrintf(
+        "ann index: %zu files, generation %lld\n",
+        embeddings.size(),
+        static_cast<long long>(generation)
+    );
+
+    // 書きかけの索引を読まないように、別名で保存してから置き換える
+    fs::path        tempPath = fs::path(annPath).concat(".tmp");
+    std::error_code error;
+    if ( ! index.save(tempPath.c_str()) ) {
+        std::perror("save ann index");
+    } else if ( fs::rename(tempPath, annPath, error); error ) {
+        std::fprintf(stderr, "rename ann index: %s\n", error.message().c_str());
+    }
+
+    return 0;
+}
+
+//! 特徴ベクトルの索引の 1 つの版
+//!
+//! 公開した版は変えない。登録と削除は base を共有したまま overrides だけを写した版にし、
+//! overrides が kAnnMergeThreshold を超えたらバックグラウンドで base にまとめる。
+struct AnnSnapshot {
+    //! まとめ終わった部分
+    struct Base {
+        HnswIndex                               index { kEmbeddingSize };
+        std::unordered_map<FileId, AnnEntry>    entries;
+        std::unordered_map<std::string, FileId> ids;
+    };
+
+    std::shared_ptr<const Base> base;
+
+    //! base より新しい変更 (nullptr なら削除)
+    std::map<FileId, std::shared_ptr<const AnnEntry>> overrides;
+};
+
+//! overrides がこれを超えたら base にまとめる
+static const std::size_t kAnnMergeThreshold = 256;
+
+//! snapshot で name のファイルを探す
+//!
+//! @return 特徴ベクトルのあるファイルがなければ -1
+static FileId findAnnFile(const AnnSnapshot& snapshot, const std::string& name)
+{
+    for ( const auto& change : snapshot.overrides ) {
+        if ( change.second && change.second->name == name ) {
+            return change.first;
+        }
+    }
+
+    auto found = snapshot.base->ids.find(name);
+    if ( found == snapshot.base->ids.end() || snapshot.overrides.count(found->second) ) {
+        return -1;
+    }
+    return found->second;
+}
+
+//! snapshot で fileId のファイルを引く
+//!
+//! @return なければ nullptr
+static const AnnEntry* getAnnEntry(const AnnSnapshot& snapshot, FileId fileId)
+{
+    auto change = snapshot.overrides.find(fileId);
+    if ( change != snapshot.overrides.end() ) {
+        return change->second.get();
+    }
+
+    auto found = snapshot.base->entries.find(fileId);
+    return found == snapshot.base->entries.end() ? nullptr : &found->second;
+}
+
+//! DB の特徴ベクトルから索引の版を作る
+//!
+//! @return 成功なら 0
+//!
+//! 索引は syncAnnIndex() で annPath と合わせてから読み込む。
+static int loadAnnSnapshot(
+    sqlite3* db, const fs::path& annPath, std::unique_ptr<AnnSnapshot>& snapshot
+)
+{
+    auto base = std::make_shared<AnnSnapshot::Base>();
+    if ( syncAnnIndex(db, annPath, base->index) ) {
+        return 1;
+    }
+
+    std::vector<std::pair<FileId, AnnEntry>> entries;
+    if ( getNamedEmbeddings(db, nullptr, entries) ) {
+        return 1;
+    }
+    for ( auto& entry : entries ) {
+        base->ids[entry.second.name] = entry.first;
+        base->entries.emplace(entry.first, std::move(entry.second));
+    }
+
+    snapshot.reset(new AnnSnapshot);
+    snapshot->base = std::move(base);
+    return 0;
+}
+
+//! base に overrides を反映した新しい base を作る
+static std::shared_ptr<const AnnSnapshot::Base> mergeAnnBase(
+    const AnnSnapshot::Base&                                 base,
+    const std::map<FileId, std::shared_ptr<const AnnEntry>>& overrides
+)
+{
+    auto merged = std::make_shared<AnnSnapshot::Base>(base);
+    for ( const auto& change : overrides ) {
+        auto found = merged->entries.find(change.first);
+        if ( found != merged->entries.end() ) {
+            merged->ids.erase(found->second.name);
+            merged->entries.erase(found);
+            merged->index.remove(std::uint32_t(change.first));
+        }
+    }
+    for ( const auto& change : overrides ) {
+        if ( change.second ) {
+            merged->ids[change.second->name] = change.first;
+            merged->entries.emplace(change.first, *change.second);
+            merged->index.add(std::uint32_t(change.first), change.second->embedding.data());
+        }
+    }
+
+    // 墓標が多すぎたら作り直す
+    if ( merged->index.deletedCount() * 2 > merged->index.size() ) {
+        merged->index = HnswIndex(kEmbeddingSize);
+        for ( const auto& entry : merged->entries ) {
+            merged->index.add(std::uint32_t(entry.first), entry.second.embedding.data());
+        }
+    }
+
+    debugPrintf(
+        "ann merge: %zu changes, %zu files\n", overrides.size(), merged->entries.size()
+    );
+    return merged;
+}
+
+#ifdef VIDUP_DEBUG_COMMANDS
+
+// vidup コマンドだけに入れるデバッグ用の関数 (debug.h)
+
+//! ファイル一覧を出力する
+//!
+//! @return 成功なら 0
+static int files(sqlite3* db)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int           status;
+
+    status = sqlite3_prepare_v2(db, "SELECT path, status FROM files", -1, &stmt, nullptr);
+    if ( status ) {
+        std::fprintf(stderr, "files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    status = sqlite3_step(stmt);
+    std::fprintf(stdout, "name\tstatus\n");
+    while ( status == SQLITE_ROW ) {
+        fs::path path       = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        int      fileStatus = sqlite3_column_int(stmt, 1);
+
+        std::fprintf(stdout, "%s\t%d\n", path.c_str(), fileStatus);
+        status = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if ( status != SQLITE_DONE ) {
+        std::fprintf(stderr, "files: %s\n", sqlite3_errmsg(db));
+        return status;
+    }
+
+    return 0;
+}
+
+//! fileId のシーンを出力する (デバッグ用)
+//!
+//! @return 成功なら 0
+static int showFileScenes(sqlite3* db, FileId fileId, HashType hashType)
+{
+    std::vector<Scene> scenesOfFile;
+
+    std::fprintf(stdout, "file id: %d\n", fileId);
+
+    // fileId のシーンを列挙
+    if ( getScenesByFile(db, fileId, scenesOfFile) ) {
+        return 1;
+    }
+
+    // scenesOfFile を出力
+    if ( hashType == HashType::kHashCrc64 ) {
+        std::fprintf(stdout, "hash             duration (ms)\n");
+        for ( const auto& scene : scenesOfFile ) {
+            std::fprintf(
+                stdout,
+                "%016llX %8d\n",
+                static_cast<unsigned long long>(scene.sceneId.hash),
+                scene.sceneId.durationMs
+            );
+        }
+    } else {
+        std::fprintf(stdout, "hash     duration (ms)\n");
+        for ( const auto& scene : scenesOfFile ) {
+            std::fprintf(
+                stdout, "%08X %8d\n", std::uint32_t(scene.sceneId.hash), scene.sceneId.durationMs
+            );
+        }
+    }
+
+    return 0;
+}
+
+//! fileId の保管庫からフレームを戻して標準出力に書き出す (デバッグ用)
+//!
+//! @return 成功なら 0
+//!
+//! 書き出したフレームはディザリング済みの入力と一致する。
+static int dumpArchiveFrames(sqlite3* db, FileId fileId, std::uint32_t iFirstFrame, int nFrames)
+{
+    ArchiveInfo info;
+    bool        found = false;
+    if ( getArchive(db, fileId, info, found) ) {
+        return 1;
+    }
+    if ( ! found ) {
+        std::fprintf(stderr, "the file is not archived.\n");
+        return 1;
+    }
+
+    std::uint32_t             iEndFrame = std::min<std::uint64_t>(
+        std::uint64_t(iFirstFrame) + std::uint64_t(nFrames), info.frameCount
+    );
+    std::vector<std::uint8_t> packed;
+    std::uint8_t              frame[kFrameSize];
+    for ( std::uint32_t i = iFirstFrame; i < iEndFrame; i += info.blockFrames ) {
+        std::uint32_t n = std::min(info.blockFrames, iEndFrame - i);
+        if ( readArchiveFrames(db, fileId, info, i, n, packed) ) {
+            return 1;
+        }
+        for ( std::size_t offset = 0; offset < packed.size(); offset += kPackedFrameSize ) {
+            unpackFrame(&packed[offset], frame);
+            if ( std::fwrite(frame, kFrameSize, 1, stdout) != 1 ) {
+                std::perror("fwrite");
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+//! intersectSorted() のマイクロベンチマーク (デバッグ用)
+//!
+//! @return 成功なら 0
+int benchIntersect()
+{
+    struct Case {
+        const char* name;
+        std::size_t na;
+        std::size_t nb;
+        std::size_t sparsity; //!< 要素数の何倍の範囲から選ぶか
+    };
+    static const Case kCases[] = {
+        { "small", 16, 16, 2 },
+        { "small", 16, 16, 16 },
+        { "medium", 1000, 1000, 2 },
+        { "medium", 1000, 1000, 16 },
+        { "large", 100000, 100000, 2 },
+        { "large", 100000, 100000, 16 },
+        { "skewed", 16, 100000, 2 },
+        { "skewed", 1000, 100000, 2 },
+    };
+
+    std::mt19937_64 random(1);
+
+    auto makeKeys = [&](std::size_t n, std::size_t universe) {
+        std::vector<std::uint64_t> keys;
+        while ( keys.size() < n ) {
+            keys.push_back(random() % universe * 0x9E3779B97F4A7C15ull);
+            if ( keys.size() == n ) {
+                std::sort(keys.begin(), keys.end());
+                keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            }
+        }
+        return keys;
+    };
+
+    auto measure = [](auto&& f) {
+        using Clock = std::chrono::steady_clock;
+
+        std::size_t       n     = 0;
+        Clock::time_point begin = Clock::now();
+        Clock::duration   elapsed {};
+        do {
+            f();
+            n += 1;
+            elapsed = Clock::now() - begin;
+        } while ( elapsed < std::chrono::milliseconds(200) );
+
+        return std::chrono::duration<double, std::nano>(elapsed).count() / n;
+    };
+
+    std::fprintf(
+        stdout, "case       |a|     |b|  matched   scalar (ns)   indexed (ns)   count (ns)\n"
+    );
+    for ( const Case& c : kCases ) {
+        std::size_t                universe = std::max(c.na, c.nb) * c.sparsity;
+        std::vector<std::uint64_t> a        = makeKeys(c.na, universe);
+        std::vector<std::uint64_t> b        = makeKeys(c.nb, universe);
+        std::vector<std::uint32_t> indices(std::min(a.size(), b.size()));
+
+        const std::uint64_t* pa = a.data();
+        const std::uint64_t* pb = b.data();
+
+        std::size_t nScalar  = 0;
+        std::size_t nIndexed = 0;
+        std::size_t nCount   = 0;
+        double      scalarNs = measure([&] {
+            nScalar = intersectSortedScalar(pa, a.size(), pb, b.size(), indices.data(), nullptr);
+        });
+        double indexedNs = measure([&] {
+            nIndexed = intersectSorted(pa, a.size(), pb, b.size(), indices.data(), nullptr);
+        });
+        double countNs = measure([&] {
+            nCount = intersectSorted(pa, a.size(), pb, b.size(), nullptr, nullptr);
+        });
+        if ( nScalar != nIndexed || nScalar != nCount ) {
+            std::fprintf(stderr, "%s: mismatch %zu, %zu, %zu\n", c.name, nScalar, nIndexed, nCount);
+            return 1;
+        }
+
+        std::fprintf(
+            stdout,
+            "%-6s %7zu %7zu %8zu %13.1f %14.1f %12.1f\n",
+            c.name,
+            a.size(),
+            b.size(),
+            nScalar,
+            scalarNs,
+            indexedNs,
+            countNs
+        );
+    }
+
+    return 0;
+}
+
+//! BulkReader の読み込み方法ごとの速さを、ページキャッシュを捨てた状態から測る (デバッグ用)
+//!
+//! @return 成功なら 0
+int benchRead(const std::vector<std::string>& paths)
+{
+    struct Case {
+        const char*        name;
+        BulkReader::Backend backend;
+    };
+    static const Case kCases[] = {
+        { "read", BulkReader::Backend::kRead },
+        { "io_uring", BulkReader::Backend::kUring },
+    };
+
+    std::fprintf(stdout, "backend     files        MiB    seconds      MiB/s\n");
+    for ( const Case& c : kCases ) {
+        // ページキャッシュから捨てる (ほかに開いている人がいなければ消える)
+        for ( const std::string& path : paths ) {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if ( fd < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) ) {
+                std::fprintf(stderr, "%s: cannot drop the page cache\n", path.c_str());
+            }
+            if ( fd >= 0 ) {
+                close(fd);
+            }
+        }
+
+        auto       start = std::chrono::steady_clock::now();
+        BulkReader reader(paths, c.backend);
+        if ( ! reader.start() ) {
+            std::fprintf(stdout, "%-8s unavailable\n", c.name);
+            continue;
+        }
+
+        std::unique_ptr<BulkFile> file;
+        std::size_t               nFiles = 0;
+        std::size_t               nBytes = 0;
+        while ( reader.next(file) ) {
+            if ( file->error ) {
+                std::fprintf(stderr, "%s: %s\n", file->path.c_str(), std::strerror(file->error));
+                return 1;
+            }
+            nFiles += 1;
+            nBytes += file->data.size();
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                             .count();
+        double mib     = nBytes / (1024.0 * 1024.0);
+        std::fprintf(
+            stdout,
+            "%-8s %8zu %10.1f %10.3f %10.1f\n",
+            c.name,
+            nFiles,
+            mib,
+            seconds,
+            mib / seconds
+        );
+    }
+
+    return 0;
+}
+
+//! 全フレームを比べる検出と frameStride おきに飛ばす検出を比べる (デバッグ用)
+//!
+//! @return 成功して切れ目がすべて一致し、4-bit に詰めたフレームの検出とハッシュも一致すれば 0
+//!
+//! 詰めたフレームの検出の速さと、保管庫の圧縮率も出力する。
+int benchDetect(const char* path, int frameRate, int frameStride)
+{
+    BulkReader reader({ path }, BulkReader::Backend::kRead);
+    reader.start();
+
+    std::unique_ptr<BulkFile> file;
+    if ( ! reader.next(file) || file->error ) {
+        std::fprintf(stderr, "%s: %s\n", path, std::strerror(file ? file->error : EIO));
+        return 1;
+    }
+    std::size_t nFrames = file->data.size() / kFrameSize;
+    for ( std::uint8_t& pixel : file->data ) {
+        pixel &= 0xF0;
+    }
+
+    auto start   = std::chrono::steady_clock::now();
+    auto elapsed = [&] {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    std::vector<std::uint8_t> packed(nFrames * kPackedFrameSize);
+    start = std::chrono::steady_clock::now();
+    packFrames(file->data.data(), nFrames, packed.data());
+    double packSeconds = elapsed();
+
+    FrameArchiveBuilder archive;
+    start = std::chrono::steady_clock::now();
+    archive.add(file->data.data(), nFrames);
+    archive.finish();
+    double      compressSeconds = elapsed();
+    std::size_t archiveSize     = 0;
+    for ( const std::vector<std::uint8_t>& block : archive.blocks() ) {
+        archiveSize += block.size();
+    }
+
+    FrameClock clock(frameRate);
+    struct Result {
+        std::vector<std::uint32_t> boundaries;
+        std::vector<Hash>          hashes;
+        std::size_t                nComparisons;
+        double                     seconds;
+    };
+    auto detect = [&](int stride, bool isPacked) {
+        Result        result;
+        SceneDetector detector(
+            clock,
+            HashType::kHashCrc64,
+            stride,
+            [&](const SceneId&      sceneId,
+                std::uint32_t       iFirstFrame,
+                const std::uint8_t*,
+                const std::uint8_t*) {
+                result.boundaries.push_back(iFirstFrame);
+                result.hashes.push_back(sceneId.hash);
+                return true;
+            },
+            isPacked
+        );
+
+        const std::uint8_t* frames    = isPacked ? packed.data() : file->data.data();
+        std::size_t         frameSize = isPacked ? kPackedFrameSize : kFrameSize;
+        start                         = std::chrono::steady_clock::now();
+        for ( std::size_t i = 0; i < nFrames; i += kFramesPerBlock ) {
+            detector.push(&frames[i * frameSize], std::min(kFramesPerBlock, nFrames - i));
+        }
+        detector.finish();
+        result.seconds      = elapsed();
+        result.nComparisons = detector.comparisonCount();
+        return result;
+    };
+
+    Result full   = detect(1, false);
+    Result skip   = detect(frameStride, false);
+    Result onPack = detect(1, true);
+    int    nFound = 0;
+    for ( std::uint32_t boundary : full.boundaries ) {
+        nFound += std::binary_search(skip.boundaries.begin(), skip.boundaries.end(), boundary);
+    }
+
+    std::fprintf(stdout, "stride  comparisons   scenes   seconds\n");
+    std::fprintf(
+        stdout, "%6d %12zu %8zu %9.4f\n", 1, full.nComparisons, full.boundaries.size(), full.seconds
+    );
+    std::fprintf(
+        stdout,
+        "%6d %12zu %8zu %9.4f\n",
+        frameStride,
+        skip.nComparisons,
+        skip.boundaries.size(),
+        skip.seconds
+    );
+    std::fprintf(
+        stdout,
+        "%zu frames, %d of %zu boundaries found, %zu extra\n",
+        nFrames,
+        nFound,
+        full.boundaries.size(),
+        skip.boundaries.size() - nFound
+    );
+
+    bool isPackedSame = onPack.boundaries == full.boundaries && onPack.hashes == full.hashes;
+    std::fprintf(
+        stdout,
+        "packed: %s, detected in %.4f s (%.0f MiB/s), packed in %.4f s\n",
+        isPackedSame ? "same scenes" : "DIFFERENT scenes",
+        onPack.seconds,
+        double(packed.size()) / onPack.seconds / (1024 * 1024),
+        packSeconds
+    );
+    std::fprintf(
+        stdout,
+        "archive: %zu bytes (%.1f%% of packed) in %zu blocks, compressed in %.4f s\n",
+        archiveSize,
+        packed.empty() ? 0.0 : 100.0 * double(archiveSize) / double(packed.size()),
+        archive.blocks().size(),
+        compressSeconds
+    );
+
+    return nFound == int(full.boundaries.size()) && skip.boundaries.size() == full.boundaries.size()
+            && isPackedSame
+        ? 0
+        : 1;
+}
+
+#endif // VIDUP_DEBUG_COMMANDS
+
+//! コミットを待っている vidup_similar() の索引への変更
+struct AnnChange {
+    std::string                     name;
+    FileId                          fileId; //!< 削除なら -1
+    std::shared_ptr<const AnnEntry> entry;  //!< 削除なら nullptr
+};
+
+//! C API のハンドル
+struct vidup {
+    std::mutex        mutex; //!< 関数の呼び出しを直列化する (vidup_similar() は取らない)
+    sqlite3*          db = nullptr;
+    fs::path          dbPath;
+    HashType          hashType    = HashType::kHashCrc32;
+    int               frameStride = 1;
+    std::atomic<bool> isOutdated { false }; //!< vidup_init() しか使えない
+    Throttle          throttle;
+
+    SearchCache searchCache; //!< vidup_search() の結果
+
+    std::atomic<bool> isInterrupted { false }; //!< vidup_interrupt() された
+
+    RcuCell<AnnSnapshot>   ann;                  //!< vidup_similar() の索引 (初めて探すときに作る)
+    std::vector<AnnChange> annPending;           //!< コミットを待っている変更
+    std::thread            annMerger;            //!< overrides を base にまとめるスレッド
+    bool                   isAnnMerging = false; //!< annMerger がまとめている
+
+    //! ann の書き手を直列化する (mutex と両方取るときは mutex を先に取る)
+    std::mutex    annMutex;
+    std::uint64_t annCommits   = 0;     //!< 索引に関わるコミットの数 (annMutex)
+    bool          hasAnnMisses = false; //!< 索引がない間の変更がコミットを待っている
+    std::mutex    annLoadMutex;         //!< vidup_similar() が索引を作るのを直列化する
+};
+
+//! C API の結果の列
+struct vidup_results {
+    std::vector<std::string>  names; //!< results が指すファイル名
+    std::vector<vidup_result> results;
+    bool                      isPartial = false; //!< 期限までに調べきれなかった
+};
+
+//! 古いスキーマの DB に追加されたテーブルを埋める
+//!
+//! @return 成功なら 0
+static int upgradeDatabase(sqlite3* db, std::int64_t schemaVersion)
+{
+    std::fprintf(
+        stderr,
+        "upgrading database from version %lld to %lld\n",
+        static_cast<long long>(schemaVersion),
+        static_cast<long long>(kSchemaVersion)
+    );
+
+    if ( execSql(db, "BEGIN") ) {
+        return 1;
+    }
+
+    bool failed = false;
+    if ( schemaVersion < 1 ) {
+        failed = failed || rebuildPostings(db);
+    }
+    // version 9 で要約のバケットを加えた
+    if ( schemaVersion < 9 ) {
+        failed = failed || rebuildSketches(db);
+    }
+    // version 4 のサムネイルは動画がないと作れないので、古いファイルにはない
+    // version 5 の保管庫も --archive で登録したファイルにしかない
+    if ( schemaVersion < 6 ) {
+        failed = failed || rebuildFrequencies(db);
+    }
+    // version 7 の検索結果のキャッシュと version 8 の途中の状態は空から始める
+    failed = failed || setMeta(db, "schema_version", kSchemaVersion);
+
+    if ( failed ) {
+        execSql(db, "ROLLBACK");
+        return 1;
+    }
+
+    return execSql(db, "COMMIT") ? 1 : 0;
+}
+
+//! meta テーブルの設定をハンドルに読み込む
+//!
+//! @return vidup_status
+static int loadMeta(vidup& handle)
+{
+    // meta テーブルがない DB は最初のバージョン
+    bool hasMeta = false;
+    if ( hasTable(handle.db, "meta", hasMeta) ) {
+        return VIDUP_ERROR;
+    }
+    std::int64_t schemaVersion = 0;
+    if ( hasMeta && getMeta(handle.db, "schema_version", schemaVersion, 0) ) {
+        return VIDUP_ERROR;
+    }
+    handle.isOutdated = schemaVersion < kSchemaVersion;
+    if ( handle.isOutdated ) {
+        return VIDUP_OUTDATED;
+    }
+
+    std::int64_t hashBits = 0;
+    if ( getMeta(handle.db, "hash_bits", hashBits, HashType::kHashCrc32) ) {
+        return VIDUP_ERROR;
+    }
+    if ( hashBits != HashType::kHashCrc32 && hashBits != HashType::kHashCrc64 ) {
+        std::fprintf(stderr, "unknown hash_bits: %lld\n", static_cast<long long>(hashBits));
+        return VIDUP_ERROR;
+    }
+    handle.hashType = HashType(hashBits);
+
+    // シーンハッシュに含めるフレームの間隔
+    std::int64_t frameStride = 1;
+    if ( getMeta(handle.db, "frame_stride", frameStride, 1) ) {
+        return VIDUP_ERROR;
+    }
+    if ( frameStride < 1 ) {
+        std::fprintf(stderr, "invalid frame_stride: %lld\n", static_cast<long long>(frameStride));
+        return VIDUP_ERROR;
+    }
+    handle.frameStride = int(frameStride);
+
+    return VIDUP_OK;
+}
+
+//! name の登録済みのエントリを取得する
+//!
+//! @return vidup_status (なければ VIDUP_NOT_FOUND)
+static int findFile(vidup& handle, const char* name, FileEntry& entry)
+{
+    if ( getFileEntry(handle.db, name, entry) ) {
+        return VIDUP_ERROR;
+    }
+    return entry.id < 0 ? VIDUP_NOT_FOUND : VIDUP_OK;
+}
+
+//! matches のファイル名を引いて結果の列を作る
+//!
+//! @return vidup_status
+static int makeResults(sqlite3* db, const std::vector<Match>& matches, vidup_results** results)
+{
+    std::unique_ptr<vidup_results> owner(new vidup_results);
+
+    // results から c_str() を指すので先に確保しておく
+    owner->names.reserve(matches.size() * 2);
+    for ( const Match& match : matches ) {
+        fs::path name;
+        fs::path otherName;
+        if ( getFileName(db, match.fileId, name) ) {
+            return VIDUP_ERROR;
+        }
+        if ( match.otherFileId >= 0 && getFileName(db, match.otherFileId, otherName) ) {
+            return VIDUP_ERROR;
+        }
+
+        vidup_result result {};
+        owner->names.push_back(name.string());
+        result.name = owner->names.back().c_str();
+        if ( match.otherFileId >= 0 ) {
+            owner->names.push_back(otherName.string());
+            result.other_name = owner->names.back().c_str();
+        }
+        result.scenes        = match.scenes;
+        result.seconds       = match.seconds;
+        result.distance      = match.distance;
+        result.is_unverified = match.isUnverified;
+        owner->results.push_back(result);
+    }
+
+    *results = owner.release();
+    return VIDUP_OK;
+}
+
+//! snapshot で name に特徴ベクトルが近いファイルを近い順に k 件探して結果の列を作る
+//!
+//! @return name の特徴ベクトルがなければ false
+//!
+//! base は索引で、overrides は総当たりで探す。DB には触れない。
+static bool
+similarFiles(const AnnSnapshot& snapshot, const char* name, int k, vidup_results** results)
+{
+    FileId          fileId = findAnnFile(snapshot, name);
+    const AnnEntry* query  = fileId >= 0 ? getAnnEntry(snapshot, fileId) : nullptr;
+    if ( ! query ) {
+        return false;
+    }
+
+    // 自分自身と overrides で消えたファイルが含まれるので、その分多く探す
+    auto        begin  = std::chrono::steady_clock::now();
+    std::size_t nExtra = 1 + snapshot.overrides.size();
+    auto        nearest = snapshot.base->index.search(
+        query->embedding.data(), k + nExtra, std::max<std::size_t>(k + nExtra, 64)
+    );
+    nearest.erase(
+        std::remove_if(
+            nearest.begin(),
+            nearest.end(),
+            [&](const auto& distanceLabel) {
+                return snapshot.overrides.count(FileId(distanceLabel.second)) != 0;
+            }
+        ),
+        nearest.end()
+    );
+    for ( const auto& change : snapshot.overrides ) {
+        if ( change.second ) {
+            float distance = 0;
+            for ( std::size_t i = 0; i < kEmbeddingSize; i += 1 ) {
+                float d = change.second->embedding[i] - query->embedding[i];
+                distance += d * d;
+            }
+            nearest.emplace_back(distance, std::uint32_t(change.first));
+        }
+    }
+    std::sort(nearest.begin(), nearest.end());
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    debugPrintf(
+        "ann search: %.3f ms\n", std::chrono::duration<double, std::milli>(elapsed).count()
+    );
+
+    std::unique_ptr<vidup_results> owner(new vidup_results);
+    owner->names.reserve(std::size_t(std::max(k, 0)));
+    for ( const auto& distanceLabel : nearest ) {
+        if ( int(owner->results.size()) >= k ) {
+            break;
+        }
+        if ( FileId(distanceLabel.second) == fileId ) {
+            continue;
+        }
+
+        // 壊れた索引ファイルの label は DB にないことがある
+        const AnnEntry* entry = getAnnEntry(snapshot, FileId(distanceLabel.second));
+        if ( ! entry ) {
+            continue;
+        }
+
+        vidup_result result {};
+        owner->names.push_back(entry->name);
+        result.name     = owner->names.back().c_str();
+        result.distance = std::sqrt(distanceLabel.first);
+        owner->results.push_back(result);
+    }
+
+    *results = owner.release();
+    return true;
+}
+
+//! vidup_similar() の索引の版を外す
+//!
+//! 次に探すときに DB から作り直す。
+static void invalidateAnnSnapshot(vidup& handle)
+{
+    std::lock_guard<std::mutex> lock(handle.annMutex);
+    handle.annPending.clear();
+    handle.annCommits += 1;
+    handle.hasAnnMisses = false;
+    handle.ann.publish(nullptr);
+}
+
+//! snapshot の overrides を base にまとめるスレッドを始める
+//!
+//! まとめ終わったら、その間に公開された変更を overrides に残して差し替える。
+//! その間に索引が作り直されていたら捨てる。
+static void startAnnMerge(vidup& handle, const AnnSnapshot& snapshot)
+{
+    // 前のスレッドは isAnnMerging を下ろしたら終わる
+    if ( handle.annMerger.joinable() ) {
+        handle.annMerger.join();
+    }
+
+    // 割り込みのシグナルは読み込み段に届ける (analyzeScenes())
+    InterruptSignalBlocker signalBlocker;
+    handle.isAnnMerging = true;
+    handle.annMerger    = std::thread(
+        [&handle, base = snapshot.base, overrides = snapshot.overrides] {
+            std::shared_ptr<const AnnSnapshot::Base> merged = mergeAnnBase(*base, overrides);
+
+            std::lock_guard<std::mutex> lock(handle.mutex);
+            std::lock_guard<std::mutex> annLock(handle.annMutex);
+            const AnnSnapshot*          current = handle.ann.current();
+            if ( current && current->base == base ) {
+                std::unique_ptr<AnnSnapshot> snapshot(new AnnSnapshot);
+                snapshot->base = merged;
+                for ( const auto& change : current->overrides ) {
+                    auto found = overrides.find(change.first);
+                    if ( found == overrides.end() || found->second != change.second ) {
+                        snapshot->overrides.insert(change);
+                    }
+                }
+                handle.ann.publish(std::move(snapshot));
+            }
+            handle.isAnnMerging = false;
+        }
+    );
+}
+
+//! コミットを待っている変更を反映した索引の版を公開する
+//!
+//! 索引がない間の変更があれば、その間に vidup_similar() が作った索引には入っていないかも
+//! しれないので、索引を外して作り直させる。
+static void publishAnnChanges(vidup& handle)
+{
+    std::lock_guard<std::mutex> lock(handle.annMutex);
+    if ( ! handle.annPending.empty() || handle.hasAnnMisses ) {
+        handle.annCommits += 1;
+    }
+    if ( handle.hasAnnMisses ) {
+        handle.annPending.clear();
+        handle.hasAnnMisses = false;
+        handle.ann.publish(nullptr);
+        return;
+    }
+
+    const AnnSnapshot* current = handle.ann.current();
+    if ( ! current || handle.annPending.empty() ) {
+        handle.annPending.clear();
+        return;
+    }
+
+    std::unique_ptr<AnnSnapshot> snapshot(new AnnSnapshot(*current));
+    for ( AnnChange& change : handle.annPending ) {
+        // 登録し直したファイルは ID が変わるので、古いほうは名前で探して消す
+        FileId oldId = findAnnFile(*snapshot, change.name);
+        if ( oldId >= 0 ) {
+            snapshot->overrides[oldId] = nullptr;
+        }
+        if ( change.entry ) {
+            snapshot->overrides[change.fileId] = std::move(change.entry);
+        }
+    }
+    handle.annPending.clear();
+
+    if ( snapshot->overrides.size() > kAnnMergeThreshold && ! handle.isAnnMerging ) {
+        startAnnMerge(handle, *snapshot);
+    }
+    handle.ann.publish(std::move(snapshot));
+}
+
+//! name の登録か削除を vidup_similar() の索引に伝える
+//!
+//! 索引がまだなければ、変更があったことだけを覚えておく。トランザクションの中ならコミットまで
+//! 溜めておく。DB から読めなければ索引を外す。
+static void recordAnnChange(vidup& handle, const char* name)
+{
+    if ( ! handle.ann.current() ) {
+        handle.hasAnnMisses = true;
+        if ( sqlite3_get_autocommit(handle.db) ) {
+            publishAnnChanges(handle);
+        }
+        return;
+    }
+
+    std::vector<std::pair<FileId, AnnEntry>> entries;
+    if ( getNamedEmbeddings(handle.db, name, entries) ) {
+        invalidateAnnSnapshot(handle);
+        return;
+    }
+
+    AnnChange change { name, -1, nullptr };
+    if ( ! entries.empty() ) {
+        change.fileId = entries[0].first;
+        change.entry  = std::make_shared<const AnnEntry>(std::move(entries[0].second));
+    }
+    handle.annPending.push_back(std::move(change));
+
+    if ( sqlite3_get_autocommit(handle.db) ) {
+        publishAnnChanges(handle);
+    }
+}
+
+//! name を登録し直せる状態にしてエントリを取得する
+//!
+//! @return vidup_status (登録済みで VIDUP_FORCE がなければ VIDUP_EXISTS)
+//!
+//! 登録済みのエントリは消して作り直す。VIDUP_DRY_RUN なら DB を変えない。
+static int prepareFile(sqlite3* db, const char* name, int flags, FileEntry& entry)
+{
+    bool isDryRun = (flags & VIDUP_DRY_RUN) != 0;
+
+    if ( getFileEntry(db, name, entry) ) {
+        return VIDUP_ERROR;
+    }
+    if ( entry.id >= 0 ) {
+        if ( entry.status == FileStatus::kAnalyzed && ! (flags & VIDUP_FORCE) ) {
+            return VIDUP_EXISTS;
+        }
+
+        // どんな状態であろうとエントリが存在するなら消す
+        if ( ! isDryRun && deleteFile(db, entry.id) ) {
+            return VIDUP_ERROR;
+        }
+    }
+
+    if ( ! isDryRun ) {
+        if ( registerFile(db, name) ) {
+            return VIDUP_ERROR;
+        }
+        if ( getFileEntry(db, name, entry) ) {
+            return VIDUP_ERROR;
+        }
+    }
+    return VIDUP_OK;
+}
+
+//! name の解析の途中の状態を取得する
+//!
+//! @return vidup_status
+//!
+//! 解析し終わっていないエントリに途中の状態があれば found に true が入る。
+static int
+findCheckpoint(sqlite3* db, const char* name, FileEntry& entry, Checkpoint& checkpoint, bool& found)
+{
+    found = false;
+    if ( getFileEntry(db, name, entry) ) {
+        return VIDUP_ERROR;
+    }
+    if ( entry.id >= 0 && entry.status != FileStatus::kAnalyzed
+         && getCheckpoint(db, entry.id, checkpoint, found) ) {
+        return VIDUP_ERROR;
+    }
+    return VIDUP_OK;
+}
+
+int vidup_open(const char* path, vidup** handle)
+{
+    *handle           = new vidup;
+    (*handle)->dbPath = path;
+
+    if ( sqlite3_open(path, &(*handle)->db) ) {
+        std::fprintf(stderr, "sqlite3_open: %s\n", sqlite3_errmsg((*handle)->db));
+        return VIDUP_ERROR;
+    }
+    if ( enableForeignKeys((*handle)->db) ) {
+        return VIDUP_ERROR;
+    }
+    sqlite3_busy_timeout((*handle)->db, kBusyTimeoutMs);
+
+    return loadMeta(**handle);
+}
+
+void vidup_close(vidup* handle)
+{
+    if ( ! handle ) {
+        return;
+    }
+    if ( handle->annMerger.joinable() ) {
+        handle->annMerger.join();
+    }
+    sqlite3_close(handle->db);
+    delete handle;
+}
+
+int vidup_init(vidup* handle, int hashBits, int frameStride)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    sqlite3*                    db = handle->db;
+
+    if ( (hashBits != 0 && hashBits != HashType::kHashCrc32 && hashBits != HashType::kHashCrc64)
+         || frameStride < 0 ) {
+        std::fprintf(stderr, "vidup_init: invalid arguments\n");
+        return VIDUP_ERROR;
+    }
+
+    if ( createTables(db) ) {
+        return VIDUP_ERROR;
+    }
+
+    std::int64_t schemaVersion = 0;
+    if ( getMeta(db, "schema_version", schemaVersion, 0) ) {
+        return VIDUP_ERROR;
+    }
+    if ( schemaVersion < kSchemaVersion ) {
+        if ( upgradeDatabase(db, schemaVersion) ) {
+            return VIDUP_ERROR;
+        }
+    }
+
+    // hash_bits がない DB は 32-bit ハッシュで作成されたもの
+    std::int64_t currentHashBits    = 0;
+    std::int64_t currentFrameStride = 1;
+    if ( getMeta(db, "hash_bits", currentHashBits, HashType::kHashCrc32) ) {
+        return VIDUP_ERROR;
+    }
+    if ( getMeta(db, "frame_stride", currentFrameStride, 1) ) {
+        return VIDUP_ERROR;
+    }
+    if ( hashBits == 0 ) {
+        hashBits = int(currentHashBits);
+    }
+    if ( frameStride == 0 ) {
+        frameStride = int(currentFrameStride);
+    }
+    if ( hashBits != currentHashBits || frameStride != currentFrameStride ) {
+        // 既存のシーンと比較できなくなるので、空の DB でしか変更できない
+        std::int64_t nScenes = 0;
+        if ( countAllScenes(db, nScenes) ) {
+            return VIDUP_ERROR;
+        }
+        if ( nScenes > 0 ) {
+            std::fprintf(stderr, "cannot change the hash type of a non-empty database.\n");
+            return VIDUP_ERROR;
+        }
+    }
+
+    if ( setMeta(db, "hash_bits", hashBits) || setMeta(db, "frame_stride", frameStride) ) {
+        return VIDUP_ERROR;
+    }
+    invalidateAnnSnapshot(*handle);
+    return loadMeta(*handle);
+}
+
+void vidup_set_verbose(int isVerbose)
+{
+    g_isVerbose = isVerbose != 0;
+}
+
+int vidup_set_trace(const char* path)
+{
+    return traceStart(path) ? VIDUP_ERROR : VIDUP_OK;
+}
+
+int vidup_set_throttle(
+    vidup* handle, double cpuShare, double readBytesPerSecond, double scenesPerSecond
+)
+{
+    if ( cpuShare < 0 || readBytesPerSecond < 0 || scenesPerSecond < 0 ) {
+        std::fprintf(stderr, "vidup_set_throttle: invalid arguments\n");
+        return VIDUP_ERROR;
+    }
+
+    handle->throttle.cpu.setShare(cpuShare);
+    handle->throttle.input.setRate(readBytesPerSecond);
+    handle->throttle.write.setRate(scenesPerSecond);
+    return VIDUP_OK;
+}
+
+void vidup_interrupt(vidup* handle)
+{
+    // シグナルハンドラから呼ばれるのでロックしない
+    handle->isInterrupted.store(true);
+}
+
+int vidup_is_registered(vidup* handle, const char* name, int* isRegistered)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    if ( handle->isOutdated ) {
+        return VIDUP_OUTDATED;
+    }
+
+    FileEntry entry {};
+    if ( getFileEntry(handle->db, name, entry) ) {
+        return VIDUP_ERROR;
+    }
+    *isRegistered = entry.id >= 0 && entry.status == FileStatus::kAnalyzed;
+    return VIDUP_OK;
+}
+
+int vidup_register(
+    vidup*            handle,
+    const char*       name,
+    int               frameRate,
+    const double*     timestamps,
+    size_t            nTimestamps,
+    vidup_read_frames read,
+    void*             context,
+    int               flags,
+    unsigned*         sceneCount
+)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    sqlite3*                    db       = handle->db;
+    bool                        isDryRun = (flags & VIDUP_DRY_RUN) != 0;
+
+    if ( handle->isOutdated ) {
+        return VIDUP_OUTDATED;
+    }
+    if ( frameRate <= 0 ) {
+        std::fprintf(stderr, "invalid frame rate: %d\n", frameRate);
+        return VIDUP_ERROR;
+    }
+
+    if ( (flags & VIDUP_RESUME) && (flags & VIDUP_ARCHIVE) ) {
+        std::fprintf(stderr, "VIDUP_RESUME cannot be used with VIDUP_ARCHIVE.\n");
+        return VIDUP_ERROR;
+    }
+
+    // 途中の状態があればエントリを消さずに続きから解析する
+    FileEntry  fileEntry {};
+    Checkpoint checkpoint;
+    bool       isResuming = false;
+    if ( flags & VIDUP_RESUME ) {
+        if ( int status = findCheckpoint(db, name, fileEntry, checkpoint, isResuming); status ) {
+            return status;
+        }
+    }
+    if ( ! isResuming ) {
+        if ( int status = prepareFile(db, name, flags, fileEntry); status ) {
+            return status;
+        }
+    }
+
+    std::uint32_t nScenes = 0;
+    FrameReader   reader  = [&](std::uint8_t* dest, std::size_t maxFrames) {
+        return read(context, dest, maxFrames);
+    };
+    FrameClock clock(frameRate, std::vector<double>(timestamps, timestamps + nTimestamps));
+    int        status = analyzeScenes(
+        isDryRun ? nullptr : db,
+        reader,
+        fileEntry.id,
+        clock,
+        handle->hashType,
+        handle->frameStride,
+        (flags & VIDUP_ARCHIVE) != 0,
+        (flags & VIDUP_CHECKPOINT) != 0,
+        isResuming ? &checkpoint : nullptr,
+        handle->throttle,
+        handle->isInterrupted,
+        nScenes
+    );
+
+    // 失敗しても古いエントリは消えている
+    if ( ! isDryRun ) {
+        recordAnnChange(*handle, name);
+    }
+    if ( status ) {
+        return status;
+    }
+
+    if ( sceneCount ) {
+        *sceneCount = nScenes;
+    }
+    return VIDUP_OK;
+}
+
+int vidup_checkpoint(vidup* handle, const char* name, uint32_t* frameIndex)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    if ( handle->isOutdated ) {
+        return VIDUP_OUTDATED;
+    }
+
+    FileEntry  entry {};
+    Checkpoint checkpoint;
+    bool       found = false;
+    if ( int status = findCheckpoint(handle->db, name, entry, checkpoint, found); status ) {
+        return status;
+    }
+    *frameIndex = found ? checkpoint.iFrame : 0;
+    return VIDUP_OK;
+}
+
+int vidup_register_frames(
+    vidup*         handle,
+    const char*    name,
+    const uint8_t* frames,
+    size_t         nFrames,
+    int            frameRate,
+    int            flags,
+    unsigned*      sceneCount
+)
+{
+    vidup_analyzer* analyzer = nullptr;
+    int             status   = vidup_analyzer_begin(
+        handle, name, frameRate, nullptr, 0, flags, nullptr, nullptr, &analyzer
+    );
+    if ( ! status ) {
+        status = vidup_analyzer_push(analyzer, frames, nFrames);
+    }
+    if ( ! status ) {
+        status = vidup_analyzer_finish(analyzer, sceneCount);
+    }
+
+    vidup_analyzer_free(analyzer);
+    return status;
+}
+
+//! C API の push で解析するハンドル
+struct vidup_analyzer {
+    vidup*                         handle;
+    std::string                    name;
+    int                            flags;
+    std::unique_ptr<SceneAnalyzer> analyzer;
+    bool                           failed = false; //!< push() が失敗した
+};
+
+int vidup_analyzer_begin(
+    vidup*               handle,
+    const char*          name,
+    int                  frameRate,
+    const double*        timestamps,
+    size_t               nTimestamps,
+    int                  flags,
+    vidup_scene_callback onScene,
+    void*                context,
+    vidup_analyzer**     analyzer
+)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+
+    *analyzer = nullptr;
+    if ( handle->isOutdated ) {
+        return VIDUP_OUTDATED;
+    }
+    if ( frameRate <= 0 ) {
+        std::fprintf(stderr, "invalid frame rate: %d\n", frameRate);
+        return VIDUP_ERROR;
+    }
+
+    // 解析してから登録済みだとわかっても無駄になるので先に調べる
+    FileEntry entry {};
+    if ( getFileEntry(handle->db, name, entry) ) {
+        return VIDUP_ERROR;
+    }
+    if ( entry.status == FileStatus::kAnalyzed && ! (flags & VIDUP_FORCE) ) {
+        return VIDUP_EXISTS;
+    }
+
+    SceneAnalyzer::SceneHandler handler;
+    if ( onScene ) {
+        handler = [onScene, context](const SceneId& sceneId, std::uint32_t iFirstFrame) {
+            onScene(context, sceneId.hash, sceneId.durationMs, iFirstFrame);
+        };
+    }
+    std::unique_ptr<vidup_analyzer> owner(new vidup_analyzer);
+    owner->handle = handle;
+    owner->name   = name;
+    owner->flags  = flags;
+    owner->analyzer.reset(new SceneAnalyzer(
+        frameRate,
+        std::vector<double>(timestamps, timestamps + nTimestamps),
+        handle->hashType,
+        handle->frameStride,
+        (flags & VIDUP_ARCHIVE) && ! (flags & VIDUP_DRY_RUN),
+        handle->throttle,
+        handle->isInterrupted,
+        std::move(handler)
+    ));
+
+    *analyzer = owner.release();
+    return VIDUP_OK;
+}
+
+int vidup_analyzer_push(vidup_analyzer* analyzer, const uint8_t* frames, size_t nFrames)
+{
+    if ( analyzer->failed ) {
+        return VIDUP_ERROR;
+    }
+    if ( ! analyzer->analyzer->push(frames, nFrames) ) {
+        std::fprintf(stderr, "there are fewer timestamps than frames.\n");
+        analyzer->failed = true;
+        return VIDUP_ERROR;
+    }
+    return analyzer->analyzer->isStopped() ? VIDUP_INTERRUPTED : VIDUP_OK;
+}
+
+int vidup_analyzer_finish(vidup_analyzer* analyzer, unsigned* sceneCount)
+{
+    vidup& handle = *analyzer->handle;
+    if ( analyzer->failed ) {
+        return VIDUP_ERROR;
+    }
+    // 割り込まれたら最後のシーンを閉じずに、古いエントリも残す
+    if ( analyzer->analyzer->isStopped() || handle.isInterrupted.load() ) {
+        return VIDUP_INTERRUPTED;
+    }
+    if ( ! analyzer->analyzer->finish() ) {
+        std::fprintf(stderr, "there are fewer timestamps than frames.\n");
+        analyzer->failed = true;
+        return VIDUP_ERROR;
+    }
+
+    if ( ! (analyzer->flags & VIDUP_DRY_RUN) ) {
+        std::lock_guard<std::mutex> lock(handle.mutex);
+
+        FileEntry entry {};
+        int       status = prepareFile(handle.db, analyzer->name.c_str(), analyzer->flags, entry);
+        if ( status ) {
+            return status;
+        }
+        status = analyzer->analyzer->registerTo(handle.db, entry.id);
+        recordAnnChange(handle, analyzer->name.c_str());
+        if ( status ) {
+            return status;
+        }
+    }
+
+    if ( sceneCount ) {
+        *sceneCount = unsigned(analyzer->analyzer->scenes().size());
+    }
+    return VIDUP_OK;
+}
+
+void vidup_analyzer_free(vidup_analyzer* analyzer)
+{
+    delete analyzer;
+}
+
+int vidup_delete(vidup* handle, const char* name)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    if ( handle->isOutdated ) {
+        return VIDUP_OUTDATED;
+    }
+
+    FileEntry entry {};
+    if ( int status = findFile(*handle, name, entry); status ) {
+        return status;
+    }
+    if ( deleteFile(handle->db, entry.id) ) {
+        return VIDUP_ERROR;
+    }
+    recordAnnChange(*handle, name);
+    return VIDUP_OK;
+}
+
+int vidup_begin(vidup* handle)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    return execSql(handle->db, "BEGIN") ? VIDUP_ERROR : VIDUP_OK;
+}
+
+int vidup_commit(vidup* handle)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    if ( execSql(handle->db, "COMMIT") ) {
+        return VIDUP_ERROR;
+    }
+    publishAnnChanges(*handle);
+    return VIDUP_OK;
+}
+
+int vidup_rollback(vidup* handle)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+
+    // 索引と検索結果はトランザクションの中の変更を読んで作ったかもしれないので作り直す。
+    // 取り消した後の search_generation は同じ値にまた進むので、値では見分けられない
+    invalidateAnnSnapshot(*handle);
+    handle->searchCache = SearchCache();
+    return execSql(handle->db, "ROLLBACK") ? VIDUP_ERROR : VIDUP_OK;
+}
+
+int vidup_search(vidup* handle, const char* name, int limit, int flags, vidup_results** results)
+{
+    return vidup_search_timeout(handle, name, limit, flags, 0, results);
+}
+
+int vidup_search_timeout(
+    vidup* handle, const char* name, int limit, int flags, int timeoutMs, vidup_results** results
+)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    if ( handle->isOutdated ) {
+        return VIDUP_OUTDATED;
+    }
+
+    FileEntry          entry {};
+    std::vector<Match> matches;
+    if ( int status = findFile(*handle, name, entry); status ) {
+        return status;
+    }
+    bool isVerifying = (flags & VIDUP_VERIFY) != 0;
+    bool isPartial   = false;
+    VIDUP_PROBE2(query_start, entry.id, limit);
+    bool failed = searchFile(
+        handle->db, handle->searchCache, entry.id, limit, isVerifying, timeoutMs, matches, isPartial
+    );
+    VIDUP_PROBE3(query_end, entry.id, failed ? -1 : int(matches.size()), int(isPartial));
+    if ( failed ) {
+        return VIDUP_ERROR;
+    }
+    if ( int status = makeResults(handle->db, matches, results); status ) {
+        return status;
+    }
+    (*results)->isPartial = isPartial;
+    return VIDUP_OK;
+}
+
+int vidup_top(vidup* handle, int limit, vidup_results** results)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    if ( handle->isOutdated ) {
+        return VIDUP_OUTDATED;
+    }
+
+    std::vector<Match> matches;
+    if ( top(handle->db, limit, matches) ) {
+        return VIDUP_ERROR;
+    }
+    return makeResults(handle->db, matches, results);
+}
+
+int vidup_similar(vidup* handle, const char* name, int k, vidup_results** results)
+{
+    // 索引の版があればロックを取らずに探す
+    {
+        RcuCell<AnnSnapshot>::Reader reader(handle->ann);
+        if ( reader.get() && similarFiles(*reader.get(), name, k, results) ) {
+            return VIDUP_OK;
+        }
+    }
+    if ( handle->isOutdated ) {
+        return VIDUP_OUTDATED;
+    }
+
+    // 索引がなければ作る。登録などで mutex が長く取られていても待たないように、mutex は取らずに
+    // 読み込み専用の接続でコミット済みの特徴ベクトルから作る
+    std::lock_guard<std::mutex> loadLock(handle->annLoadMutex);
+    std::uint64_t               nCommits = 0;
+    {
+        std::lock_guard<std::mutex> lock(handle->annMutex);
+        nCommits = handle->annCommits;
+    }
+
+    sqlite3* db = nullptr;
+    if ( sqlite3_open_v2(handle->dbPath.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) ) {
+        std::fprintf(stderr, "sqlite3_open_v2: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return VIDUP_ERROR;
+    }
+    std::unique_ptr<sqlite3, decltype(&sqlite3_close)> closer(db, sqlite3_close);
+    sqlite3_busy_timeout(db, kBusyTimeoutMs);
+
+    FileEntry entry {};
+    if ( getFileEntry(db, name, entry) ) {
+        return VIDUP_ERROR;
+    }
+    if ( entry.id < 0 ) {
+        return VIDUP_NOT_FOUND;
+    }
+
+    // 待っている間にほかの呼び出しが作っていればそれを使う
+    RcuCell<AnnSnapshot>::Reader reader(handle->ann);
+    const AnnSnapshot*           snapshot = reader.get();
+    std::unique_ptr<AnnSnapshot> loaded;
+    if ( ! snapshot ) {
+        fs::path annPath = fs::path(handle->dbPath).concat(".hnsw");
+        if ( execSql(db, "BEGIN") ) {
+            return VIDUP_ERROR;
+        }
+        int status = loadAnnSnapshot(db, annPath, loaded);
+        execSql(db, "COMMIT");
+        if ( status ) {
+            return VIDUP_ERROR;
+        }
+        snapshot = loaded.get();
+
+        // 作っている間に変更がコミットされていたら、この呼び出しだけで使って公開しない
+        std::lock_guard<std::mutex> lock(handle->annMutex);
+        if ( handle->annCommits == nCommits && ! handle->ann.current() ) {
+            handle->ann.publish(std::move(loaded));
+        }
+    }
+    if ( ! similarFiles(*snapshot, name, k, results) ) {
+        std::fprintf(stderr, "no embedding. register the file again.\n");
+        return VIDUP_ERROR;
+    }
+    return VIDUP_OK;
+}
+
+int vidup_reindex(vidup* handle, int hashBits, int frameStride)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    if ( handle->isOutdated ) {
+        return VIDUP_OUTDATED;
+    }
+    if ( (hashBits != 0 && hashBits != HashType::kHashCrc32 && hashBits != HashType::kHashCrc64)
+         || frameStride < 0 ) {
+        std::fprintf(stderr, "vidup_reindex: invalid arguments\n");
+        return VIDUP_ERROR;
+    }
+
+    HashType hashType = hashBits ? HashType(hashBits) : handle->hashType;
+    int      status   = reindex(
+        handle->db,
+        hashType,
+        frameStride ? frameStride : handle->frameStride,
+        handle->throttle,
+        handle->isInterrupted
+    );
+
+    // 特徴ベクトルも作り直すので索引も作り直す
+    invalidateAnnSnapshot(*handle);
+    if ( status ) {
+        return status;
+    }
+    return loadMeta(*handle);
+}
+
+size_t vidup_results_count(const vidup_results* results)
+{
+    return results->results.size();
+}
+
+const vidup_result* vidup_results_get(const vidup_results* results, size_t i)
+{
+    return i < results->results.size() ? &results->results[i] : nullptr;
+}
+
+int vidup_results_is_partial(const vidup_results* results)
+{
+    return results->isPartial;
+}
+
+void vidup_results_free(vidup_results* results)
+{
+    delete results;
+}
+
+#ifdef VIDUP_DEBUG_COMMANDS
+
+int debugFiles(vidup* handle)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    return files(handle->db) ? 1 : 0;
+}
+
+int debugFileScenes(vidup* handle, const char* name)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+
+    FileEntry entry {};
+    if ( int status = findFile(*handle, name, entry); status ) {
+        return status;
+    }
+    return showFileScenes(handle->db, entry.id, handle->hashType);
+}
+
+int debugArchiveFrames(vidup* handle, const char* name, std::uint32_t iFirstFrame, int nFrames)
+{
+    std::lock_guard<std::mutex> lock(handle->mutex);
+
+    FileEntry entry {};
+    if ( int status = findFile(*handle, name, entry); status ) {
+        return status;
+    }
+    return dumpArchiveFrames(handle->db, entry.id, iFirstFrame, nFrames);
+}
+
+#endif // VIDUP_DEBUG_COMMANDS
@@ -0,0 +1,246 @@
+#pragma once
+
+//! libvidup: 動画の重複検出の C API
+//!
+//! vidup コマンドと同じ DB を読み書きする。関数はハンドルごとにスレッドセーフで、
+//! 同じハンドルへの呼び出しは直列化される。別のハンドルは並行に使える。
+//! 失敗の詳細は標準エラー出力に書く。
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// libvidup は -fvisibility=hidden でビルドし、ここで宣言する関数だけを公開する
+#pragma GCC visibility push(default)
+
+//! 16x16 の 8-bit グレースケールのフレームのバイト数
+#define VIDUP_FRAME_SIZE (16 * 16)
+
+//! DB のハンドル
+typedef struct vidup vidup;
+
+//! 結果の列
+typedef struct vidup_results vidup_results;
+
+//! フレームを受け取りながら解析する
+typedef struct vidup_analyzer vidup_analyzer;
+
+//! 戻り値
+enum vidup_status {
+    VIDUP_OK          = 0,
+    VIDUP_ERROR       = 1, //!< DB のエラーなど
+    VIDUP_NOT_FOUND   = 2, //!< その名前のファイルは登録されていない
+    VIDUP_EXISTS      = 3, //!< すでに登録されている
+    VIDUP_OUTDATED    = 4, //!< DB が古い (vidup_init() で更新する)
+    VIDUP_INTERRUPTED = 5, //!< vidup_interrupt() で止めた
+};
+
+//! vidup_register() と vidup_search() のフラグ
+enum vidup_flags {
+    VIDUP_FORCE   = 1 << 0, //!< 登録済みでも登録し直す
+    VIDUP_ARCHIVE = 1 << 1, //!< フレームを保管庫にも登録する
+    VIDUP_DRY_RUN = 1 << 2, //!< 解析だけして DB に書き込まない
+    VIDUP_VERIFY  = 1 << 3, //!< 検索で一致したシーンをサムネイルでも照合する
+
+    //! 解析の途中の状態を定期的にコミットして、失敗しても VIDUP_RESUME で続けられるようにする
+    //! (トランザクションの外で VIDUP_ARCHIVE なしのときだけ)。コミットはシーンの切れ目でするので、
+    //! 長いシーンはその終わりまでコミットされない
+    VIDUP_CHECKPOINT = 1 << 4,
+
+    //! vidup_checkpoint() のフレームから続きを解析する
+    VIDUP_RESUME = 1 << 5,
+};
+
+//! 結果の 1 件
+typedef struct vidup_result {
+    const char* name;          //!< ファイル名
+    const char* other_name;    //!< vidup_top() の組のもう一方 (ほかは NULL)
+    int         scenes;        //!< 一致したシーン数 (vidup_search())
+    double      seconds;       //!< 一致した秒数 (vidup_search(), vidup_top())
+    double      distance;      //!< 特徴ベクトルの距離 (vidup_similar())
+    int         is_unverified; //!< VIDUP_VERIFY で期限までに照合できず、scenes が照合前なら 1
+} vidup_result;
+
+//! フレームを読み込むコールバック
+//!
+//! VIDUP_FRAME_SIZE バイトのフレームを最大 max_frames 枚 dest に書き、枚数を返す。
+//! 0 を返すと終わり。
+typedef size_t (*vidup_read_frames)(void* context, uint8_t* dest, size_t max_frames);
+
+//! シーンが閉じるたびに呼ばれるコールバック
+//!
+//! hash はシーンハッシュ、first_frame はシーンの先頭のフレーム番号。
+typedef void (*vidup_scene_callback)(
+    void* context, uint64_t hash, uint32_t duration_ms, uint32_t first_frame
+);
+
+//! DB を開く
+//!
+//! @return VIDUP_OK、DB が古ければ VIDUP_OUTDATED (handle は有効で vidup_init() だけ使える)
+//!
+//! 失敗しても *handle は vidup_close() で閉じる。
+int vidup_open(const char* path, vidup** handle);
+
+void vidup_close(vidup* handle);
+
+//! テーブルを作成または更新し、ハッシュのビット数とフレームの間隔を設定する
+//!
+//! hash_bits (32 か 64) と frame_stride は 0 なら今の設定のまま (新しい DB なら 32 と 1)。
+//! シーンが登録された DB では変更できない (vidup_reindex() を使う)。
+int vidup_init(vidup* handle, int hash_bits, int frame_stride);
+
+//! 解析の進み具合などを標準エラー出力に書く
+void vidup_set_verbose(int is_verbose);
+
+//! 登録と検索の段ごとの区間を記録し、プロセスの終了時に path に Chrome trace 形式の JSON で書く
+//!
+//! 区間はスレッドごとのバッファにロックを取らずに記録する。chrome://tracing か Perfetto で開くと、
+//! 読み込み、検出、書き込みの段が重なっている様子や待っている時間がわかる。
+//! NULL なら記録をやめて書き出さない。
+int vidup_set_trace(const char* path);
+
+//! 登録と vidup_reindex() の速さの上限を設定する
+//!
+//! cpu_share はプロセスが使う CPU コア何個分か、read_bytes_per_second は解析するフレームの
+//! バイト数、scenes_per_second は DB に書き込むシーン数で、0 なら制限しない。
+//! 上限を超えた段は補充されるまで待つので、ほかの処理と並べて一定の負荷で取り込める。
+int vidup_set_throttle(
+    vidup* handle, double cpu_share, double read_bytes_per_second, double scenes_per_second
+);
+
+//! 進めている vidup_register()、vidup_register_frames()、vidup_analyzer_*() と vidup_reindex() を
+//! 止める
+//!
+//! ロックを取らないのでシグナルハンドラから呼べる。vidup_register() は読むのをやめ、読み込み済みの
+//! フレームを解析してからそのファイルの変更を取り消す。VIDUP_CHECKPOINT なら最後のシーンの
+//! 切れ目までを途中の状態にコミットするので VIDUP_RESUME で続けられる。
+//! vidup_register_frames() と vidup_analyzer_push() は解析中のブロックの切れ目で止まり、
+//! vidup_analyzer_finish() は何も登録しない (登録中なら取り消す)。vidup_reindex() は
+//! 全体を取り消す。どれも VIDUP_INTERRUPTED を返し、以後の呼び出しもすぐに止まる。
+void vidup_interrupt(vidup* handle);
+
+//! name が登録済みなら *is_registered を 1 にする
+int vidup_is_registered(vidup* handle, const char* name, int* is_registered);
+
+//! read で読んだフレームを解析して name として登録する
+//!
+//! @return 登録済みで VIDUP_FORCE がなければ VIDUP_EXISTS
+//!
+//! timestamps はフレームごとの表示時刻 (ms) で、NULL ならフレームレートから時刻を求める。
+//! 登録したシーン数を *scene_count に書く (NULL なら書かない)。
+int vidup_register(
+    vidup*            handle,
+    const char*       name,
+    int               frame_rate,
+    const double*     timestamps,
+    size_t            timestamp_count,
+    vidup_read_frames read,
+    void*             context,
+    int               flags,
+    unsigned*         scene_count
+);
+
+//! name の VIDUP_CHECKPOINT の解析が途中で止まっていれば、続きを始めるフレーム番号を書く
+//!
+//! 途中の状態がなければ 0 を書く。VIDUP_RESUME の vidup_register() の read はこのフレームから
+//! 読む (フレームレートとタイムスタンプは止まる前と同じにする)。
+int vidup_checkpoint(vidup* handle, const char* name, uint32_t* frame_index);
+
+//! メモリ上の n_frames 枚のフレームをコピーせずに解析して name として登録する
+int vidup_register_frames(
+    vidup*         handle,
+    const char*    name,
+    const uint8_t* frames,
+    size_t         n_frames,
+    int            frame_rate,
+    int            flags,
+    unsigned*      scene_count
+);
+
+//! name として登録するフレームを受け取り始める
+//!
+//! @return 登録済みで VIDUP_FORCE がなければ VIDUP_EXISTS
+//!
+//! vidup_analyzer_push() で渡したフレームはその場で解析し、
+//! 閉じたシーンを on_scene (NULL なら呼ばない) に渡す。DB には vidup_analyzer_finish() で
+//! まとめて登録するので、その間も handle はほかの呼び出しに使える。
+//! 1 つの解析は 1 つのスレッドから使う。
+int vidup_analyzer_begin(
+    vidup*               handle,
+    const char*          name,
+    int                  frame_rate,
+    const double*        timestamps,
+    size_t               timestamp_count,
+    int                  flags,
+    vidup_scene_callback on_scene,
+    void*                context,
+    vidup_analyzer**     analyzer
+);
+
+//! 続きの n_frames 枚のフレームを解析する
+//!
+//! frames は戻ったら再利用してよい。vidup_interrupt() されたら VIDUP_INTERRUPTED を返す。
+int vidup_analyzer_push(vidup_analyzer* analyzer, const uint8_t* frames, size_t n_frames);
+
+//! 最後のシーンを閉じて登録し、登録したシーン数を *scene_count に書く (NULL なら書かない)
+int vidup_analyzer_finish(vidup_analyzer* analyzer, unsigned* scene_count);
+
+//! 解析を破棄する (vidup_analyzer_finish() の前なら何も登録しない)
+void vidup_analyzer_free(vidup_analyzer* analyzer);
+
+int vidup_delete(vidup* handle, const char* name);
+
+//! トランザクションを始める
+//!
+//! 多数の登録を 1 回のコミットにまとめると速い。
+int vidup_begin(vidup* handle);
+int vidup_commit(vidup* handle);
+int vidup_rollback(vidup* handle);
+
+//! name と同じシーンを含むファイルを一致したシーン数の多い順に最大 limit 件探す
+int vidup_search(vidup* handle, const char* name, int limit, int flags, vidup_results** results);
+
+//! timeout_ms ミリ秒の期限付きで vidup_search() をする
+//!
+//! 含まれるファイルの少ないシーンから順に調べ、期限までに見つかった上位を返す。
+//! 調べきれなければ vidup_results_is_partial() が 1 になる。0 なら期限なし。
+//! VIDUP_VERIFY で期限までにサムネイルで照合できなかった結果は is_unverified を 1 にして返す。
+int vidup_search_timeout(
+    vidup* handle, const char* name, int limit, int flags, int timeout_ms, vidup_results** results
+);
+
+//! 同じシーンを含むファイルの組を一致した秒数の多い順に列挙する
+//!
+//! limit は調べるシーン数なので結果の件数とは一致しない。
+int vidup_top(vidup* handle, int limit, vidup_results** results);
+
+//! 特徴ベクトルが name に近いファイルを近い順に k 件探す
+//!
+//! 索引は初めて呼んだときに別の読み込み専用の接続で作ってメモリに置く。作るときも探すときも
+//! ハンドルをロックしないので、ほかのスレッドの登録や削除を待たない。このハンドルでの登録と
+//! 削除はコミットされると反映される。ほかのプロセスの変更は開き直すまで見えない。
+int vidup_similar(vidup* handle, const char* name, int k, vidup_results** results);
+
+//! 保管庫のフレームからすべてのシーンを検出し直す
+//!
+//! hash_bits と frame_stride は 0 なら今の設定のまま。
+int vidup_reindex(vidup* handle, int hash_bits, int frame_stride);
+
+size_t vidup_results_count(const vidup_results* results);
+
+//! i 件目の結果 (vidup_results_free() まで有効)
+const vidup_result* vidup_results_get(const vidup_results* results, size_t i);
+
+//! 期限までに調べきれず、結果が途中までなら 1
+int vidup_results_is_partial(const vidup_results* results);
+
+void vidup_results_free(vidup_results* results);
+
+#pragma GCC visibility pop
+
+#ifdef __cplusplus
+}
+#endif
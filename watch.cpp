@@ -0,0 +1,213 @@
+#include "watch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+#include <utility>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+//! 書き終わったとみなすイベント
+static const std::uint32_t kReadyEvents = IN_CLOSE_WRITE | IN_MOVED_TO;
+
+//! 待っているファイルを取り消すイベント
+static const std::uint32_t kGoneEvents = IN_DELETE | IN_MOVED_FROM;
+
+//! ディレクトリそのものがなくなったイベント
+static const std::uint32_t kSelfEvents = IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED;
+
+DirWatcher::DirWatcher(std::string dir, int debounceMs)
+    : m_Dir(std::move(dir))
+    , m_Debounce(std::max(debounceMs, 0))
+{
+}
+
+DirWatcher::~DirWatcher()
+{
+    if ( m_Fd >= 0 ) {
+        close(m_Fd);
+    }
+}
+
+bool DirWatcher::start()
+{
+    m_Fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ( m_Fd < 0 ) {
+        std::perror("inotify_init1");
+        return false;
+    }
+
+    // 書き足しも見て、書き終わったファイルに続けて書かれたら待ち直す
+    std::uint32_t mask = kReadyEvents | kGoneEvents | IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF
+                       | IN_ONLYDIR;
+    if ( inotify_add_watch(m_Fd, m_Dir.c_str(), mask) < 0 ) {
+        std::fprintf(stderr, "%s: %s\n", m_Dir.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    // 監視を始める前に置かれたファイルを取りこぼさない
+    return scan();
+}
+
+bool DirWatcher::wait(std::vector<std::string>& paths, int timeoutMs)
+{
+    Clock::time_point deadline = timeoutMs < 0
+        ? Clock::time_point::max()
+        : Clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    while ( true ) {
+        Clock::time_point now  = Clock::now();
+        Clock::time_point next = deadline;
+        for ( auto it = m_Pending.begin(); it != m_Pending.end(); ) {
+            PendingFile& file = it->second;
+            if ( file.state == FileState::kWriting ) {
+                ++it;
+                continue;
+            }
+            if ( now - file.time < m_Debounce ) {
+                next = std::min(next, file.time + m_Debounce);
+                ++it;
+                continue;
+            }
+
+            // 前から置かれていたファイルは、変わっていなければ書き終わったとみなす
+            if ( file.state == FileState::kScanned ) {
+                std::uintmax_t size  = 0;
+                std::int64_t   mtime = 0;
+                if ( ! stat(it->first, size, mtime) ) {
+                    it = m_Pending.erase(it);
+                    continue;
+                }
+                if ( size != file.size || mtime != file.mtime ) {
+                    file.time  = now;
+                    file.size  = size;
+                    file.mtime = mtime;
+                    next       = std::min(next, file.time + m_Debounce);
+                    ++it;
+                    continue;
+                }
+            }
+            paths.push_back((fs::path(m_Dir) / it->first).string());
+            it = m_Pending.erase(it);
+        }
+        if ( ! paths.empty() || now >= deadline ) {
+            return true;
+        }
+
+        int pollMs = -1;
+        if ( next != Clock::time_point::max() ) {
+            auto rest = std::chrono::ceil<std::chrono::milliseconds>(next - now);
+            pollMs    = int(rest.count());
+        }
+        pollfd pfd { m_Fd, POLLIN, 0 };
+        int    n = poll(&pfd, 1, pollMs);
+        if ( n < 0 ) {
+            if ( errno == EINTR ) {
+                return true;
+            }
+            std::perror("poll");
+            return false;
+        }
+        if ( n > 0 && ! readEvents() ) {
+            return false;
+        }
+    }
+}
+
+bool DirWatcher::readEvents()
+{
+    alignas(inotify_event) char buffer[4096];
+
+    while ( true ) {
+        ssize_t size = read(m_Fd, buffer, sizeof(buffer));
+        if ( size < 0 ) {
+            if ( errno == EAGAIN ) {
+                return true;
+            }
+            if ( errno == EINTR ) {
+                continue;
+            }
+            std::perror("read inotify");
+            return false;
+        }
+
+        Clock::time_point now = Clock::now();
+        for ( ssize_t offset = 0; offset < size; ) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(&buffer[offset]);
+            offset += ssize_t(sizeof(inotify_event) + event->len);
+
+            if ( event->mask & kSelfEvents ) {
+                std::fprintf(stderr, "\"%s\" was removed or moved.\n", m_Dir.c_str());
+                return false;
+            }
+            if ( event->mask & IN_Q_OVERFLOW ) {
+                // 取りこぼしたイベントがわからないので、ディレクトリを見直す
+                if ( ! scan() ) {
+                    return false;
+                }
+                continue;
+            }
+            if ( (event->mask & IN_ISDIR) || event->len == 0 || event->name[0] == '.' ) {
+                continue;
+            }
+
+            std::string name = event->name;
+            if ( event->mask & kReadyEvents ) {
+                m_Pending[name] = { now, FileState::kClosed };
+            } else if ( event->mask & kGoneEvents ) {
+                m_Pending.erase(name);
+            } else if ( event->mask & IN_MODIFY ) {
+                // 書き足されたら、次に閉じられるまで待つ
+                auto it = m_Pending.find(name);
+                if ( it != m_Pending.end() ) {
+                    it->second.time  = now;
+                    it->second.state = FileState::kWriting;
+                }
+            }
+        }
+    }
+}
+
+bool DirWatcher::scan()
+{
+    std::error_code        error;
+    Clock::time_point      now = Clock::now();
+    fs::directory_iterator it(m_Dir, error);
+    for ( fs::directory_iterator end; ! error && it != end; it.increment(error) ) {
+        // 調べる間に消えたファイルは飛ばす。待っているファイルはそのまま待つ
+        std::error_code statError;
+        std::string     name = it->path().filename().string();
+        if ( name[0] == '.' || ! it->is_regular_file(statError) || m_Pending.count(name) ) {
+            continue;
+        }
+        PendingFile file { now, FileState::kScanned };
+        if ( stat(name, file.size, file.mtime) ) {
+            m_Pending.emplace(name, file);
+        }
+    }
+    if ( error ) {
+        std::fprintf(stderr, "%s: %s\n", m_Dir.c_str(), error.message().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool DirWatcher::stat(const std::string& name, std::uintmax_t& size, std::int64_t& mtime) const
+{
+    struct stat status;
+    if ( ::stat((fs::path(m_Dir) / name).c_str(), &status) != 0 ) {
+        return false;
+    }
+    size  = std::uintmax_t(status.st_size);
+    mtime = std::int64_t(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+    return true;
+}
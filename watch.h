@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+//! ディレクトリに書き終わったファイルを inotify で待つ
+//!
+//! 書き込んで閉じられたか、別の場所から移されたファイルを、最後のイベントから
+//! debounceMs の間なにも起きなければ渡す。続けて書き足されるファイルは閉じられるまで待つ。
+//! 名前が . で始まるファイル (コピー中の一時ファイルなど) は無視する。
+//!
+//! 監視を始める前からあるファイルは閉じられたかどうかわからないので、debounceMs の間に
+//! 大きさも更新時刻も変わらなければ渡す。その間に書き込まれたら閉じられるまで待つ。
+class DirWatcher {
+public:
+    explicit DirWatcher(std::string dir, int debounceMs = 500);
+    ~DirWatcher();
+
+    DirWatcher(const DirWatcher&)            = delete;
+    DirWatcher& operator=(const DirWatcher&) = delete;
+
+    //! 監視を始める
+    //!
+    //! @return 成功なら true
+    //!
+    //! 始める前からあるファイルも一度だけ渡す。
+    bool start();
+
+    //! 落ち着いたファイルを paths に加える
+    //!
+    //! @return 失敗なら false
+    //!
+    //! timeoutMs (負なら無期限) の間に落ち着いたファイルがないか、シグナルで
+    //! 割り込まれたら paths を空のまま戻る。
+    bool wait(std::vector<std::string>& paths, int timeoutMs = -1);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    //! 待っているファイルの状態
+    enum class FileState {
+        kClosed,  //!< 閉じられたか移されたので、落ち着いたら渡す
+        kScanned, //!< ディレクトリを見て見つけたので、大きさと更新時刻が変わらなければ渡す
+        kWriting, //!< 書き込まれているので、閉じられるまで待つ
+    };
+
+    //! 待っているファイル
+    struct PendingFile {
+        Clock::time_point time;      //!< 最後のイベントの時刻
+        FileState         state;     //!< 渡すまでに待つもの
+        std::uintmax_t    size  = 0; //!< kScanned のときに見た大きさ
+        std::int64_t      mtime = 0; //!< kScanned のときに見た更新時刻 (ns)
+    };
+
+    std::string                        m_Dir;
+    std::chrono::milliseconds          m_Debounce;
+    int                                m_Fd = -1;
+    std::map<std::string, PendingFile> m_Pending; //!< ファイル名ごと
+
+    //! name の大きさと更新時刻を取得する
+    //!
+    //! @return 取得できたら true
+    bool stat(const std::string& name, std::uintmax_t& size, std::int64_t& mtime) const;
+
+    //! 届いているイベントをすべて読む
+    //!
+    //! @return 失敗なら false
+    bool readEvents();
+
+    //! ディレクトリにあるファイルをすべて待ちに加える
+    //!
+    //! @return 失敗なら false
+    bool scan();
+};